@@ -0,0 +1,241 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "compress.h"
+
+#include "d2lobby.h"
+#include "lobbymgr.h"
+#include "util.h"
+
+#include <filesystem.h>
+#include <tier1/utlbuffer.h>
+
+#include <inttypes.h>
+#include <zlib.h>
+
+BodyCompressor g_BodyCompressor;
+
+const char *ContentEncodingHeader(ContentEncoding encoding)
+{
+	switch (encoding)
+	{
+	case ContentEncoding::Gzip:
+		return "gzip";
+	default:
+		return nullptr;
+	}
+}
+
+ContentEncoding ContentEncodingFromName(const char *pszName)
+{
+	if (!V_stricmp(pszName, "gzip"))
+		return ContentEncoding::Gzip;
+
+	return ContentEncoding::Identity;
+}
+
+static bool GzipCompress(int level, const char *pData, size_t len, std::vector<uint8> &out)
+{
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	// 15 window bits, +16 for a gzip rather than zlib wrapper.
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return false;
+
+	out.resize(deflateBound(&zs, (uLong)len));
+
+	zs.next_in = (Bytef *)pData;
+	zs.avail_in = (uInt)len;
+	zs.next_out = out.data();
+	zs.avail_out = (uInt)out.size();
+
+	int ret = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+
+	return ret == Z_STREAM_END;
+}
+
+bool CompressBody(ContentEncoding encoding, int level, const char *pData, size_t len, std::vector<uint8> &out)
+{
+	switch (encoding)
+	{
+	case ContentEncoding::Gzip:
+		return GzipCompress(clamp(level, 1, 9), pData, len, out);
+	default:
+		return false;
+	}
+}
+
+void BodyCompressor::Start()
+{
+	m_bStopWorker = false;
+	m_Worker = std::thread(&BodyCompressor::WorkerThread, this);
+}
+
+void BodyCompressor::Stop()
+{
+	if (!m_Worker.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStopWorker = true;
+	}
+	m_WakeWorker.notify_one();
+	m_Worker.join();
+
+	m_Jobs.clear();
+	m_Results.clear();
+}
+
+uint64 BodyCompressor::Submit(const PayloadRef &body, ContentEncoding encoding, int level)
+{
+	Job job;
+	job.ticket = m_NextTicket++;
+	job.body = body;
+	job.encoding = encoding;
+	job.level = level;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Jobs.push_back(job);
+	}
+	m_WakeWorker.notify_one();
+
+	return job.ticket;
+}
+
+void BodyCompressor::Collect(std::vector<Result> &results)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	results.swap(m_Results);
+}
+
+void BodyCompressor::WorkerThread()
+{
+	std::vector<uint8> out;
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	for (;;)
+	{
+		m_WakeWorker.wait(lock, [this] { return m_bStopWorker || m_Jobs.size(); });
+		if (m_bStopWorker)
+			break;
+
+		Job job = m_Jobs.front();
+		lock.unlock();
+
+		Result result;
+		result.ticket = job.ticket;
+		result.encoding = ContentEncoding::Identity;
+
+		double flStart = Plat_FloatTime();
+
+		// Not worth sending compressed unless it actually got smaller.
+		if (CompressBody(job.encoding, job.level, job.body->Data(), job.body->Size(), out) && out.size() < job.body->Size())
+		{
+			result.body = Payload::Copy((const char *)out.data(), out.size());
+			result.encoding = job.encoding;
+
+			// Out of memory. The original goes out uncompressed instead.
+			if (result.body->Size() != out.size())
+			{
+				result.body = PayloadRef();
+				result.encoding = ContentEncoding::Identity;
+			}
+		}
+
+		double flElapsed = Plat_FloatTime() - flStart;
+
+		lock.lock();
+
+		m_Jobs.pop_front();
+		m_BytesIn += job.body->Size();
+		m_BytesOut += result.body ? result.body->Size() : job.body->Size();
+		m_Results.push_back(std::move(result));
+		m_flCompressTime += flElapsed;
+	}
+}
+
+void BodyCompressor::PrintDebug() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	Msg("Body compressor: %u job(s) pending, %" PRIu64 " bytes in, %" PRIu64 " bytes out (%.1f%%), %.1fms spent\n",
+		(uint32)m_Jobs.size(), m_BytesIn, m_BytesOut, m_BytesIn ? (100.0 * m_BytesOut / m_BytesIn) : 100.0, m_flCompressTime * 1000.0);
+}
+
+// Runs each given payload through every compression level and reports the
+// ratio and CPU cost. Recorded sign-out payloads can be found in
+// match_<id>.txt files, or copied out of the server log.
+CON_COMMAND(d2lobby_compression_bench, "d2lobby_compression_bench <file> [file] ... - Measures compression ratio and cost on recorded payloads")
+{
+	if (args.ArgC() < 2)
+	{
+		Msg("d2lobby_compression_bench <file> [file] ...\n");
+		return;
+	}
+
+	// It runs every level many times over on the game thread.
+	if (g_LobbyMgr.IsMatchActive())
+	{
+		Msg("Can't run the compression bench while a match is active\n");
+		return;
+	}
+
+	static const int kIterations = 20;
+
+	for (int i = 1; i < args.ArgC(); ++i)
+	{
+		CUtlBuffer buf;
+		if (!filesystem->ReadFile(args[i], "GAME", buf))
+		{
+			Msg("Couldn't read \"%s\"\n", args[i]);
+			continue;
+		}
+
+		const char *pData = (const char *)buf.Base();
+		size_t len = buf.TellPut();
+
+		Msg("%s: %u bytes\n", args[i], (uint32)len);
+
+		std::vector<uint8> out;
+		for (int level = 1; level <= 9; ++level)
+		{
+			double flStart = Plat_FloatTime();
+			for (int n = 0; n < kIterations; ++n)
+			{
+				CompressBody(ContentEncoding::Gzip, level, pData, len, out);
+			}
+			double flPerRun = (Plat_FloatTime() - flStart) / kIterations;
+
+			Msg("- gzip %d: %u bytes (%.1f%%), %.3fms, %.1f MB/s\n", level, (uint32)out.size(),
+				len ? (100.0 * out.size() / len) : 100.0, flPerRun * 1000.0, flPerRun > 0.0 ? (len / flPerRun) / (1024.0 * 1024.0) : 0.0);
+		}
+	}
+}
@@ -0,0 +1,102 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "payload.h"
+
+#include <basetypes.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+enum class ContentEncoding : uint8
+{
+	Identity,
+	Gzip,
+};
+
+// Value for the Content-Encoding header, or nullptr for Identity.
+const char *ContentEncodingHeader(ContentEncoding encoding);
+
+// Parses a d2lobby_http_compression value. Unknown names give Identity.
+ContentEncoding ContentEncodingFromName(const char *pszName);
+
+// Compresses len bytes of pData into out. Thread safe.
+bool CompressBody(ContentEncoding encoding, int level, const char *pData, size_t len, std::vector<uint8> &out);
+
+// Compresses request bodies on a background thread. Jobs complete in the
+// order they were submitted.
+class BodyCompressor
+{
+public:
+	struct Job
+	{
+		uint64 ticket;
+		PayloadRef body;
+		ContentEncoding encoding;
+		int level;
+	};
+
+	struct Result
+	{
+		uint64 ticket;
+		// Compressed body, or empty if it was left as is.
+		PayloadRef body;
+		ContentEncoding encoding;
+	};
+public:
+	void Start();
+	// Joins the worker. Unfinished jobs are dropped.
+	void Stop();
+
+	uint64 Submit(const PayloadRef &body, ContentEncoding encoding, int level);
+	void Collect(std::vector<Result> &results);
+
+	void PrintDebug() const;
+private:
+	void WorkerThread();
+private:
+	uint64 m_NextTicket = 1;
+
+	// Shared with the worker thread
+	mutable std::mutex m_Mutex;
+	std::condition_variable m_WakeWorker;
+	std::deque<Job> m_Jobs;
+	std::vector<Result> m_Results;
+	bool m_bStopWorker = false;
+
+	uint64 m_BytesIn = 0;
+	uint64 m_BytesOut = 0;
+	double m_flCompressTime = 0.0;
+
+	std::thread m_Worker;
+};
+
+extern BodyCompressor g_BodyCompressor;
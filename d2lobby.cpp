@@ -28,8 +28,12 @@
 #include "d2lobby.h"
 #include "eventlog.h"
 #include "httpmgr.h"
+#include "identity.h"
+#include "livestats.h"
 #include "lobbymgr.h"
 #include "logger.h"
+#include "matchstats.h"
+#include "msgcapture.h"
 #include "pluginsystem.h"
 #include "util.h"
 
@@ -76,7 +80,7 @@ CSteamGameServerAPIContext steamctx;
 
 static bool s_bLieAboutVersion = true;// false;
 
-static ConVar d2lobby_enable_live_stats("d2lobby_enable_live_stats", "1");
+static ConVar d2lobby_shutdown_drain_timeout("d2lobby_shutdown_drain_timeout", "300", FCVAR_RELEASE, "Max seconds to wait for outstanding HTTP requests before quitting");
 
 class BaseAccessor : public IConCommandBaseAccessor
 {
@@ -252,23 +256,25 @@ void D2Lobby::Hook_GameServerSteamAPIActivated()
 	json_object_set_new(pContainer, "ip", json_string(CommandLine()->ParmValue("-ip", "")));
 	json_object_set_new(pContainer, "port", json_integer(CommandLine()->ParmValue("-ip", 0)));
 
-	char *pszOutput = json_dumps(pContainer, JSON_COMPACT);
-	json_decref(pContainer);
+	PayloadRef payload = Payload::FromJSON(pContainer, JSON_COMPACT);
 
-	UTIL_LogToFile("Sending startup message:\n%s\n", pszOutput);
+	UTIL_LogPayloadToFile(*payload, "Sending startup message:\n");
 
-	if (match_post_url.GetString()[0])
-	{
-		g_HTTPManager.PostJSONToMatchUrl(pszOutput);
-	}
+	g_HTTPManager.Post(payload, PayloadKind::Startup, pContainer);
+	json_decref(pContainer);
 
-	free(pszOutput);
+	g_EventLogger.FlushEvents();
 
 	RETURN_META(MRES_IGNORED);
 }
 
 void D2Lobby::Hook_GameFrame(bool, bool, bool)
 {
+	for (auto p : PluginSystems())
+	{
+		p->OnGameFrame();
+	}
+
 	if (m_GameState == DOTA_GAMERULES_STATE_WAIT_FOR_PLAYERS_TO_LOAD)
 	{
 		static float flLastStatusMessageTime = 0.f;
@@ -337,8 +343,14 @@ void D2Lobby::Hook_GameFrame(bool, bool, bool)
 	else if (m_ShutdownState == ShutdownState::ShuttingDown)
 	{
 		if (g_HTTPManager.HasAnyPendingRequests())
-			return;
+		{
+			if (Plat_FloatTime() < m_flShutdownStartTime + d2lobby_shutdown_drain_timeout.GetFloat())
+				return;
+
+			UTIL_LogToFile("Shutdown: giving up on outstanding HTTP requests.\n");
+		}
 
+		g_HTTPManager.LogStats();
 		engine->ServerCommand("quit\n");
 	}
 }
@@ -390,34 +402,12 @@ void D2Lobby::OnGCPlayerFailedToConnect(CMsgDOTAPlayerFailedToConnect &msg)
 	json_object_set_new(m_MatchData, "failed_players", pFailedPlayers);
 	json_object_set_new(m_MatchData, "connected_players", pFailedPlayers);
 
-	SendMatchData();
+	SendMatchData(PayloadKind::LoadFailed);
 	g_LobbyMgr.DeleteLobby();
 
 	BeginShutdown();
 }
 
-void D2Lobby::OnLiveStatsUpdate(CMsgDOTALiveScoreboardUpdate &msg)
-{
-	if (!d2lobby_enable_live_stats.GetBool())
-		return;
-
-	json_t *pJson = parse_msg(&msg);
-	json_object_set_new(pJson, "status", json_string("update"));
-	json_object_set_new(pJson, "match_id", json_integer(g_LobbyMgr.MatchId()));
-
-	char *pszOutput = json_dumps(pJson, JSON_COMPACT);
-
-	UTIL_MsgAndLog("Sending live update:\n%s\n", pszOutput);
-
-	if (match_post_url.GetString()[0])
-	{
-		g_HTTPManager.PostJSONToMatchUrl(pszOutput);
-	}
-
-	json_decref(pJson);
-	free(pszOutput);
-}
-
 void D2Lobby::OnGCMatchSignOut(CMsgGameMatchSignOut &msg)
 {
 	json_t *pAdditionalMessages = json_array();
@@ -459,66 +449,66 @@ void D2Lobby::OnGCMatchSignOut(CMsgGameMatchSignOut &msg)
 	assert(m_MatchData == nullptr);
 	m_MatchData = parse_msg(&msg);
 	json_object_set_new(m_MatchData, "additional_msgs", pAdditionalMessages);
+	json_object_set_new(m_MatchData, "match_stats", g_MatchStats.ToJSON());
 	json_object_set_new(m_MatchData, "status", json_string("completed"));
 	json_object_set_new(m_MatchData, "match_id", json_integer(g_LobbyMgr.MatchId()));
 
-	SendMatchData();
+	SendMatchData(PayloadKind::Completed);
 
 	m_flPreShutdownStartTime = Plat_FloatTime();
 	m_ShutdownState = ShutdownState::PreShutdown;
 }
 
-void D2Lobby::SendMatchData()
+void D2Lobby::SendMatchData(PayloadKind kind)
 {
-	char *pszOutput = json_dumps(m_MatchData, JSON_COMPACT);
+	PayloadRef payload = Payload::FromJSON(m_MatchData, JSON_COMPACT);
 
-	UTIL_MsgAndLog("Sending match data:\n%s\n", pszOutput);
+	UTIL_MsgAndLogPayload(*payload, "Sending match data:\n");
 
-	if (match_post_url.GetString()[0])
+	if (g_HTTPManager.HasSinkFor(kind))
 	{
-		g_HTTPManager.PostJSONToMatchUrl(pszOutput);
+		g_HTTPManager.Post(payload, kind, m_MatchData);
 	}
 	else
 	{
-		UTIL_MsgAndLog("Match url not set, saving match result to match_%" PRIu64 ".txt\n", g_LobbyMgr.MatchId());
+		UTIL_MsgAndLog("No sink takes match results, saving match result to match_%" PRIu64 ".txt\n", g_LobbyMgr.MatchId());
 		FILE *f = fopen(CFmtStr("match_%" PRIu64 ".txt", g_LobbyMgr.MatchId()), "w");
-		fprintf(f, "%s", pszOutput);
+		fwrite(payload->Data(), 1, payload->Size(), f);
 		fclose(f);
 	}
 
 	json_decref(m_MatchData);
-
-	free(pszOutput);
 }
 
 void D2Lobby::BeginShutdown()
 {
 	m_ShutdownState = ShutdownState::ShuttingDown;
+	m_flShutdownStartTime = Plat_FloatTime();
+
+	g_EventLogger.DrainEvents();
 
 	json_t *pContainer = json_object();
 	json_object_set_new(pContainer, "match_id", json_integer(g_LobbyMgr.MatchId()));
 	json_object_set_new(pContainer, "status", json_string("shutdown"));
 
-	char *pszOutput = json_dumps(pContainer, JSON_COMPACT);
-	json_decref(pContainer);
+	PayloadRef payload = Payload::FromJSON(pContainer, JSON_COMPACT);
 
-	UTIL_LogToFile("Sending shutdown message:\n%s\n", pszOutput);
+	UTIL_LogPayloadToFile(*payload, "Sending shutdown message:\n");
 
-	if (match_post_url.GetString()[0])
-	{
-		g_HTTPManager.PostJSONToMatchUrl(pszOutput);
-	}
-
-	free(pszOutput);
+	g_HTTPManager.Post(payload, PayloadKind::Shutdown, pContainer);
+	json_decref(pContainer);
 }
 
 void D2Lobby::Hook_PostEventAbstract_Local(CSplitScreenSlot nSlot, GameEventHandle_t__ *pEvent, const void *pData, unsigned long nSize)
 {
+	g_MessageCapture.OnMessage(pEvent->m_MessageID, pData);
 	g_EventLogger.OnGameEvent(pEvent->m_MessageID, pData);
 }
 
 void D2Lobby::Hook_PostEventAbstract(CSplitScreenSlot nSlot, bool bSendToServer, int nClientCount, const unsigned char *clients, GameEventHandle_t__ *pEvent, const void *pData, unsigned long nSize, NetChannelBufType_t)
 {
+	g_MessageCapture.OnMessage(pEvent->m_MessageID, pData, nClientCount, clients);
+
 	if (pEvent->m_MessageID == DOTA_UM_GamerulesStateChanged)
 	{
 		DOTA_GameState newState = (DOTA_GameState)((CDOTAUserMsg_GamerulesStateChanged *)pData)->state();
@@ -541,6 +531,7 @@ void D2Lobby::Hook_PostEventAbstract(CSplitScreenSlot nSlot, bool bSendToServer,
 
 void D2Lobby::Hook_PostEntityEventAbstract(const CBaseHandle &, GameEventHandle_t__ *pEvent, const void *pData, unsigned long nSize, NetChannelBufType_t)
 {
+	g_MessageCapture.OnMessage(pEvent->m_MessageID, pData);
 	g_EventLogger.OnGameEvent(pEvent->m_MessageID, pData);
 }
 
@@ -549,6 +540,7 @@ void D2Lobby::Hook_OnClientConnected(CEntityIndex index, int userId, const char
 {
 	CSteamID sid(xuid);
 	g_LobbyMgr.OnPlayerConnected(sid);
+	g_PlayerIdentities.OnClientConnected(index, sid, bFakePlayer);
 
 	if (g_LobbyMgr.GetGameState() == DOTA_GAMERULES_STATE_WAIT_FOR_PLAYERS_TO_LOAD)
 	{
@@ -578,6 +570,7 @@ void D2Lobby::Hook_ClientDisconnect(CEntityIndex index, int userId, /* ENetworkD
 {
 	CSteamID sid(xuid);
 	g_LobbyMgr.OnPlayerDisconnected(xuid);
+	g_PlayerIdentities.OnClientDisconnected(index, sid);
 
 	if (g_LobbyMgr.GetGameState() == DOTA_GAMERULES_STATE_WAIT_FOR_PLAYERS_TO_LOAD)
 	{
@@ -39,6 +39,7 @@
 struct json_t;
 class CMsgDOTAPlayerFailedToConnect;
 class CMsgGameMatchSignOut;
+enum class PayloadKind : uint8;
 
 
 #if defined WIN32 && !defined snprintf
@@ -65,11 +66,10 @@ private:
 	bool InitGlobals(char *error, size_t maxlen);
 	void InitHooks();
 	void ShutdownHooks();
-	void SendMatchData();
+	void SendMatchData(PayloadKind kind);
 	void BeginShutdown();
 public:
 	void OnGCPlayerFailedToConnect(CMsgDOTAPlayerFailedToConnect &msg);
-	void OnLiveStatsUpdate(CMsgDOTALiveScoreboardUpdate &msg);
 	void OnGCMatchSignOut(CMsgGameMatchSignOut &msg);
 public:
 	int Hook_GetBuildVersion() const;
@@ -98,6 +98,7 @@ private:
 		ShuttingDown,
 	};
 	float m_flPreShutdownStartTime = 0.0f;
+	float m_flShutdownStartTime = 0.0f;
 	ShutdownState m_ShutdownState = ShutdownState::None;
 };
 
@@ -0,0 +1,531 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "detour.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined( __x86_64__ ) || defined( _M_X64 )
+
+// jmp rel32
+static const size_t kNearJumpSize = 5;
+// jmp qword ptr [rip+0], followed by the address
+static const size_t kAbsJumpSize = 14;
+static const size_t kStubSize = 64;
+static const size_t kTrampolineOffset = 16;
+// Stubs are kept well inside the reach of a rel32 from the target, so that
+// relocated rip-relative operands still reach what they pointed at.
+static const int64 kMaxStubDistance = 0x40000000;
+
+static void WriteAbsJump(uint8 *p, const void *pDest)
+{
+	p[0] = 0xFF;
+	p[1] = 0x25;
+	memset(p + 2, 0, 4);
+	uint64 dest = (uint64)pDest;
+	memcpy(p + 6, &dest, sizeof(dest));
+}
+
+static bool IsNear(const void *p, const void *pTarget)
+{
+	int64 distance = (int64)((intptr_t)p - (intptr_t)pTarget);
+	return distance > -kMaxStubDistance && distance < kMaxStubDistance;
+}
+
+// Length of the instruction at p, or 0 if it isn't one that can be moved.
+// relOffset is set to the offset of a rel32 operand relative to the end of
+// the instruction (a branch target or a rip-relative address), or -1.
+//
+// Only covers what compilers put in function prologues. Anything else,
+// including short branches, makes the detour fail to create.
+static size_t InstructionLength(const uint8 *pStart, int &relOffset)
+{
+	const uint8 *p = pStart;
+	bool bOperand16 = false;
+	bool bRexW = false;
+	relOffset = -1;
+
+	for (;;)
+	{
+		uint8 b = *p;
+		if (b == 0x66)
+		{
+			bOperand16 = true;
+		}
+		else if (b != 0x67 && b != 0xF2 && b != 0xF3 && b != 0xF0 && b != 0x2E && b != 0x36 && b != 0x3E && b != 0x26 && b != 0x64 && b != 0x65)
+		{
+			break;
+		}
+		++p;
+	}
+
+	if ((*p & 0xF0) == 0x40)
+	{
+		bRexW = (*p & 0x08) != 0;
+		++p;
+	}
+
+	size_t immOperand = bOperand16 ? 2 : 4;
+	size_t immSize = 0;
+	bool bModRM = false;
+	bool bRel = false;
+	// F6 and F7 only take an immediate for test (/0 and /1).
+	int testImmediate = 0;
+
+	uint8 op = *p++;
+	if (op == 0x0F)
+	{
+		uint8 op2 = *p++;
+		if (op2 >= 0x80 && op2 <= 0x8F)
+		{
+			immSize = 4;
+			bRel = true;
+		}
+		else if (op2 == 0x05 || op2 == 0x0B || op2 == 0x31 || op2 == 0xA2 || (op2 >= 0xC8 && op2 <= 0xCF))
+		{
+		}
+		else if (op2 == 0x38)
+		{
+			++p;
+			bModRM = true;
+		}
+		else if (op2 == 0x3A)
+		{
+			++p;
+			bModRM = true;
+			immSize = 1;
+		}
+		else if ((op2 >= 0x70 && op2 <= 0x73) || op2 == 0xA4 || op2 == 0xAC || op2 == 0xBA || op2 == 0xC2 || (op2 >= 0xC4 && op2 <= 0xC6))
+		{
+			bModRM = true;
+			immSize = 1;
+		}
+		else
+		{
+			bModRM = true;
+		}
+	}
+	else if (op < 0x40)
+	{
+		switch (op & 7)
+		{
+		case 0: case 1: case 2: case 3:
+			bModRM = true;
+			break;
+		case 4:
+			immSize = 1;
+			break;
+		case 5:
+			immSize = immOperand;
+			break;
+		default:
+			return 0;
+		}
+	}
+	else if ((op >= 0x50 && op <= 0x5F) || (op >= 0x90 && op <= 0x99) || op == 0xC3 || op == 0xC9 || op == 0xCC)
+	{
+	}
+	else if (op == 0x63 || (op >= 0x84 && op <= 0x8F) || (op >= 0xD0 && op <= 0xD3) || op == 0xFE || op == 0xFF)
+	{
+		bModRM = true;
+	}
+	else if (op == 0x69 || op == 0x81 || op == 0xC7)
+	{
+		bModRM = true;
+		immSize = immOperand;
+	}
+	else if (op == 0x6B || op == 0x80 || op == 0x83 || op == 0xC0 || op == 0xC1 || op == 0xC6)
+	{
+		bModRM = true;
+		immSize = 1;
+	}
+	else if (op == 0x68 || op == 0xA9)
+	{
+		immSize = immOperand;
+	}
+	else if (op == 0x6A || op == 0xA8 || (op >= 0xB0 && op <= 0xB7))
+	{
+		immSize = 1;
+	}
+	else if (op >= 0xB8 && op <= 0xBF)
+	{
+		immSize = bRexW ? 8 : immOperand;
+	}
+	else if (op == 0xC2)
+	{
+		immSize = 2;
+	}
+	else if (op == 0xE8 || op == 0xE9)
+	{
+		immSize = 4;
+		bRel = true;
+	}
+	else if (op == 0xF6 || op == 0xF7)
+	{
+		bModRM = true;
+		testImmediate = op == 0xF6 ? 1 : (int)immOperand;
+	}
+	else
+	{
+		return 0;
+	}
+
+	if (bModRM)
+	{
+		uint8 modrm = *p++;
+		int mod = modrm >> 6;
+		int reg = (modrm >> 3) & 7;
+		int rm = modrm & 7;
+
+		if (testImmediate && reg < 2)
+		{
+			immSize = testImmediate;
+		}
+
+		if (mod != 3)
+		{
+			size_t disp = 0;
+			if (rm == 4)
+			{
+				uint8 sib = *p++;
+				if (mod == 0 && (sib & 7) == 5)
+				{
+					disp = 4;
+				}
+			}
+			else if (mod == 0 && rm == 5)
+			{
+				// Rip-relative. Measured from the end, so the immediate
+				// goes between.
+				relOffset = -(int)(4 + immSize);
+				disp = 4;
+			}
+
+			if (mod == 1)
+			{
+				disp = 1;
+			}
+			else if (mod == 2)
+			{
+				disp = 4;
+			}
+
+			p += disp;
+		}
+	}
+
+	p += immSize;
+
+	if (bRel)
+	{
+		relOffset = -4;
+	}
+
+	return p - pStart;
+}
+
+// The unit memory protection is changed in.
+static size_t PageSize()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+#else
+	return (size_t)sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// What an address passed to VirtualAlloc or mmap has to be aligned to.
+// Coarser than a page on Windows.
+static size_t AllocationGranularity()
+{
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwAllocationGranularity;
+#else
+	return PageSize();
+#endif
+}
+
+static void *TryAllocateAt(uintptr_t address, size_t size)
+{
+#ifdef _WIN32
+	return VirtualAlloc((void *)address, size, MEM_COMMIT | MEM_RESERVE, PAGE_EXECUTE_READWRITE);
+#else
+	void *p = mmap((void *)address, size, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return p != MAP_FAILED ? p : nullptr;
+#endif
+}
+
+static void FreeStub(void *p, size_t size)
+{
+#ifdef _WIN32
+	VirtualFree(p, 0, MEM_RELEASE);
+#else
+	munmap(p, size);
+#endif
+}
+
+// Tries addresses moving outward from the target until one is free.
+static uint8 *AllocateNear(const void *pTarget, size_t size)
+{
+	size_t granularity = AllocationGranularity();
+	uintptr_t base = (uintptr_t)pTarget & ~(uintptr_t)(granularity - 1);
+	const uintptr_t step = 1024 * 1024;
+
+	for (uintptr_t delta = 0; delta < (uintptr_t)kMaxStubDistance; delta += step)
+	{
+		for (int dir = 0; dir < 2; ++dir)
+		{
+			if (dir == 0 && delta > base)
+				continue;
+
+			uintptr_t address = dir == 0 ? base - delta : base + delta;
+			void *p = TryAllocateAt(address, size);
+			if (!p)
+				continue;
+
+			if (IsNear(p, pTarget))
+				return (uint8 *)p;
+
+			FreeStub(p, size);
+		}
+	}
+
+	return nullptr;
+}
+
+// Writes up to 8 bytes of code. When they fall within one aligned qword
+// they are written with a single atomic store, so a thread running through
+// the target sees either the old or the new instruction.
+static bool WriteCode(uint8 *pDest, const uint8 *pBytes, size_t len)
+{
+	uintptr_t aligned = (uintptr_t)pDest & ~(uintptr_t)7;
+	size_t pageSize = PageSize();
+	uintptr_t page = (uintptr_t)pDest & ~(uintptr_t)(pageSize - 1);
+	size_t protectLen = (uintptr_t)pDest + len - page;
+
+#ifdef _WIN32
+	DWORD oldProtect;
+	if (!VirtualProtect((void *)page, protectLen, PAGE_EXECUTE_READWRITE, &oldProtect))
+		return false;
+#else
+	if (mprotect((void *)page, protectLen, PROT_READ | PROT_WRITE | PROT_EXEC) != 0)
+		return false;
+#endif
+
+	if ((uintptr_t)pDest + len <= aligned + 8)
+	{
+		uint64 word;
+		memcpy(&word, (void *)aligned, sizeof(word));
+		memcpy((uint8 *)&word + ((uintptr_t)pDest - aligned), pBytes, len);
+#ifdef _WIN32
+		InterlockedExchange64((volatile LONG64 *)aligned, (LONG64)word);
+#else
+		__atomic_store_n((uint64 *)aligned, word, __ATOMIC_SEQ_CST);
+#endif
+	}
+	else
+	{
+		memcpy(pDest, pBytes, len);
+	}
+
+#ifdef _WIN32
+	VirtualProtect((void *)page, protectLen, oldProtect, &oldProtect);
+	FlushInstructionCache(GetCurrentProcess(), pDest, len);
+#else
+	mprotect((void *)page, protectLen, PROT_READ | PROT_EXEC);
+#endif
+
+	return true;
+}
+
+bool Detour::Create(void *pTarget, void *pReplacement)
+{
+	Free();
+
+	uint8 *pSrc = (uint8 *)pTarget;
+	uint8 *pStub = AllocateNear(pTarget, kStubSize);
+	if (!pStub)
+		return false;
+
+	WriteAbsJump(pStub, pReplacement);
+
+	// Move whole instructions until there is room for the jump.
+	uint8 *pTrampoline = pStub + kTrampolineOffset;
+	size_t moved = 0;
+	while (moved < kNearJumpSize)
+	{
+		int relOffset;
+		size_t len = InstructionLength(pSrc + moved, relOffset);
+		if (!len || kTrampolineOffset + moved + len + kAbsJumpSize > kStubSize)
+		{
+			FreeStub(pStub, kStubSize);
+			return false;
+		}
+
+		memcpy(pTrampoline + moved, pSrc + moved, len);
+
+		if (relOffset != -1)
+		{
+			int32 rel;
+			memcpy(&rel, pSrc + moved + len + relOffset, sizeof(rel));
+
+			intptr_t dest = (intptr_t)(pSrc + moved + len) + rel;
+			int64 newRel = (int64)(dest - (intptr_t)(pTrampoline + moved + len));
+			if (newRel < INT32_MIN || newRel > INT32_MAX)
+			{
+				FreeStub(pStub, kStubSize);
+				return false;
+			}
+
+			rel = (int32)newRel;
+			memcpy(pTrampoline + moved + len + relOffset, &rel, sizeof(rel));
+		}
+
+		moved += len;
+	}
+
+	WriteAbsJump(pTrampoline + moved, pSrc + moved);
+
+#ifndef _WIN32
+	mprotect(pStub, kStubSize, PROT_READ | PROT_EXEC);
+#endif
+
+	memcpy(m_Original, pSrc, kNearJumpSize);
+	m_Patch[0] = 0xE9;
+	int32 rel = (int32)((intptr_t)pStub - (intptr_t)(pSrc + kNearJumpSize));
+	memcpy(m_Patch + 1, &rel, sizeof(rel));
+
+	m_pTarget = pTarget;
+	m_pStub = pStub;
+	m_pTrampoline = pTrampoline;
+	return true;
+}
+
+bool Detour::Install()
+{
+	if (!m_pStub)
+		return false;
+
+	if (m_bInstalled)
+		return true;
+
+	if (!WriteCode((uint8 *)m_pTarget, m_Patch, kNearJumpSize))
+		return false;
+
+	m_bInstalled = true;
+	return true;
+}
+
+void Detour::Remove()
+{
+	if (!m_bInstalled)
+		return;
+
+	WriteCode((uint8 *)m_pTarget, m_Original, kNearJumpSize);
+	m_bInstalled = false;
+}
+
+void Detour::Free()
+{
+	Remove();
+
+	if (m_pStub)
+	{
+		FreeStub(m_pStub, kStubSize);
+		m_pStub = nullptr;
+	}
+
+	m_pTarget = nullptr;
+	m_pTrampoline = nullptr;
+}
+
+#else // x86
+
+bool Detour::Create(void *pTarget, void *pReplacement)
+{
+	Free();
+
+	m_Hook = subhook_new(pTarget, pReplacement, subhook_options_t(0));
+	if (!m_Hook)
+		return false;
+
+	m_pTarget = pTarget;
+	m_pTrampoline = subhook_get_trampoline(m_Hook);
+	return m_pTrampoline != nullptr;
+}
+
+bool Detour::Install()
+{
+	if (!m_Hook)
+		return false;
+
+	if (!m_bInstalled)
+	{
+		if (subhook_install(m_Hook) != 0)
+			return false;
+
+		m_bInstalled = true;
+	}
+
+	return true;
+}
+
+void Detour::Remove()
+{
+	if (m_bInstalled)
+	{
+		subhook_remove(m_Hook);
+		m_bInstalled = false;
+	}
+}
+
+void Detour::Free()
+{
+	Remove();
+
+	if (m_Hook)
+	{
+		subhook_free(m_Hook);
+		m_Hook = nullptr;
+	}
+
+	m_pTarget = nullptr;
+	m_pTrampoline = nullptr;
+}
+
+#endif
@@ -0,0 +1,80 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <stddef.h>
+
+#if !defined( __x86_64__ ) && !defined( _M_X64 )
+#include <subhook.h>
+#endif
+
+// Redirects calls to a function to a replacement, which can still call the
+// original through Original().
+//
+// On x64 the target's first instruction(s) are replaced with a 5 byte jump
+// to a stub allocated within reach of the target. The stub holds an
+// absolute jump to the replacement, and the trampoline: the instructions
+// that were overwritten, relocated, followed by an absolute jump back into
+// the target. The code is patched only by Install and Remove, so calling
+// the original is a single indirect call and never races a thread calling
+// the target. On 32-bit builds subhook's trampoline is used.
+class Detour
+{
+public:
+	Detour() = default;
+	~Detour() { Free(); }
+
+	Detour(const Detour &) = delete;
+	Detour &operator=(const Detour &) = delete;
+
+	// Builds the trampoline. Nothing is patched until Install.
+	bool Create(void *pTarget, void *pReplacement);
+	bool Install();
+	void Remove();
+	// Removes the detour and releases the trampoline.
+	void Free();
+
+	bool IsInstalled() const { return m_bInstalled; }
+	void *Target() const { return m_pTarget; }
+	void *Trampoline() const { return m_pTrampoline; }
+
+	template <typename Fn>
+	Fn Original() const { return (Fn)m_pTrampoline; }
+private:
+	void *m_pTarget = nullptr;
+	void *m_pTrampoline = nullptr;
+	bool m_bInstalled = false;
+#if defined( __x86_64__ ) || defined( _M_X64 )
+	uint8 *m_pStub = nullptr;
+	uint8 m_Patch[8];
+	uint8 m_Original[8];
+#else
+	subhook_t m_Hook = nullptr;
+#endif
+};
@@ -28,20 +28,122 @@
 #include "d2lobby.h"
 #include "lobbymgr.h"
 #include "httpmgr.h"
+#include "identity.h"
+#include "matchstats.h"
 #include "util.h"
 
 #include <filesystem.h>
 #include <fmtstr.h>
 
-#include <jansson.h>
-
 #include <steam/steam_gameserver.h>
 
 #include <generated_proto/dota_usermessages.pb.h>
 
 EventLogger g_EventLogger;
 
-extern ConVar match_post_url;
+static ConVar d2lobby_event_batch_size("d2lobby_event_batch_size", "16", FCVAR_RELEASE, "Number of queued events that triggers an immediate send");
+static ConVar d2lobby_event_batch_latency("d2lobby_event_batch_latency", "1.0", FCVAR_RELEASE, "Max seconds an event is held before its batch is sent");
+
+static uint32 s_EventTypeMask = kAllEventTypes;
+
+static void OnEventTypesChanged(IConVar *var, const char *pOldValue, float flOldValue);
+static ConVar d2lobby_event_types("d2lobby_event_types", "all", FCVAR_RELEASE, "Comma separated event types to log, or all. Sinks can narrow this with their events option", OnEventTypesChanged);
+
+static void OnEventTypesChanged(IConVar *var, const char *pOldValue, float flOldValue)
+{
+	if (!EventTypeMaskFromString(d2lobby_event_types.GetString(), s_EventTypeMask))
+	{
+		Msg("Invalid event types \"%s\", still logging the previous set\n", d2lobby_event_types.GetString());
+	}
+}
+
+const char *EventTypeName(EventType type)
+{
+	switch (type)
+	{
+	case EventType::GameStateChange:
+		return "game_state";
+	case EventType::PlayerConnect:
+		return "player_connect";
+	case EventType::PlayerDisconnect:
+		return "player_disconnect";
+	case EventType::PlayerTeam_OBSOLETE:
+		return "player_team";
+	case EventType::HeroDeath:
+		return "hero_death";
+	case EventType::TowerKill:
+		return "tower_kill";
+	case EventType::CourierKill:
+		return "courier_kill";
+	case EventType::RoshanKill:
+		return "roshan_kill";
+	case EventType::RuneBottled:
+		return "rune_bottled";
+	case EventType::RuneUsed:
+		return "rune_used";
+	case EventType::AegisPickup:
+		return "aegis_pickup";
+	case EventType::AegisSteal:
+		return "aegis_steal";
+	case EventType::Buyback:
+		return "buyback";
+	case EventType::AegisDeny:
+		return "aegis_deny";
+	case EventType::FirstBlood:
+		return "first_blood";
+	case EventType::TowerDeny:
+		return "tower_deny";
+	case EventType::ItemPurchase:
+		return "item_purchase";
+	case EventType::CallGG:
+		return "call_gg";
+	case EventType::CancelGG:
+		return "cancel_gg";
+	default:
+		return "unknown";
+	}
+}
+
+bool EventTypeMaskFromString(const char *pszTypes, uint32 &mask)
+{
+	if (!V_stricmp(pszTypes, "all"))
+	{
+		mask = kAllEventTypes;
+		return true;
+	}
+
+	uint32 result = 0;
+	const char *p = pszTypes;
+	while (*p)
+	{
+		const char *pszEnd = strchr(p, ',');
+		size_t len = pszEnd ? (size_t)(pszEnd - p) : strlen(p);
+
+		int t = 0;
+		for (; t < (int)EventType::Count; ++t)
+		{
+			const char *pszName = EventTypeName((EventType)t);
+			if (strlen(pszName) == len && !V_strnicmp(p, pszName, len))
+				break;
+		}
+
+		if (t == (int)EventType::Count)
+			return false;
+
+		result |= 1 << t;
+		p += len;
+		if (*p == ',')
+		{
+			++p;
+		}
+	}
+
+	if (!result)
+		return false;
+
+	mask = result;
+	return true;
+}
 
 SH_DECL_HOOK2_void(ConCommand, Dispatch, SH_NOATTRIB, 0, const CCommandContext &, const CCommand &);
 SH_DECL_HOOK1_void(ISource2GameClients, SetCommandClient, SH_NOATTRIB, 0, CPlayerSlot);
@@ -84,6 +186,15 @@ bool EventLogger::OnLoad()
 	h = SH_ADD_HOOK(ISource2GameClients, SetCommandClient, serverclients, SH_MEMBER(this, &EventLogger::Hook_SetCommandClient), true);
 	m_Hooks.push_back(h);
 
+	UpdateEventGroups();
+	memset(m_Purchases, 0, sizeof(m_Purchases));
+	memset(m_RecentMessages, 0, sizeof(m_RecentMessages));
+	m_bReplaying = false;
+	m_bWorkerReplaying = false;
+
+	m_bStopWorker = false;
+	m_Worker = std::thread(&EventLogger::WorkerThread, this);
+
 	return true;
 }
 
@@ -93,46 +204,605 @@ void EventLogger::OnUnload()
 	{
 		SH_REMOVE_HOOK_ID(h);
 	}
+
+	// The worker closes whatever batch it has open before it exits.
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStopWorker = true;
+	}
+	m_WakeWorker.notify_one();
+	if (m_Worker.joinable())
+	{
+		m_Worker.join();
+	}
+
+	uint32 unsent = 0;
+	for (auto &batch : m_ReadyBatches)
+	{
+		unsent += batch.count;
+	}
+
+	for (auto &purchases : m_Purchases)
+	{
+		unsent += purchases.count;
+		purchases.count = 0;
+	}
+
+	if (unsent)
+	{
+		UTIL_LogToFile("Discarding %u unsent event(s)\n", unsent);
+	}
+	m_ReadyBatches.clear();
+}
+
+void EventLogger::OnGameFrame()
+{
+	m_MatchId.store(g_LobbyMgr.MatchId(), std::memory_order_relaxed);
+	m_BatchSize.store(d2lobby_event_batch_size.GetInt(), std::memory_order_relaxed);
+	m_flBatchLatency.store(d2lobby_event_batch_latency.GetFloat(), std::memory_order_relaxed);
+	UpdateEventGroups();
+	PushPurchases(false);
+
+	// Events that arrive before the Steam API is up are held here.
+	if (http)
+	{
+		SendReadyBatches();
+	}
+}
+
+EventRecord EventLogger::NewEvent(EventType type)
+{
+	EventRecord record;
+	memset(&record, 0, sizeof(record));
+	record.type = type;
+	//record.time = g_GameRules.GetGameTime();
+	record.time = Plat_FloatTime();
+
+	return record;
+}
+
+void EventLogger::PushEvent(const EventRecord &record)
+{
+	if (!m_Ring.Push(record))
+	{
+		++m_Dropped;
+		return;
+	}
+
+	++m_Pushed;
+
+	uint32 size = (uint32)m_Ring.Size();
+	if (size > m_RingHighWater)
+	{
+		m_RingHighWater = size;
+	}
+
+	// A worker with batches open wakes up by itself when the oldest is due,
+	// so it only needs waking when it has none or the ring is half full.
+	if (size == m_Ring.Capacity() / 2)
+	{
+		WakeWorker();
+		return;
+	}
+
+	// Pairs with the fence in WorkerThread. Either the worker sees the new
+	// record before it sleeps, or this sees it idle.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (m_bWorkerIdle.load(std::memory_order_relaxed) && m_bWorkerIdle.exchange(false))
+	{
+		WakeWorker();
+	}
+}
+
+void EventLogger::WakeWorker()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bWakeWorker = true;
+	}
+	m_WakeWorker.notify_one();
+}
+
+void EventLogger::PushPurchases(bool bAll)
+{
+	double flOldest = Plat_FloatTime() - d2lobby_event_batch_latency.GetFloat();
+	for (auto &purchases : m_Purchases)
+	{
+		if (purchases.count && (bAll || purchases.time <= flOldest))
+		{
+			PushEvent(purchases);
+			purchases.count = 0;
+		}
+	}
+}
+
+void EventLogger::FlushEvents()
+{
+	m_MatchId.store(g_LobbyMgr.MatchId(), std::memory_order_relaxed);
+	PushPurchases(true);
+
+	EventRecord flush = NewEvent(EventType::Flush);
+	flush.value = m_bReplaying;
+
+	// With the ring full the open batches still go out once they're due.
+	if (!m_Ring.Push(flush))
+	{
+		++m_Dropped;
+		return;
+	}
+
+	++m_FlushesRequested;
+	WakeWorker();
+}
+
+void EventLogger::DrainEvents()
+{
+	m_MatchId.store(g_LobbyMgr.MatchId(), std::memory_order_relaxed);
+	PushPurchases(true);
+
+	EventRecord flush = NewEvent(EventType::Flush);
+	flush.value = m_bReplaying;
+
+	// The flush marker has to get in even if the ring is full.
+	double flGiveUpTime = Plat_FloatTime() + 1.0;
+	while (!m_Ring.Push(flush))
+	{
+		if (Plat_FloatTime() > flGiveUpTime)
+			return;
+
+		WakeWorker();
+		std::this_thread::yield();
+	}
+
+	uint64 target = ++m_FlushesRequested;
+	WakeWorker();
+
+	{
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		m_FlushDone.wait_for(lock, std::chrono::seconds(1), [&] { return m_FlushesDone >= target; });
+	}
+
+	if (http)
+	{
+		SendReadyBatches();
+	}
+}
+
+void EventLogger::SetReplaying(bool bReplaying)
+{
+	if (m_bReplaying == bReplaying)
+		return;
+
+	m_bReplaying = bReplaying;
+	// Replayed messages are never duplicates of live ones or the reverse.
+	memset(m_RecentMessages, 0, sizeof(m_RecentMessages));
+	DrainEvents();
+}
+
+void EventLogger::SendReadyBatches()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_ReadyBatches.empty())
+			return;
+
+		m_SendingBatches.swap(m_ReadyBatches);
+	}
+
+	for (auto &batch : m_SendingBatches)
+	{
+		g_HTTPManager.Post(batch.payloads, PayloadKind::Events, nullptr, batch.groupKey, batch.bReplayed);
+	}
+
+	m_SendingBatches.clear();
+}
+
+void EventLogger::UpdateEventGroups()
+{
+	uint32 sinkMasks[kMaxEventGroups];
+	uint32 sinkFormats[kMaxEventGroups];
+	uint32 sinkMaskCount = g_HTTPManager.GetEventMasks(sinkMasks, sinkFormats, kMaxEventGroups);
+
+	EventGroupConfig config = {};
+	if (!sinkMaskCount)
+	{
+		config.count = 1;
+		config.keys[0] = 0;
+		config.masks[0] = s_EventTypeMask;
+		config.formats[0] = 1 << (int)WireFormat::JSON;
+	}
+	else
+	{
+		config.count = MIN(sinkMaskCount, (uint32)kMaxEventGroups);
+		for (uint32 g = 0; g < config.count; ++g)
+		{
+			config.keys[g] = sinkMasks[g];
+			config.masks[g] = sinkMasks[g] & s_EventTypeMask;
+			config.formats[g] = sinkFormats[g] | (1 << (int)WireFormat::JSON);
+		}
+	}
+
+	uint32 enabledMask = 0;
+	for (uint32 g = 0; g < config.count; ++g)
+	{
+		enabledMask |= config.masks[g];
+	}
+	m_EnabledMask = enabledMask;
+
+	if (config == m_GroupConfig)
+		return;
+
+	if (sinkMaskCount > kMaxEventGroups)
+	{
+		UTIL_LogToFile("Sinks use %u different event masks. Only the first %d get events\n", sinkMaskCount, kMaxEventGroups);
+	}
+
+	m_GroupConfig = config;
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_SharedGroupConfig = config;
+}
+
+void EventLogger::WorkerThread()
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	for (;;)
+	{
+		// Sleeps until the oldest open batch is due, or until woken if none
+		// are open.
+		double flDeadline = 0.0;
+		float flLatency = m_flBatchLatency.load(std::memory_order_relaxed);
+		for (uint32 g = 0; g < m_WorkerGroupConfig.count; ++g)
+		{
+			if (m_Groups[g].pending)
+			{
+				double flDue = m_Groups[g].flFirstPendingTime + flLatency;
+				if (!flDeadline || flDue < flDeadline)
+				{
+					flDeadline = flDue;
+				}
+			}
+		}
+
+		auto woken = [&] { return m_bStopWorker || m_bWakeWorker; };
+		if (flDeadline)
+		{
+			double flWait = flDeadline - Plat_FloatTime();
+			if (flWait > 0.0)
+			{
+				m_WakeWorker.wait_for(lock, std::chrono::duration<double>(flWait), woken);
+			}
+		}
+		else
+		{
+			m_bWorkerIdle.store(true, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (!m_Ring.Size())
+			{
+				m_WakeWorker.wait(lock, woken);
+			}
+			m_bWorkerIdle.store(false, std::memory_order_relaxed);
+		}
+		m_bWakeWorker = false;
+
+		bool bStop = m_bStopWorker;
+		EventGroupConfig config = m_SharedGroupConfig;
+		lock.unlock();
+
+		// Events already written keep the grouping they were written with.
+		if (config != m_WorkerGroupConfig)
+		{
+			FinishAllBatches();
+			m_WorkerGroupConfig = config;
+		}
+
+		uint64 flushes = 0;
+		EventRecord record;
+		while (m_Ring.Pop(record))
+		{
+			if (record.type == EventType::Flush)
+			{
+				FinishAllBatches();
+				m_bWorkerReplaying = record.value != 0;
+				++flushes;
+				continue;
+			}
+
+			WriteEvent(record);
+		}
+
+		if (bStop)
+		{
+			FinishAllBatches();
+		}
+		else
+		{
+			double flNow = Plat_FloatTime();
+			flLatency = m_flBatchLatency.load(std::memory_order_relaxed);
+			for (uint32 g = 0; g < m_WorkerGroupConfig.count; ++g)
+			{
+				if (m_Groups[g].pending && flNow - m_Groups[g].flFirstPendingTime >= flLatency)
+				{
+					FinishBatch(g);
+				}
+			}
+		}
+
+		lock.lock();
+		if (flushes)
+		{
+			m_FlushesDone += flushes;
+			m_FlushDone.notify_all();
+		}
+
+		if (bStop)
+			break;
+	}
 }
 
-void EventLogger::SendAndFreeEvent(json_t *pData)
+// Written the same way by the JSON and the MessagePack writer.
+template <typename Writer>
+static void WriteEventObject(Writer &w, const EventRecord &record)
 {
-#pragma message ("Remember to queue events or something if ISteamHTTP isn't available yet")
-	if (!http)
+	w.BeginObject();
+	w.Key("time");
+	w.Real(record.time);
+	w.Key("event_type");
+	w.Int((int)record.type);
+
+	switch (record.type)
 	{
-		UTIL_LogToFile("Can't send event, ISteamHTTP not available!!!!!!\n");
+	case EventType::GameStateChange:
+		w.Key("new_state");
+		w.UInt((uint32)record.value);
+		break;
+	case EventType::PlayerConnect:
+		w.Key("player");
+		w.UInt(record.player);
+		break;
+	case EventType::PlayerDisconnect:
+		w.Key("player");
+		w.UInt(record.player);
+		w.Key("reason");
+		w.Int(record.value);
+		break;
+	case EventType::HeroDeath:
+		w.Key("player");
+		w.UInt(record.player);
+		w.Key("gold");
+		w.UInt((uint32)record.value);
+		w.Key("killers");
+		w.BeginArray();
+		for (uint32 i = 0; i < record.count; ++i)
+		{
+			w.UInt(record.killers[i]);
+		}
+		w.EndArray();
+		break;
+	case EventType::CourierKill:
+		w.Key("team");
+		w.Int(record.team);
+		break;
+	case EventType::RoshanKill:
+		w.Key("team");
+		w.Int(record.team);
+		w.Key("gold");
+		w.UInt((uint32)record.value);
+		break;
+	case EventType::TowerKill:
+	case EventType::CallGG:
+	case EventType::CancelGG:
+		w.Key("player");
+		w.UInt(record.player);
+		w.Key("team");
+		w.Int(record.team);
+		break;
+	case EventType::RuneBottled:
+	case EventType::RuneUsed:
+		w.Key("player");
+		w.UInt(record.player);
+		w.Key("rune_type");
+		w.Int(record.value);
+		break;
+	case EventType::ItemPurchase:
+		w.Key("player");
+		w.UInt(record.player);
+		w.Key("items");
+		w.BeginArray();
+		for (uint32 i = 0; i < record.count; ++i)
+		{
+			w.UInt(record.items[i]);
+		}
+		w.EndArray();
+		break;
+	default:
+		w.Key("player");
+		w.UInt(record.player);
+		break;
+	}
+
+	w.EndObject();
+}
+
+template <typename Writer>
+static void WriteBatchObject(Writer &w, uint64 matchId, const Writer &events)
+{
+	w.Reset();
+	w.BeginObject();
+	w.Key("match_id");
+	w.UInt(matchId);
+	w.Key("events");
+	w.Raw(events.Data(), events.Size());
+	w.Key("status");
+	w.String("events");
+	w.Key("has_events");
+	w.Bool(true);
+	w.EndObject();
+}
+
+void EventLogger::WriteEvent(const EventRecord &record)
+{
+	static const uint32 kPacked = 1 << (int)WireFormat::MessagePack;
+	uint32 bit = 1 << (int)record.type;
+
+	// Only written as MessagePack if a group taking it sends that.
+	bool bPacked = false;
+	for (uint32 g = 0; g < m_WorkerGroupConfig.count; ++g)
+	{
+		bPacked |= (m_WorkerGroupConfig.masks[g] & bit) && (m_WorkerGroupConfig.formats[g] & kPacked);
+	}
+
+	m_Event.Reset();
+	WriteEventObject(m_Event, record);
+
+	if (bPacked)
+	{
+		m_PackedEvent.Reset();
+		WriteEventObject(m_PackedEvent, record);
+	}
+
+	if (m_Event.Failed() || (bPacked && m_PackedEvent.Failed()))
+	{
+		++m_LostToMemory;
 		return;
 	}
 
-	json_t *pContainer = json_object();
-	json_t *pEvents = json_array();
-	json_array_append_new(pEvents, pData);
-	json_object_set_new(pContainer, "match_id", json_integer(g_LobbyMgr.MatchId()));
-	json_object_set_new(pContainer, "events", pEvents);
-	json_object_set_new(pContainer, "status", json_string("events"));
-	json_object_set_new(pContainer, "has_events", json_boolean(true));
+	int batchSize = m_BatchSize.load(std::memory_order_relaxed);
+	for (uint32 g = 0; g < m_WorkerGroupConfig.count; ++g)
+	{
+		if (!(m_WorkerGroupConfig.masks[g] & bit))
+			continue;
 
-	char *pszOutput = json_dumps(pContainer, JSON_COMPACT);
-	json_decref(pContainer);
+		EventGroup &group = m_Groups[g];
+		bool bGroupPacked = (m_WorkerGroupConfig.formats[g] & kPacked) != 0;
+		if (!group.pending)
+		{
+			group.events.Reset();
+			group.events.BeginArray();
+			if (bGroupPacked)
+			{
+				group.packedEvents.Reset();
+				group.packedEvents.BeginArray();
+			}
+			group.flFirstPendingTime = Plat_FloatTime();
+		}
 
-	UTIL_LogToFile("Sending event:\n%s\n", pszOutput);
+		group.events.Raw(m_Event.Data(), m_Event.Size());
+		if (bGroupPacked)
+		{
+			group.packedEvents.Raw(m_PackedEvent.Data(), m_PackedEvent.Size());
+		}
 
-	if (match_post_url.GetString()[0])
+		if ((int)++group.pending >= batchSize)
+		{
+			FinishBatch(g);
+		}
+	}
+}
+
+void EventLogger::FinishBatch(int g)
+{
+	EventGroup &group = m_Groups[g];
+	if (!group.pending)
+		return;
+
+	uint32 count = group.pending;
+	uint64 matchId = m_MatchId.load(std::memory_order_relaxed);
+	bool bPacked = (m_WorkerGroupConfig.formats[g] & (1 << (int)WireFormat::MessagePack)) != 0;
+
+	group.events.EndArray();
+	WriteBatchObject(m_Batch, matchId, group.events);
+
+	bool bFailed = group.events.Failed() || m_Batch.Failed();
+
+	if (bPacked)
+	{
+		group.packedEvents.EndArray();
+		WriteBatchObject(m_PackedBatch, matchId, group.packedEvents);
+
+		bFailed |= group.packedEvents.Failed() || m_PackedBatch.Failed();
+	}
+
+	group.pending = 0;
+	group.events.Reset();
+	group.packedEvents.Reset();
+
+	if (bFailed)
+	{
+		m_LostToMemory += count;
+		return;
+	}
+
+	ReadyBatch batch;
+	batch.payloads[(int)WireFormat::JSON] = Payload::Copy(m_Batch.Data(), m_Batch.Size());
+	if (bPacked)
+	{
+		batch.payloads[(int)WireFormat::MessagePack] = Payload::Copy(m_PackedBatch.Data(), m_PackedBatch.Size());
+	}
+	batch.count = count;
+	batch.groupKey = m_WorkerGroupConfig.keys[g];
+	batch.bReplayed = m_bWorkerReplaying;
+
+	UTIL_LogPayloadToFile(*batch.payloads[(int)WireFormat::JSON], "Sending %u event(s):\n", batch.count);
+
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_ReadyBatches.push_back(std::move(batch));
+}
+
+void EventLogger::FinishAllBatches()
+{
+	for (uint32 g = 0; g < m_WorkerGroupConfig.count; ++g)
 	{
-		g_HTTPManager.PostJSONToMatchUrl(pszOutput);
+		FinishBatch(g);
 	}
+}
 
-	free(pszOutput);
+void EventLogger::PrintDebug() const
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+
+	Msg("Event ring: %u/%u record(s), high water %u, %u pushed, %u dropped\n",
+		(uint32)m_Ring.Size(), (uint32)m_Ring.Capacity(), m_RingHighWater, m_Pushed, m_Dropped);
+	Msg("- %u batch(es) waiting to be sent, %u/%u flush(es) done\n", (uint32)m_ReadyBatches.size(), (uint32)m_FlushesDone, (uint32)m_FlushesRequested);
+	Msg("- enabled types 0x%05x, %u duplicate message(s) suppressed, %u event(s) lost to failed allocations\n", m_EnabledMask, m_Duplicates, m_LostToMemory.load());
+	for (uint32 g = 0; g < m_GroupConfig.count; ++g)
+	{
+		Msg("  - sink group 0x%05x: types 0x%05x\n", m_GroupConfig.keys[g], m_GroupConfig.masks[g]);
+	}
 }
 
-json_t *EventLogger::CreateTimedEvent(EventType type)
+bool EventLogger::IsDuplicate(uint16 id, const google::protobuf::Message &msg, int tick)
 {
-	json_t *pEvent = json_object();
-	//json_object_set_new(pEvent, "time", json_real(g_GameRules.GetGameTime()));
-	json_object_set_new(pEvent, "time", json_real(Plat_FloatTime()));
-	json_object_set_new(pEvent, "event_type", json_integer((int)type));
+	// Serialized onto the stack and hashed. Nothing handled here comes close
+	// to the limit, but anything that did would just go unchecked.
+	uint8 buf[512];
+	int size = msg.ByteSize();
+	if (size > (int)sizeof(buf))
+		return false;
+
+	msg.SerializeWithCachedSizesToArray(buf);
+
+	// FNV-1a
+	uint64 hash = 14695981039346656037ull ^ id;
+	for (int i = 0; i < size; ++i)
+	{
+		hash = (hash ^ buf[i]) * 1099511628211ull;
+	}
+
+	for (auto &recent : m_RecentMessages)
+	{
+		if (recent.hash == hash && recent.tick == tick)
+		{
+			++m_Duplicates;
+			return true;
+		}
+	}
+
+	RecentMessage &slot = m_RecentMessages[m_NextRecentMessage++ % kRecentMessages];
+	slot.hash = hash;
+	slot.tick = tick;
 
-	return pEvent;
+	return false;
 }
 
 void ChatDebug(CDOTAUserMsg_ChatEvent &msg)
@@ -158,108 +828,130 @@ void ChatDebug(CDOTAUserMsg_ChatEvent &msg)
 		Msg("- Player6: %d\n", msg.playerid_6());
 }
 
-void EventLogger::OnGameEvent(uint16 id, const void *pData, int clientCount, const unsigned char *clients)
+void EventLogger::OnGameEvent(uint16 id, const void *pData, int clientCount, const unsigned char *clients, int tick)
 {
+	if (tick < 0)
+	{
+		tick = engine->GetServerGlobals()->tickcount;
+	}
+
 	switch (id)
 	{
 		case DOTA_UM_ChatEvent:
 		{
 			auto &chatEvent = *(CDOTAUserMsg_ChatEvent *) pData;
+
+			// Purchases are sent once per team on purpose, so they're only
+			// checked after the copy to log has been picked.
+			if (chatEvent.type() != CHAT_MESSAGE_ITEM_PURCHASE && IsDuplicate(id, chatEvent, tick))
+				break;
+
 			switch (chatEvent.type())
 			{
 			case CHAT_MESSAGE_COURIER_LOST:
 				ChatDebug(chatEvent);
+				g_MatchStats.OnCourierKill(chatEvent.playerid_1() == kTeamDire ? kTeamRadiant : kTeamDire);
 				LogCourierKill(chatEvent.playerid_1() == kTeamDire ? kTeamRadiant : kTeamDire);
 				break;
 			case CHAT_MESSAGE_HERO_KILL:
 				{
-					std::vector<int> vecKillers;
+					int killers[kMaxTeamPlayers];
+					int killerCount = 0;
 					if (chatEvent.has_playerid_2())
 					{
-						vecKillers.push_back(chatEvent.playerid_2());
+						killers[killerCount++] = chatEvent.playerid_2();
 						if (chatEvent.has_playerid_3())
 						{
-							vecKillers.push_back(chatEvent.playerid_3());
+							killers[killerCount++] = chatEvent.playerid_3();
 							if (chatEvent.has_playerid_4())
 							{
-								vecKillers.push_back(chatEvent.playerid_4());
+								killers[killerCount++] = chatEvent.playerid_4();
 								if (chatEvent.has_playerid_5())
 								{
-									vecKillers.push_back(chatEvent.playerid_5());
+									killers[killerCount++] = chatEvent.playerid_5();
 									if (chatEvent.has_playerid_6())
 									{
-										vecKillers.push_back(chatEvent.playerid_6());
+										killers[killerCount++] = chatEvent.playerid_6();
 									}
 								}
 							}
 						}
 					}
-					LogHeroKill(chatEvent.playerid_1(), vecKillers, chatEvent.value());
+					g_MatchStats.OnHeroKill(chatEvent.playerid_1(), killers, killerCount);
+					LogHeroKill(chatEvent.playerid_1(), killers, killerCount, chatEvent.value());
 				}
 				break;
 			case CHAT_MESSAGE_RUNE_BOTTLE:
+				g_MatchStats.OnRuneBottled(chatEvent.playerid_1());
 				LogRuneBottle(chatEvent.playerid_1(), (DotaRune) chatEvent.value());
 				break;
 			case CHAT_MESSAGE_RUNE_PICKUP:
+				g_MatchStats.OnRuneUsed(chatEvent.playerid_1());
 				LogRuneUse(chatEvent.playerid_1(), (DotaRune) chatEvent.value());
 				break;
 			case CHAT_MESSAGE_ROSHAN_KILL:
 				ChatDebug(chatEvent);
+				g_MatchStats.OnRoshanKill(chatEvent.playerid_1());
 				LogRoshanKill(chatEvent.playerid_1(), chatEvent.value());
 				break;
 			case CHAT_MESSAGE_AEGIS:
+				g_MatchStats.OnAegisPickup(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::AegisPickup, chatEvent.playerid_1());
 				break;
 			case CHAT_MESSAGE_AEGIS_STOLEN:
+				g_MatchStats.OnAegisSteal(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::AegisSteal, chatEvent.playerid_1());
 				break;
 			//case CHAT_MESSAGE_HERO_DENY:
 			case CHAT_MESSAGE_BUYBACK:
+				g_MatchStats.OnBuyback(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::Buyback, chatEvent.playerid_1());
 				break;
 				// player id
 			case CHAT_MESSAGE_DENIED_AEGIS:
+				g_MatchStats.OnAegisDeny(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::AegisDeny, chatEvent.playerid_1());
 				break;
 			case CHAT_MESSAGE_FIRSTBLOOD:
+				g_MatchStats.OnFirstBlood(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::FirstBlood, chatEvent.playerid_1());
 				break;
 			case CHAT_MESSAGE_TOWER_DENY:
+				g_MatchStats.OnTowerDeny(chatEvent.playerid_1());
 				LogSimplePlayerEvent(EventType::TowerDeny, chatEvent.playerid_1());
 				break;
 			case CHAT_MESSAGE_TOWER_KILL:
+				g_MatchStats.OnTowerKill(chatEvent.playerid_1(), chatEvent.value());
 				LogTowerKill(chatEvent.playerid_1(), chatEvent.value());
 				break;
-#if 0
 			case CHAT_MESSAGE_ITEM_PURCHASE:
+				if (IsEnabled(EventType::ItemPurchase))
 				{
-					bool skip = false;
-					int ourTeam = g_LobbyMgr.GetPlayerTeam(chatEvent.playerid_1());
+					// Only log the copy that goes to the buyer's own team.
+					uint64 recipients = 0;
 					for (int i = 0; i < clientCount; ++i)
 					{
-						const CSteamID *sid = engine->GetClientSteamID(clients[i]);
-						int team = g_LobbyMgr.GetPlayerTeam(*sid);
-						if (team != ourTeam)
+						if (clients[i] < 64)
 						{
-							skip = true;
-							break;
+							recipients |= 1ull << clients[i];
 						}
 					}
 
-					if (!skip)
+					int team = g_PlayerIdentities.GetPlayerIdTeam(chatEvent.playerid_1());
+					if (!(recipients & ~g_PlayerIdentities.GetTeamSlots(team)) && !IsDuplicate(id, chatEvent, tick))
 					{
 						LogItemPurchase(chatEvent.playerid_1(), chatEvent.value());
 					}
 				}
 				break;
-#endif
 			}
 		}
 		break;
 		case DOTA_UM_ChatWheel:
 		{
 			auto &chatWheel = *(CDOTAUserMsg_ChatWheel *)pData;
-			if (chatWheel.chat_message() == k_EDOTA_CW_All_GG || chatWheel.chat_message() == k_EDOTA_CW_All_GGWP)
+			if ((chatWheel.chat_message() == k_EDOTA_CW_All_GG || chatWheel.chat_message() == k_EDOTA_CW_All_GGWP)
+				&& !IsDuplicate(id, chatWheel, tick))
 			{
 				HandlePossibleGG(CSteamID(chatWheel.account_id(), k_unSteamUserDefaultInstance, k_EUniversePublic, k_EAccountTypeIndividual));
 			}
@@ -272,7 +964,7 @@ void EventLogger::HandlePossibleGG(const CSteamID &sid)
 {
 	if (g_LobbyMgr.GetGameState() == DOTA_GAMERULES_STATE_GAME_IN_PROGRESS && m_GGTeam == kTeamUnassigned)
 	{
-		int team = g_LobbyMgr.GetPlayerTeam(sid);
+		int team = g_PlayerIdentities.GetTeam(sid);
 		if (team == kTeamRadiant || team == kTeamDire)
 		{
 			m_GGTeam = (DotaTeam)team;
@@ -285,10 +977,10 @@ void EventLogger::Hook_OnCmdSay(const CCommandContext &ctx, const CCommand &args
 {
 	if (!Q_stricmp(args.ArgS(), "\"gg\""))
 	{
-		const CSteamID *sid = engine->GetClientSteamID(m_CommandClient.Get() + 1);
-		if (sid)
+		CSteamID sid = g_PlayerIdentities.SteamIdFromEntity(m_CommandClient.Get() + 1);
+		if (sid.IsValid())
 		{
-			HandlePossibleGG(*sid);
+			HandlePossibleGG(sid);
 		}
 	}
 	RETURN_META(MRES_SUPERCEDE);
@@ -303,14 +995,14 @@ void EventLogger::Hook_OnCmdCancelGG(const CCommandContext &ctx, const CCommand
 {
 	if (g_LobbyMgr.GetGameState() == DOTA_GAMERULES_STATE_GAME_IN_PROGRESS && m_GGTeam != kTeamUnassigned)
 	{
-		const CSteamID *sid = engine->GetClientSteamID(m_CommandClient.Get() + 1);
-		if (sid)
+		CSteamID sid = g_PlayerIdentities.SteamIdFromEntity(m_CommandClient.Get() + 1);
+		if (sid.IsValid())
 		{
-			int team = g_LobbyMgr.GetPlayerTeam(*sid);
+			int team = g_PlayerIdentities.GetTeam(sid);
 			if (team == m_GGTeam)
 			{
 				m_GGTeam = kTeamUnassigned;
-				g_EventLogger.LogGGCancel(sid->ConvertToUint64(), team);
+				g_EventLogger.LogGGCancel(sid.ConvertToUint64(), team);
 			}
 		}
 	}
@@ -327,132 +1019,173 @@ void EventLogger::Hook_SetCommandClient(CPlayerSlot slot)
 
 void EventLogger::OnDOTAGameStateChange(uint32 oldState, uint32 newState)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::GameStateChange);
-	json_object_set_new(pEvent, "new_state", json_integer(newState));
+	if (IsEnabled(EventType::GameStateChange))
+	{
+		EventRecord event = NewEvent(EventType::GameStateChange);
+		event.value = (int32)newState;
+		PushEvent(event);
+	}
 
-	SendAndFreeEvent(pEvent);
+	// State changes are significant on their own; don't hold them back.
+	FlushEvents();
 }
 
 void EventLogger::LogPlayerConnect(const char *pszName, const CSteamID &steamId)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::PlayerConnect);
-	json_object_set_new(pEvent, "player", json_integer(steamId.ConvertToUint64()));
+	if (!IsEnabled(EventType::PlayerConnect))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::PlayerConnect);
+	event.player = steamId.ConvertToUint64();
+	PushEvent(event);
 }
 
 void EventLogger::LogPlayerDisconnect(const char *pszName, const CSteamID &steamId, int reason)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::PlayerDisconnect);
-	json_object_set_new(pEvent, "player", json_integer(steamId.ConvertToUint64()));
-	json_object_set_new(pEvent, "reason", json_integer(reason));
+	if (!IsEnabled(EventType::PlayerDisconnect))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::PlayerDisconnect);
+	event.player = steamId.ConvertToUint64();
+	event.value = reason;
+	PushEvent(event);
 }
 
 #if 0
 void EventLogger::LogPlayerTeam(const char *pszName, int userid, int team)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::PlayerTeam);
-	auto *sid = UserIdToCSteamID(userid);
-	json_object_set_new(pEvent, "player", json_integer(sid ? sid->ConvertToUint64() : 0));
-	json_object_set_new(pEvent, "team", json_integer(team));
+	if (!IsEnabled(EventType::PlayerTeam))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::PlayerTeam);
+	auto *sid = UserIdToCSteamID(userid);
+	event.player = sid ? sid->ConvertToUint64() : 0;
+	event.team = team;
+	PushEvent(event);
 }
 #endif
 
-void EventLogger::LogHeroKill(int victimId, std::vector<int> &vecKillers, uint gold)
+void EventLogger::LogHeroKill(int victimId, const int *pKillers, int killerCount, uint gold)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::HeroDeath);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(victimId).ConvertToUint64()));
-	json_object_set_new(pEvent, "gold", json_integer(gold));
-	json_t *pKillers = json_array();
-	for (int k : vecKillers)
-	{
-		if (k != -1)
-			json_array_append_new(pKillers, json_integer(UTIL_PlayerIdToSteamId(k).ConvertToUint64()));
-	}	
-	json_object_set_new(pEvent, "killers", pKillers);
+	if (!IsEnabled(EventType::HeroDeath))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::HeroDeath);
+	event.player = UTIL_PlayerIdToSteamId(victimId).ConvertToUint64();
+	event.value = (int32)gold;
+	for (int i = 0; i < killerCount && event.count < kMaxTeamPlayers; ++i)
+	{
+		if (pKillers[i] != -1)
+			event.killers[event.count++] = UTIL_PlayerIdToSteamId(pKillers[i]).ConvertToUint64();
+	}
+	PushEvent(event);
 }
 
 void EventLogger::LogCourierKill(int team)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::CourierKill);
-	json_object_set_new(pEvent, "team", json_integer(team));
+	if (!IsEnabled(EventType::CourierKill))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::CourierKill);
+	event.team = team;
+	PushEvent(event);
 }
 
 void EventLogger::LogRoshanKill(int team, uint gold)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::RoshanKill);
-	json_object_set_new(pEvent, "team", json_integer(team));
-	json_object_set_new(pEvent, "gold", json_integer(gold));
+	if (!IsEnabled(EventType::RoshanKill))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::RoshanKill);
+	event.team = team;
+	event.value = (int32)gold;
+	PushEvent(event);
 }
 
 void EventLogger::LogTowerKill(int playerId, int team)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::TowerKill);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(playerId).ConvertToUint64()));
-	json_object_set_new(pEvent, "team", json_integer(team));
+	if (!IsEnabled(EventType::TowerKill))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::TowerKill);
+	event.player = UTIL_PlayerIdToSteamId(playerId).ConvertToUint64();
+	event.team = team;
+	PushEvent(event);
 }
 
 void EventLogger::LogSimplePlayerEvent(EventType type, int playerId)
 {
-	json_t *pEvent = CreateTimedEvent(type);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(playerId).ConvertToUint64()));
+	if (!IsEnabled(type))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(type);
+	event.player = UTIL_PlayerIdToSteamId(playerId).ConvertToUint64();
+	PushEvent(event);
 }
 
 void EventLogger::LogRuneBottle(int playerId, DotaRune rune)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::RuneBottled);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(playerId).ConvertToUint64()));
-	json_object_set_new(pEvent, "rune_type", json_integer((int) rune));
+	if (!IsEnabled(EventType::RuneBottled))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::RuneBottled);
+	event.player = UTIL_PlayerIdToSteamId(playerId).ConvertToUint64();
+	event.value = (int32)rune;
+	PushEvent(event);
 }
 
 void EventLogger::LogRuneUse(int playerId, DotaRune rune)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::RuneUsed);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(playerId).ConvertToUint64()));
-	json_object_set_new(pEvent, "rune_type", json_integer((int) rune));
+	if (!IsEnabled(EventType::RuneUsed))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::RuneUsed);
+	event.player = UTIL_PlayerIdToSteamId(playerId).ConvertToUint64();
+	event.value = (int32)rune;
+	PushEvent(event);
 }
 
 void EventLogger::LogItemPurchase(int playerId, int itemId)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::ItemPurchase);
-	json_object_set_new(pEvent, "player", json_integer(UTIL_PlayerIdToSteamId(playerId).ConvertToUint64()));
-	json_object_set_new(pEvent, "item_id", json_integer(itemId));
+	if (!IsEnabled(EventType::ItemPurchase))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	if (playerId < 0 || playerId >= kMaxGamePlayerIds)
+		return;
+
+	EventRecord &purchases = m_Purchases[playerId];
+	if (!purchases.count)
+	{
+		purchases = NewEvent(EventType::ItemPurchase);
+		purchases.player = UTIL_PlayerIdToSteamId(playerId).ConvertToUint64();
+	}
+
+	purchases.items[purchases.count++] = (uint16)itemId;
+	if (purchases.count == kMaxPurchaseBatch)
+	{
+		PushEvent(purchases);
+		purchases.count = 0;
+	}
 }
 
 void EventLogger::LogGGCall(uint64 steamId64, int team)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::CallGG);
-	json_object_set_new(pEvent, "player", json_integer(steamId64));
-	json_object_set_new(pEvent, "team", json_integer(team));
+	if (!IsEnabled(EventType::CallGG))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::CallGG);
+	event.player = steamId64;
+	event.team = team;
+	PushEvent(event);
 }
 
 void EventLogger::LogGGCancel(uint64 steamId64, int team)
 {
-	json_t *pEvent = CreateTimedEvent(EventType::CancelGG);
-	json_object_set_new(pEvent, "player", json_integer(steamId64));
-	json_object_set_new(pEvent, "team", json_integer(team));
+	if (!IsEnabled(EventType::CancelGG))
+		return;
 
-	SendAndFreeEvent(pEvent);
+	EventRecord event = NewEvent(EventType::CancelGG);
+	event.player = steamId64;
+	event.team = team;
+	PushEvent(event);
 }
@@ -27,15 +27,24 @@
 
 #include "pluginsystem.h"
 #include "constants.h"
+#include "jsonwriter.h"
+#include "msgpackwriter.h"
+#include "payload.h"
+#include "ring.h"
+#include "wireformat.h"
 
 #include <basetypes.h>
+#include <string.h>
 
 #include <generated_proto/dota_gcmessages_common.pb.h>
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <vector>
 
 class CSteamID;
-struct json_t;
 
 enum class EventType : int
 {
@@ -58,6 +67,40 @@ enum class EventType : int
 	ItemPurchase,
 	CallGG,
 	CancelGG,
+
+	Count,
+
+	// Not an event. Tells the worker to close the current batch.
+	Flush = -1,
+};
+
+static const uint32 kAllEventTypes = (1 << (int)EventType::Count) - 1;
+
+const char *EventTypeName(EventType type);
+
+// Parses a comma separated list of event type names, or "all".
+bool EventTypeMaskFromString(const char *pszTypes, uint32 &mask);
+
+// Item purchases are sent as one event per player holding up to this many.
+static const int kMaxPurchaseBatch = 20;
+
+// Everything an event carries, captured on the game thread and turned into
+// JSON by the worker. What team and value mean depends on the type.
+struct EventRecord
+{
+	EventType type;
+	double time;
+	uint64 player;
+	int32 team;
+	int32 value;
+	uint32 count;
+	union
+	{
+		// HeroDeath
+		uint64 killers[kMaxTeamPlayers];
+		// ItemPurchase
+		uint16 items[kMaxPurchaseBatch];
+	};
 };
 
 class EventLogger : IPluginSystem
@@ -67,19 +110,35 @@ public:
 	bool OnLoad() override;
 	void OnUnload() override;
 	void OnDOTAGameStateChange(uint32 oldState, uint32 newState) override;
+	void OnGameFrame() override;
 public:
 	void Hook_OnCmdSay(const CCommandContext &, const CCommand &);
 	void Hook_OnCmdGG(const CCommandContext &, const CCommand &);
 	void Hook_OnCmdCancelGG(const CCommandContext &, const CCommand &);
 	void Hook_SetCommandClient(CPlayerSlot slot);
 public:
-	void OnGameEvent(uint16 id, const void *pData, int clientCount = 0, const unsigned char *clients = nullptr);
+	// tick is the server tick the message was sent on, or -1 for the
+	// current one. Replays pass the one that was captured.
+	void OnGameEvent(uint16 id, const void *pData, int clientCount = 0, const unsigned char *clients = nullptr, int tick = -1);
 	void LogGGCall(uint64 steamId64, int team);
 	void LogGGCancel(uint64 steamId64, int team);
 	void LogPlayerConnect(const char *pszName, const CSteamID &steamId);
 	void LogPlayerDisconnect(const char *pszName, const CSteamID &steamId, int reason);
+	// Closes the current batch. It's sent on a later frame.
+	void FlushEvents();
+	// Whether anything wants this type at all. Checked before any work is
+	// done for an event.
+	bool IsEnabled(EventType type) const { return (m_EnabledMask & (1 << (int)type)) != 0; }
+	// Closes the current batch and waits for the worker to finish it, so
+	// it is handed to the sinks before this returns.
+	void DrainEvents();
+	// While set, batches are sent through the discard transport and not
+	// spooled. Batches holding events logged before the change go out as
+	// they would have.
+	void SetReplaying(bool bReplaying);
+	void PrintDebug() const;
 private:
-	void LogHeroKill(int victimId, std::vector<int> &killers, uint gold);
+	void LogHeroKill(int victimId, const int *pKillers, int killerCount, uint gold);
 	void LogSimplePlayerEvent(EventType type, int playerId);
 	void LogTowerKill(int playerId, int team);
 	void LogCourierKill(int team);
@@ -89,12 +148,125 @@ private:
 	void LogItemPurchase(int playerId, int itemId);
 private:
 	void HandlePossibleGG(const CSteamID &sid);
-	json_t *CreateTimedEvent(EventType type);
-	void SendAndFreeEvent(json_t *pData);
+	// Whether the same message was already seen on this tick. The same one
+	// is sometimes posted once per recipient group.
+	bool IsDuplicate(uint16 id, const google::protobuf::Message &msg, int tick);
+	EventRecord NewEvent(EventType type);
+	void PushEvent(const EventRecord &record);
+	void WakeWorker();
+	// Pushes purchase batches that are full enough or old enough, or all of
+	// them.
+	void PushPurchases(bool bAll);
+	void SendReadyBatches();
+	void UpdateEventGroups();
+private: // Worker thread
+	// Sinks are grouped by their event mask, and each group gets batches
+	// holding only the types it takes. The key is the sinks' mask, or 0 for
+	// the one group used when no sink takes events. Batches are always
+	// written as JSON, which is what gets logged and spooled, and also as
+	// MessagePack when a sink in the group sends that.
+	static const int kMaxEventGroups = 4;
+
+	struct EventGroupConfig
+	{
+		uint32 count;
+		uint32 keys[kMaxEventGroups];
+		uint32 masks[kMaxEventGroups];
+		// Wire formats to write, as a bitmask.
+		uint32 formats[kMaxEventGroups];
+
+		bool operator==(const EventGroupConfig &other) const
+		{
+			return count == other.count
+				&& !memcmp(keys, other.keys, sizeof(keys[0]) * count)
+				&& !memcmp(masks, other.masks, sizeof(masks[0]) * count)
+				&& !memcmp(formats, other.formats, sizeof(formats[0]) * count);
+		}
+		bool operator!=(const EventGroupConfig &other) const { return !(*this == other); }
+	};
+
+	struct EventGroup
+	{
+		JSONWriter events;
+		MessagePackWriter packedEvents;
+		uint32 pending = 0;
+		double flFirstPendingTime = 0.0;
+	};
+
+	struct ReadyBatch
+	{
+		// By WireFormat. Only JSON is always there.
+		PayloadRef payloads[(int)WireFormat::Count];
+		uint32 count;
+		uint32 groupKey;
+		bool bReplayed;
+	};
+
+	void WorkerThread();
+	void WriteEvent(const EventRecord &record);
+	void FinishBatch(int group);
+	void FinishAllBatches();
 private:
 	std::vector<int> m_Hooks;
 	DotaTeam m_GGTeam = kTeamUnassigned;
 	CPlayerSlot m_CommandClient = 0;
+
+	// Game thread to worker
+	SPSCRing<EventRecord, 1024> m_Ring;
+	uint32 m_Pushed = 0;
+	uint32 m_Dropped = 0;
+	uint32 m_RingHighWater = 0;
+	uint64 m_FlushesRequested = 0;
+	uint32 m_EnabledMask = kAllEventTypes;
+	// Passed to the worker in the value of every flush marker, so it changes
+	// at the same point in the ring as it did here.
+	bool m_bReplaying = false;
+	// Purchases waiting to be pushed, by player id. Open while count is
+	// nonzero.
+	EventRecord m_Purchases[kMaxGamePlayerIds];
+
+	struct RecentMessage
+	{
+		uint64 hash;
+		int tick;
+	};
+
+	static const int kRecentMessages = 16;
+	RecentMessage m_RecentMessages[kRecentMessages];
+	uint32 m_NextRecentMessage = 0;
+	uint32 m_Duplicates = 0;
+	EventGroupConfig m_GroupConfig = {};
+	// Settings copied each frame for the worker to read.
+	std::atomic<uint64> m_MatchId{ 0 };
+	std::atomic<int> m_BatchSize{ 16 };
+	std::atomic<float> m_flBatchLatency{ 1.0f };
+
+	// Worker to game thread
+	mutable std::mutex m_Mutex;
+	std::condition_variable m_WakeWorker;
+	std::condition_variable m_FlushDone;
+	std::vector<ReadyBatch> m_ReadyBatches;
+	std::vector<ReadyBatch> m_SendingBatches;
+	uint64 m_FlushesDone = 0;
+	bool m_bStopWorker = false;
+	bool m_bWakeWorker = false;
+	// Set while the worker has no open batches and would sleep until woken.
+	std::atomic<bool> m_bWorkerIdle{ false };
+	EventGroupConfig m_SharedGroupConfig = {};
+
+	// Worker thread state. The writers are reused for every batch, so
+	// steady state logging doesn't allocate. Each event is written once per
+	// format to m_Event and m_PackedEvent and copied into every group that
+	// takes it.
+	std::thread m_Worker;
+	EventGroupConfig m_WorkerGroupConfig = {};
+	bool m_bWorkerReplaying = false;
+	EventGroup m_Groups[kMaxEventGroups];
+	JSONWriter m_Event;
+	JSONWriter m_Batch;
+	MessagePackWriter m_PackedEvent;
+	MessagePackWriter m_PackedBatch;
+	std::atomic<uint32> m_LostToMemory{ 0 };
 };
 
 extern EventLogger g_EventLogger;
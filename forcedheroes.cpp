@@ -26,6 +26,7 @@
 #include "forcedheroes.h"
 
 #include "d2lobby.h"
+#include "identity.h"
 #include "lobbymgr.h"
 #include "util.h"
 
@@ -146,8 +147,8 @@ void ForcedHeroes::OnDOTAGameStateChange(uint32 oldState, uint32 state)
 				continue;
 
 			const char *pszHero;
-			auto *sid = engine->GetClientSteamID(i);
-			if (sid && (pszHero = g_LobbyMgr.GetPlayerHero(*sid)))
+			CSteamID sid = g_PlayerIdentities.SteamIdFromEntity(i);
+			if (sid.IsValid() && (pszHero = g_LobbyMgr.GetPlayerHero(sid)))
 			{
 				CCommand args;
 				args.Tokenize(CFmtStr("dota_select_hero %s reserve", pszHero));
@@ -168,10 +169,10 @@ void ForcedHeroes::OnDOTAGameStateChange(uint32 oldState, uint32 state)
 
 		for (int i = 1; i <= engine->GetServerGlobals()->maxClients; ++i)
 		{
-			const CSteamID *pId = engine->GetClientSteamID(i);
-			if (pId && players.Find(*pId) != -1)
+			CSteamID sid = g_PlayerIdentities.SteamIdFromEntity(i);
+			if (sid.IsValid() && players.Find(sid) != -1)
 			{
-				s_NoRepick.AddToTail(*pId);
+				s_NoRepick.AddToTail(sid);
 				PickRandomHero(i);
 			}
 		}
@@ -190,7 +191,8 @@ void ForcedHeroes::PickRandomHero(CEntityIndex idx)
 
 void ForcedHeroes::Hook_ClientCommand(CEntityIndex ent, const CCommand &args)
 {
-	const CSteamID *sid = engine->GetClientSteamID(ent);
+	CSteamID steamId = g_PlayerIdentities.SteamIdFromEntity(ent);
+	const CSteamID *sid = steamId.IsValid() ? &steamId : nullptr;
 	// dota_select_hero repick
 	if (args.ArgC() >= 2)
 	{
@@ -0,0 +1,91 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "gcframe.h"
+
+#include <google/protobuf/message.h>
+
+#include <string.h>
+
+static const uint32 kFrameHeaderSize = sizeof(uint32) + sizeof(int32);
+
+// Only a handful of frames are ever queued at once. Buffers past this are
+// let go, as are ones grown far past what lobby updates need.
+static const size_t kMaxPooledBuffers = 8;
+static const size_t kMaxPooledCapacity = 256 * 1024;
+
+static std::vector<std::vector<uint8>> s_FreeBuffers;
+
+GCFrame GCFrame::Build(uint32 emsg, const google::protobuf::Message &body, const google::protobuf::Message *pHeader)
+{
+	int32 headerSize = pHeader ? pHeader->ByteSize() : 0;
+	int32 bodySize = body.ByteSize();
+
+	GCFrame frame;
+	if (s_FreeBuffers.size())
+	{
+		frame.m_Buffer = std::move(s_FreeBuffers.back());
+		s_FreeBuffers.pop_back();
+	}
+
+	frame.m_Buffer.resize(kFrameHeaderSize + headerSize + bodySize);
+
+	uint8 *p = frame.m_Buffer.data();
+	memcpy(p, &emsg, sizeof(emsg));
+	memcpy(p + sizeof(emsg), &headerSize, sizeof(headerSize));
+	p += kFrameHeaderSize;
+
+	if (pHeader)
+	{
+		p = pHeader->SerializeWithCachedSizesToArray(p);
+	}
+
+	body.SerializeWithCachedSizesToArray(p);
+
+	return frame;
+}
+
+uint32 GCFrame::MsgType() const
+{
+	uint32 type = 0;
+	if (m_Buffer.size() >= sizeof(type))
+	{
+		memcpy(&type, m_Buffer.data(), sizeof(type));
+	}
+
+	return type;
+}
+
+void GCFrame::Release()
+{
+	if (m_Buffer.capacity() && m_Buffer.capacity() <= kMaxPooledCapacity && s_FreeBuffers.size() < kMaxPooledBuffers)
+	{
+		m_Buffer.clear();
+		s_FreeBuffers.push_back(std::move(m_Buffer));
+	}
+
+	m_Buffer = std::vector<uint8>();
+}
@@ -0,0 +1,80 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <utility>
+#include <vector>
+
+namespace google {
+namespace protobuf {
+class Message;
+}
+}
+
+// Set in the emsg of messages with a protobuf header.
+static const uint32 kGCProtoBufFlag = 0x80000000;
+
+// A GC message as the game retrieves it: emsg, header size, header, then
+// body. Both messages are sized once and serialized
+// straight into the frame. Buffers come from a pool and go back to it when
+// the frame is destroyed, so steady state injection doesn't allocate.
+//
+// Game thread only.
+class GCFrame
+{
+public:
+	GCFrame() = default;
+	GCFrame(GCFrame &&other) : m_Buffer(std::move(other.m_Buffer)) {}
+	~GCFrame() { Release(); }
+
+	GCFrame &operator=(GCFrame &&other)
+	{
+		if (this != &other)
+		{
+			Release();
+			m_Buffer = std::move(other.m_Buffer);
+		}
+		return *this;
+	}
+
+	GCFrame(const GCFrame &) = delete;
+	GCFrame &operator=(const GCFrame &) = delete;
+
+	// emsg is written as given, flag included. The header is left empty if
+	// not given.
+	static GCFrame Build(uint32 emsg, const google::protobuf::Message &body, const google::protobuf::Message *pHeader = nullptr);
+
+	const uint8 *Data() const { return m_Buffer.data(); }
+	uint32 Size() const { return (uint32)m_Buffer.size(); }
+	uint32 MsgType() const;
+private:
+	void Release();
+private:
+	std::vector<uint8> m_Buffer;
+};
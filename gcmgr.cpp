@@ -35,6 +35,7 @@
 #include "util.h"
 
 #include <tier1/fmtstr.h>
+#include <algorithm>
 #include <generated_proto/dota_gcmessages_msgid.pb.h>
 #include <generated_proto/gcsystemmsgs.pb.h>
 
@@ -58,6 +59,13 @@ static ISteamGameCoordinator *gamecoordinator = nullptr;
 
 bool GCManager::OnLoad()
 {
+	Subscribe(this, GCDirection::Incoming, k_EMsgGCGCToRelayConnect);
+	Subscribe(this, GCDirection::Incoming, k_EMsgGCToServerConsoleCommand);
+	Subscribe(this, GCDirection::Incoming, k_EMsgGCRequestBatchPlayerResourcesResponse);
+	Subscribe(this, GCDirection::Incoming, k_EMsgGCGameMatchSignOutPermissionResponse);
+	Subscribe(this, GCDirection::Outgoing, k_EMsgGCPlayerFailedToConnect);
+	Subscribe(this, GCDirection::Outgoing, k_EMsgGCGameMatchSignOut);
+
 	int hookId = SH_ADD_HOOK(ISource2Server, GameServerSteamAPIActivated, gamedll, SH_MEMBER(this, &GCManager::Hook_GameServerSteamAPIActivated), false);
 
 #ifdef _WIN32
@@ -90,46 +98,32 @@ bool GCManager::OnLoad()
 	DevMsg("Found BGetCallback at 0x%p\n", fnSteam_BGetCallback);
 	DevMsg("Found FreeLastCallback at 0x%p\n", fnSteam_FreeLastCallback);
 
-	m_HookGetCallback = subhook_new((void *)fnSteam_BGetCallback, (void *)&Hook_Steam_BGetCallback,
-#if defined( __x86_64__ ) || defined( _M_X64 )
-		SUBHOOK_OPTION_64BIT_OFFSET
-#else
-		subhook_options_t(0)
-#endif
-	);
-	if (m_HookGetCallback == NULL)
+	if (!m_GetCallbackDetour.Create((void *)fnSteam_BGetCallback, (void *)&Hook_Steam_BGetCallback))
 	{
 		Msg("!!!!! Failed to create GetCallback hook.\n");
 		return false;
 	}
 
-	m_HookFreeCallback = subhook_new((void *)fnSteam_FreeLastCallback, (void *)&Hook_Steam_FreeLastCallback,
-#if defined( __x86_64__ ) || defined( _M_X64 )
-		SUBHOOK_OPTION_64BIT_OFFSET
-#else
-		subhook_options_t(0)
-#endif
-	);
-	if (m_HookFreeCallback == NULL)
+	if (!m_FreeCallbackDetour.Create((void *)fnSteam_FreeLastCallback, (void *)&Hook_Steam_FreeLastCallback))
 	{
 		Msg("!!!!! Failed to create FreeCallback hook.\n");
 		return false;
 	}
 
-	if (0 != subhook_install(m_HookGetCallback))
+	if (!m_GetCallbackDetour.Install())
 	{
 		Msg("!!!!! Failed to install GetCallback hook.\n");
 		return false;
 	}
 
-	if (0 != subhook_install(m_HookFreeCallback))
+	if (!m_FreeCallbackDetour.Install())
 	{
 		Msg("!!!!! Failed to install FreeCallback hook.\n");
 		return false;
 	}
 
-	DevMsg("GetCallback (func: 0x%p) (src: 0x%p) (dst: 0x%p) (realdst: 0x%p)\n", fnSteam_BGetCallback, subhook_get_src(m_HookGetCallback), subhook_get_dst(m_HookGetCallback), &Hook_Steam_BGetCallback);
-	DevMsg("FreeCallback (func: 0x%p) (src: 0x%p) (dst: 0x%p) (realdst: 0x%p)\n", fnSteam_FreeLastCallback, subhook_get_src(m_HookFreeCallback), subhook_get_dst(m_HookFreeCallback), &Hook_Steam_FreeLastCallback);
+	DevMsg("GetCallback (func: 0x%p) (trampoline: 0x%p) (hook: 0x%p)\n", fnSteam_BGetCallback, m_GetCallbackDetour.Trampoline(), &Hook_Steam_BGetCallback);
+	DevMsg("FreeCallback (func: 0x%p) (trampoline: 0x%p) (hook: 0x%p)\n", fnSteam_FreeLastCallback, m_FreeCallbackDetour.Trampoline(), &Hook_Steam_FreeLastCallback);
 
 	return hookId != 0;
 }
@@ -144,12 +138,11 @@ void GCManager::OnUnload()
 	}
 
 	m_SteamHooks.clear();
+	m_GCMsgsToInject = std::queue<InjectedMessage>();
+	Unsubscribe(this);
 
-	subhook_remove(m_HookGetCallback);
-	subhook_remove(m_HookFreeCallback);
-	
-	subhook_free(m_HookGetCallback);
-	subhook_free(m_HookFreeCallback);
+	m_GetCallbackDetour.Free();
+	m_FreeCallbackDetour.Free();
 }
 
 void GCManager::Hook_GameServerSteamAPIActivated()
@@ -182,36 +175,78 @@ void GCManager::Hook_GameServerSteamAPIActivated()
 		CMsgClientWelcome welcomeMsg;
 		welcomeMsg.set_version(1);
 
-		uint32 emsg = k_EMsgGCServerWelcome;
-		int hdrSize = welcomeHdr.ByteSize();
-
-		std::string message;
-		message.append((const char *)&emsg, sizeof(uint32));
-		message.append((const char *)&hdrSize, sizeof(int));
-		welcomeHdr.AppendToString(&message);
-		welcomeMsg.AppendToString(&message);
-		InjectGCMessage(message);
+		InjectGCMessage(GCFrame::Build(k_EMsgGCServerWelcome, welcomeMsg, &welcomeHdr));
 	}
 
 	RETURN_META(MRES_IGNORED);
 }
 
+void GCManager::InjectGCMessage(GCFrame &&frame)
+{
+	m_GCMsgsToInject.push({ std::move(frame), Plat_FloatTime() });
+
+	// While a fake callback is out, the free re-arms the notify if anything
+	// is left, so the rest goes in the same callback pump.
+	if (m_Notify == SteamGCNotify::None)
+	{
+		m_Notify = SteamGCNotify::NeedsNotify;
+	}
+}
+
+void GCManager::OnSteamGCNotify()
+{
+	m_Notify = SteamGCNotify::NeedsFree;
+	m_InjectQueuedAtNotify = m_GCMsgsToInject.size();
+	++m_InjectNotifies;
+}
+
+void GCManager::OnSteamGCFree()
+{
+	size_t queued = m_GCMsgsToInject.size();
+	size_t retrieved = m_InjectQueuedAtNotify > queued ? m_InjectQueuedAtNotify - queued : 0;
+	m_InjectPumpCount += (uint32)retrieved;
+
+	// Steam_RunCallbacks keeps calling BGetCallback until it returns false,
+	// so re-arming here hands out another fake callback in the same pump.
+	// Only if the game took something from this one, so a game that isn't
+	// retrieving can't spin the pump. Otherwise OnGameFrame re-arms it.
+	if (queued && retrieved)
+	{
+		m_Notify = SteamGCNotify::NeedsNotify;
+		return;
+	}
+
+	m_Notify = SteamGCNotify::None;
+	if (m_InjectPumpCount)
+	{
+		m_InjectPerPump.Add(m_InjectPumpCount);
+		m_InjectPumpCount = 0;
+	}
+}
+
+void GCManager::OnGameFrame()
+{
+	if (m_Notify == SteamGCNotify::None && m_GCMsgsToInject.size())
+	{
+		m_Notify = SteamGCNotify::NeedsNotify;
+	}
+}
+
+void GCManager::PrintDebug() const
+{
+	char szBuf[256];
+	Msg("GC inject: %u queued, %u notifies\n", (uint32)m_GCMsgsToInject.size(), m_InjectNotifies);
+	m_InjectLatency.Format(szBuf, sizeof(szBuf));
+	Msg("- latency ms: %s\n", szBuf);
+	m_InjectPerPump.Format(szBuf, sizeof(szBuf));
+	Msg("- per pump: %s\n", szBuf);
+}
+
 static bool Hook_Steam_BGetCallback(HSteamPipe hPipe, CallbackMsg_t *pCallback, HSteamCall hCall)
 {
 	if (!g_GCMgr.NeedsSteamGCNotify())
 	{
-#if defined( __x86_64__ ) || defined ( _M_X64 )
-		// For x64, need to remove and re-add detour before calling trampoline.
-		// Due to bug in subhook, trampoline code does not account for more that 
-		// 32-bit difference between original func and trampoline
-		subhook_remove(g_GCMgr.m_HookGetCallback);
-		bool ret = fnSteam_BGetCallback(hPipe, pCallback, hCall);
-		subhook_install(g_GCMgr.m_HookGetCallback);
-		return ret;
-#else
-		void *pTramp = subhook_get_trampoline(g_GCMgr.m_HookGetCallback);
-		return ((Steam_BGetCallback)pTramp)(hPipe, pCallback, hCall);
-#endif
+		return g_GCMgr.m_GetCallbackDetour.Original<Steam_BGetCallback>()(hPipe, pCallback, hCall);
 	}
 
 	static GCMessageAvailable_t gcmsg;
@@ -230,23 +265,13 @@ static bool Hook_Steam_BGetCallback(HSteamPipe hPipe, CallbackMsg_t *pCallback,
 
 static void Hook_Steam_FreeLastCallback(HSteamPipe hPipe)
 {
-	if (g_GCMgr.NeedsSteamGCNotify())
+	if (g_GCMgr.NeedsSteamGCFree())
 	{
 		g_GCMgr.OnSteamGCFree();
 		return;
 	}
 
-#if defined( __x86_64__ ) || defined ( _M_X64 )
-	// For x64, need to remove and re-add detour before calling trampoline.
-	// Due to bug in subhook, trampoline code does not account for more that 
-	// 32-bit difference between original func and trampoline
-	subhook_remove(g_GCMgr.m_HookFreeCallback);
-	fnSteam_FreeLastCallback(hPipe);
-	subhook_install(g_GCMgr.m_HookFreeCallback);
-#else
-	void *pTramp = subhook_get_trampoline(g_GCMgr.m_HookFreeCallback);
-	((Steam_FreeLastCallback)pTramp)(hPipe);
-#endif
+	g_GCMgr.m_FreeCallbackDetour.Original<Steam_FreeLastCallback>()(hPipe);
 }
 
 bool GCManager::Hook_IsMessageAvailable(uint32 *pcubMsgSize)
@@ -254,7 +279,7 @@ bool GCManager::Hook_IsMessageAvailable(uint32 *pcubMsgSize)
 	UTIL_LogToFile("ISM (%u to inject)\n", m_GCMsgsToInject.size());
 	if (m_GCMsgsToInject.size())
 	{
-		*pcubMsgSize = m_GCMsgsToInject.front().length();
+		*pcubMsgSize = m_GCMsgsToInject.front().frame.Size();
 		UTIL_LogToFile("Server checking for available msg and we have one of size %d\n", *pcubMsgSize);
 		RETURN_META_VALUE(MRES_SUPERCEDE, true);
 	}
@@ -266,10 +291,10 @@ EGCResults GCManager::Hook_RetrieveMessage(uint32 *punMsgType, void *pubDest, ui
 {
 	if (m_GCMsgsToInject.size())
 	{
-		auto &msg = m_GCMsgsToInject.front();
+		auto &frame = m_GCMsgsToInject.front().frame;
 
-		*punMsgType = *(uint32 *)msg.data();
-		*pcubMsgSize = msg.length();
+		*punMsgType = frame.MsgType();
+		*pcubMsgSize = frame.Size();
 
 		UTIL_LogToFile("Server retrieving for msg and we have one of size %d\n", *pcubMsgSize);
 		UTIL_LogToFile("MsgType %u (%u), cubDest %u\n", *punMsgType, (*punMsgType) & ~0x80000000, cubDest);
@@ -279,65 +304,32 @@ EGCResults GCManager::Hook_RetrieveMessage(uint32 *punMsgType, void *pubDest, ui
 			RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultBufferTooSmall);
 		}
 
-		memcpy(pubDest, msg.data(), msg.length());
+		memcpy(pubDest, frame.Data(), frame.Size());
 
+		m_InjectLatency.Add((uint64)((Plat_FloatTime() - m_GCMsgsToInject.front().flQueuedTime) * 1000.0));
 		m_GCMsgsToInject.pop();
 
 		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
 	}
 
 	EGCResults ret = SH_CALL(gamecoordinator, &ISteamGameCoordinator::RetrieveMessage)(punMsgType, pubDest, cubDest, pcubMsgSize);
-
-	int realMsg = (*punMsgType) & ~0x80000000;
-
-	switch (realMsg)
+	if (ret != k_EGCResultOK)
 	{
-	case k_EMsgGCGCToRelayConnect:
-	case k_EMsgGCToServerConsoleCommand:
-		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultNoMessage);
-	case k_EMsgGCRequestBatchPlayerResourcesResponse:
-	{
-		CMsgDOTARequestBatchPlayerResourcesResponse msg;
-		MessageFromBuffer(msg, pubDest, cubDest);
-
-		Msg("Got k_EMsgGCRequestBatchPlayerResourcesResponse.\n");
-		for (auto &r : msg.results())
-		{
-			Msg("----------------\n");
-			Msg("%s\n", r.DebugString().c_str());
-		}
-		Msg("----------------\n");
+		RETURN_META_VALUE(MRES_SUPERCEDE, ret);
 	}
-	case k_EMsgGCGameMatchSignOutPermissionResponse:
-	{
-		UTIL_LogToFile("Intercepted incoming k_EMsgGCGameMatchSignOutPermissionResponse\n");
-		uint32 skip = 4 /*emsg*/ + 4 /*hsizesize*/ + *(int32 *)((intp)pubDest + 4) /*hsize*/;
-		void *start = (void *)((intp)pubDest + skip);
-		uint32 size = *pcubMsgSize - skip;
 
-		CMsgGameMatchSignOutPermissionResponse msg;
-		if (msg.ParseFromArray(start, size))
-		{
-			msg.set_permission_granted(true);
-			msg.clear_retry_delay_seconds();
-			uint32 newMsgSize = (uint32)msg.ByteSize();
-			if (newMsgSize > (cubDest - skip))
-			{
-				RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultBufferTooSmall);
-			}
-
-			msg.SerializeToArray(start, newMsgSize);
-			*pcubMsgSize = newMsgSize + skip;
-			RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
-		}
-		else
-		{
-			UTIL_MsgAndLog("Failed to parse SignOutPermissionResponse\n");
-		}
-	}
-	break;
+	GCMessageView view(*punMsgType, pubDest, *pcubMsgSize, cubDest, m_Header);
+	switch (Dispatch(GCDirection::Incoming, view))
+	{
+	case GCMessageAction::Block:
+		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultNoMessage);
+	case GCMessageAction::BufferTooSmall:
+		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultBufferTooSmall);
+	default:
+		break;
 	}
 
+	*pcubMsgSize = view.Size();
 	RETURN_META_VALUE(MRES_SUPERCEDE, ret);
 }
 
@@ -361,91 +353,202 @@ EGCResults GCManager::Hook_RetrieveMessagePost(uint32 *punMsgType, void *pubDest
 
 EGCResults GCManager::Hook_SendMessage(uint32 unMsgType, const void *pubData, uint32 cubData)
 {
-	int realMsg = unMsgType & ~0x80000000;
-
-	switch (realMsg)
+	// Outgoing messages are never rewritten, so the view has no room to.
+	GCMessageView view(unMsgType, const_cast<void *>(pubData), cubData, cubData, m_Header);
+	if (Dispatch(GCDirection::Outgoing, view) == GCMessageAction::Block)
 	{
-	case k_EMsgGCLiveScoreboardUpdate:
+		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
+	}
+
+	RETURN_META_VALUE(MRES_IGNORED, k_EGCResultOK);
+}
+
+void GCManager::Subscribe(IGCMessageHandler *pHandler, GCDirection dir, uint32 emsg)
+{
+	m_Handlers[(int)dir][emsg].push_back(pHandler);
+}
+
+void GCManager::Unsubscribe(IGCMessageHandler *pHandler)
+{
+	for (auto &table : m_Handlers)
 	{
-		DevMsg("!!!!! GOT SCOREBOARD UPDATE (%.2f)\n", Plat_FloatTime());
+		for (auto iter = table.begin(); iter != table.end();)
+		{
+			auto &handlers = iter->second;
+			handlers.erase(std::remove(handlers.begin(), handlers.end(), pHandler), handlers.end());
+			if (handlers.empty())
+			{
+				iter = table.erase(iter);
+			}
+			else
+			{
+				++iter;
+			}
+		}
+	}
+}
 
-		// Set league_id in lobby for this to work (1 is fine)
-		CMsgDOTALiveScoreboardUpdate msg;
-		MessageFromBuffer(msg, pubData, cubData);
-		g_D2Lobby.OnLiveStatsUpdate(msg);
+GCMessageAction GCManager::Dispatch(GCDirection dir, GCMessageView &msg)
+{
+	auto &table = m_Handlers[(int)dir];
+	auto iter = table.find(msg.EMsg());
+	if (iter == table.end())
+		return GCMessageAction::Pass;
 
-		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
+	for (auto *pHandler : iter->second)
+	{
+		GCMessageAction action = pHandler->OnGCMessage(dir, msg);
+		if (action != GCMessageAction::Pass)
+			return action;
 	}
-	case k_EMsgGCPlayerFailedToConnect:
+
+	return GCMessageAction::Pass;
+}
+
+GCMessageAction GCManager::OnGCMessage(GCDirection dir, GCMessageView &msg)
+{
+	switch (msg.EMsg())
 	{
+	case k_EMsgGCGCToRelayConnect:
+	case k_EMsgGCToServerConsoleCommand:
+		return GCMessageAction::Block;
+	case k_EMsgGCRequestBatchPlayerResourcesResponse:
+		if (msg.ParseBody(m_BatchPlayerResources))
+		{
+			Msg("Got k_EMsgGCRequestBatchPlayerResourcesResponse.\n");
+			for (auto &r : m_BatchPlayerResources.results())
+			{
+				Msg("----------------\n");
+				Msg("%s\n", r.DebugString().c_str());
+			}
+			Msg("----------------\n");
+		}
+		return GCMessageAction::Pass;
+	case k_EMsgGCGameMatchSignOutPermissionResponse:
+		return OnSignOutPermission(msg);
+	case k_EMsgGCPlayerFailedToConnect:
 		UTIL_MsgAndLog("Intercepted outgoing k_EMsgGCPlayerFailedToConnect\n");
 
-		CMsgDOTAPlayerFailedToConnect msg;
-		MessageFromBuffer(msg, pubData, cubData);
-		g_D2Lobby.OnGCPlayerFailedToConnect(msg);
-
-		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
+		msg.ParseBody(m_FailedToConnect);
+		g_D2Lobby.OnGCPlayerFailedToConnect(m_FailedToConnect);
+		return GCMessageAction::Block;
+	case k_EMsgGCGameMatchSignOut:
+		return OnMatchSignOut(msg);
 	}
-	case k_EMsgGCConnectedPlayers:
-	{
-		CMsgConnectedPlayers msg;
-		MessageFromBuffer(msg, pubData, cubData);
 
-		UTIL_MsgAndLog("Intercepted outgoing k_EMsgGCConnectedPlayers (%s)\n", CMsgConnectedPlayers_SendReason_Name(msg.send_reason()).c_str());
+	return GCMessageAction::Pass;
+}
 
-		g_LobbyMgr.HandleConnectedPlayers(msg);
+GCMessageAction GCManager::OnSignOutPermission(GCMessageView &msg)
+{
+	UTIL_LogToFile("Intercepted incoming k_EMsgGCGameMatchSignOutPermissionResponse\n");
 
-		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
-	}
-	case k_EMsgGCGameMatchSignOut:
+	if (!msg.ParseBody(m_SignOutPermission))
 	{
-		UTIL_LogToFile("Intercepted outgoing k_EMsgGCGameMatchSignOut\n");
+		UTIL_MsgAndLog("Failed to parse SignOutPermissionResponse\n");
+		return GCMessageAction::Pass;
+	}
 
-		UTIL_LogToFile("Building match end data\n");
+	m_SignOutPermission.set_permission_granted(true);
+	m_SignOutPermission.clear_retry_delay_seconds();
+	if (!msg.ReplaceBody(m_SignOutPermission))
+		return GCMessageAction::BufferTooSmall;
 
-		CMsgProtoBufHeader hdrIn;
-		HeaderFromBuffer(hdrIn, pubData, cubData);
-		uint64 jobId_gs = hdrIn.job_id_source();
+	return GCMessageAction::Pass;
+}
 
-		CMsgGameMatchSignOut msgIn;
-		MessageFromBuffer(msgIn, pubData, cubData);
+GCMessageAction GCManager::OnMatchSignOut(GCMessageView &msg)
+{
+	UTIL_LogToFile("Intercepted outgoing k_EMsgGCGameMatchSignOut\n");
 
-		g_D2Lobby.OnGCMatchSignOut(msgIn);
-		
-		CMsgProtoBufHeader hdrOut;
-		hdrOut.set_job_id_target(jobId_gs);
+	UTIL_LogToFile("Building match end data\n");
 
-		CMsgGameMatchSignoutResponse msgOut;
-		msgOut.set_match_id(g_LobbyMgr.MatchId());
+	uint64 jobId_gs = msg.Header().job_id_source();
 
-		uint32 emsg = k_EMsgGCGameMatchSignOutResponse | 0x80000000;
-		int headerSize = hdrOut.ByteSize();
+	msg.ParseBody(m_SignOut);
 
-		std::string message;
-		message.append((const char *)&emsg, sizeof(uint32));
-		message.append((const char *)&headerSize, sizeof(int));
-		hdrOut.AppendToString(&message);
-		msgOut.AppendToString(&message);
+	g_D2Lobby.OnGCMatchSignOut(m_SignOut);
 
-		Msg("Adding SignOutResposne message to the queue\n");
+	CMsgProtoBufHeader hdrOut;
+	hdrOut.set_job_id_target(jobId_gs);
 
-		InjectGCMessage(message);
+	CMsgGameMatchSignoutResponse msgOut;
+	msgOut.set_match_id(g_LobbyMgr.MatchId());
 
-		if (msgIn.good_guys_win())
-		{
-			g_LobbyMgr.EnterPostGame(k_EMatchOutcome_RadVictory);
-		}
-		else
+	Msg("Adding SignOutResposne message to the queue\n");
+
+	InjectGCMessage(GCFrame::Build(k_EMsgGCGameMatchSignOutResponse | kGCProtoBufFlag, msgOut, &hdrOut));
+
+	if (m_SignOut.good_guys_win())
+	{
+		g_LobbyMgr.EnterPostGame(k_EMatchOutcome_RadVictory);
+	}
+	else
+	{
+		g_LobbyMgr.EnterPostGame(k_EMatchOutcome_DireVictory);
+	}
+	//g_LobbyMgr.DeleteLobby();
+
+	return GCMessageAction::Block;
+}
+
+static const uint32 kFrameHeaderSize = sizeof(uint32) + sizeof(int32);
+
+uint32 GCMessageView::BodyOffset() const
+{
+	if (m_Size < kFrameHeaderSize)
+		return 0;
+
+	int32 headerSize;
+	memcpy(&headerSize, m_pData + sizeof(uint32), sizeof(headerSize));
+	if (headerSize < 0 || (uint32)headerSize > m_Size - kFrameHeaderSize)
+		return 0;
+
+	return kFrameHeaderSize + headerSize;
+}
+
+const CMsgProtoBufHeader &GCMessageView::Header()
+{
+	if (!m_bHeaderParsed)
+	{
+		m_bHeaderParsed = true;
+		m_Header.Clear();
+
+		uint32 bodyOffset = BodyOffset();
+		if (bodyOffset)
 		{
-			g_LobbyMgr.EnterPostGame(k_EMatchOutcome_DireVictory);
+			m_Header.ParsePartialFromArray(m_pData + kFrameHeaderSize, bodyOffset - kFrameHeaderSize);
 		}
-		//g_LobbyMgr.DeleteLobby();
-
-		RETURN_META_VALUE(MRES_SUPERCEDE, k_EGCResultOK);
 	}
+
+	return m_Header;
+}
+
+bool GCMessageView::ParseBody(google::protobuf::Message &msg) const
+{
+	uint32 bodyOffset = BodyOffset();
+	if (!bodyOffset)
+	{
+		msg.Clear();
+		return false;
 	}
 
-	RETURN_META_VALUE(MRES_IGNORED, k_EGCResultOK);
+	return msg.ParseFromArray(m_pData + bodyOffset, m_Size - bodyOffset);
+}
+
+bool GCMessageView::ReplaceBody(const google::protobuf::Message &msg)
+{
+	uint32 bodyOffset = BodyOffset();
+	if (!bodyOffset)
+		return false;
+
+	uint32 bodySize = (uint32)msg.ByteSize();
+	if (bodySize > m_Capacity - bodyOffset)
+		return false;
+
+	msg.SerializeWithCachedSizesToArray(m_pData + bodyOffset);
+	m_Size = bodyOffset + bodySize;
+	return true;
 }
 
 GCManager g_GCMgr;
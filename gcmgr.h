@@ -25,23 +25,89 @@
 
 #pragma once
 
+#include "detour.h"
+#include "gcframe.h"
+#include "histogram.h"
 #include "pluginsystem.h"
 
 #include <steam/steam_gameserver.h>
 #include <steam/isteamgamecoordinator.h>
 
 #include <generated_proto/dota_gcmessages_common.pb.h>
+#include <generated_proto/dota_gcmessages_server.pb.h>
 
 #include <queue>
+#include <unordered_map>
 #include <vector>
-#include <subhook.h>
 
-class GCManager : public IPluginSystem
+enum class GCDirection
+{
+	// Retrieved by the game
+	Incoming,
+	// Sent by the game
+	Outgoing,
+
+	Count,
+};
+
+enum class GCMessageAction
+{
+	// Carry on with the message, as rewritten if it was.
+	Pass,
+	// Outgoing messages aren't sent and the game is told they were.
+	// Incoming ones are dropped.
+	Block,
+	// A rewritten incoming message doesn't fit the game's buffer.
+	BufferTooSmall,
+};
+
+// A GC message on its way to or from the game. Nothing is parsed until
+// asked for: the header on the first Header() call and the body only into
+// the message a handler passes to ParseBody, which it can keep and reuse.
+class GCMessageView
+{
+public:
+	GCMessageView(uint32 msgType, void *pData, uint32 size, uint32 capacity, CMsgProtoBufHeader &header)
+		: m_MsgType(msgType), m_pData((uint8 *)pData), m_Size(size), m_Capacity(capacity), m_Header(header)
+	{
+	}
+
+	uint32 EMsg() const { return m_MsgType & ~kGCProtoBufFlag; }
+	uint32 Size() const { return m_Size; }
+
+	const CMsgProtoBufHeader &Header();
+	bool ParseBody(google::protobuf::Message &msg) const;
+	// Incoming only. Replaces the body in the game's buffer, keeping the
+	// header. False if it doesn't fit.
+	bool ReplaceBody(const google::protobuf::Message &msg);
+private:
+	// Offset of the body, or 0 if the frame is malformed.
+	uint32 BodyOffset() const;
+private:
+	uint32 m_MsgType;
+	uint8 *m_pData;
+	uint32 m_Size;
+	uint32 m_Capacity;
+	CMsgProtoBufHeader &m_Header;
+	bool m_bHeaderParsed = false;
+};
+
+// Implemented by systems that want GC messages, registered per EMsg with
+// GCManager::Subscribe. Handlers for a message run in subscription order
+// until one doesn't pass it on.
+class IGCMessageHandler
+{
+public:
+	virtual GCMessageAction OnGCMessage(GCDirection dir, GCMessageView &msg) = 0;
+};
+
+class GCManager : public IPluginSystem, public IGCMessageHandler
 {
 public:
 	virtual const char *GetName() const override { return "GC Manager"; }
 	virtual bool OnLoad() override;
 	virtual void OnUnload() override;
+	virtual void OnGameFrame() override;
 public:
 	void Hook_GameServerSteamAPIActivated();
 
@@ -50,32 +116,51 @@ public:
 	EGCResults Hook_RetrieveMessagePost(uint32 *punMsgType, void *pubDest, uint32 cubDest, uint32 *pcubMsgSize);
 	EGCResults Hook_SendMessage(uint32 unMsgType, const void *pubData, uint32 cubData);
 public:
-	void InjectGCMessage(const std::string &msg) {
-		m_GCMsgsToInject.push(msg);
-		m_Notify = SteamGCNotify::NeedsNotify;
-	}
+	void InjectGCMessage(GCFrame &&frame);
+
+	void Subscribe(IGCMessageHandler *pHandler, GCDirection dir, uint32 emsg);
+	void Unsubscribe(IGCMessageHandler *pHandler);
 
 	bool NeedsSteamGCNotify() const { return m_Notify == SteamGCNotify::NeedsNotify; }
 	bool NeedsSteamGCFree() const { return m_Notify == SteamGCNotify::NeedsFree; }
 
-	void OnSteamGCNotify() { m_Notify = SteamGCNotify::NeedsFree; }
-	void OnSteamGCFree() { m_Notify = SteamGCNotify::None; }
+	void OnSteamGCNotify();
+	void OnSteamGCFree();
+	void PrintDebug() const;
+public: // IGCMessageHandler
+	GCMessageAction OnGCMessage(GCDirection dir, GCMessageView &msg) override;
 private:
-	inline bool HeaderFromBuffer(CMsgProtoBufHeader &hdr, const void *pubData, uint32 cubData)
-	{
-		int headerSize = *(int *)((intptr_t)pubData + 4);
-		return hdr.ParsePartialFromArray((const void *)((intptr_t)pubData + 8), headerSize);
-	}
-
-	template<typename T>
-	inline bool MessageFromBuffer(T &msg, const void *pubData, uint32 cubData)
-	{
-		int headerSize = *(int *)((intptr_t)pubData + 4);
-		return msg.ParseFromArray((const void *)((intptr_t)pubData + 8 + headerSize), cubData - headerSize - 8);
-	}
+	GCMessageAction Dispatch(GCDirection dir, GCMessageView &msg);
+	GCMessageAction OnMatchSignOut(GCMessageView &msg);
+	GCMessageAction OnSignOutPermission(GCMessageView &msg);
 private:
 	std::vector<int> m_SteamHooks;
-	std::queue<std::string> m_GCMsgsToInject;
+
+	// EMsg to its handlers, per direction.
+	std::unordered_map<uint32, std::vector<IGCMessageHandler *>> m_Handlers[(int)GCDirection::Count];
+	// Reused for every message that is looked at.
+	CMsgProtoBufHeader m_Header;
+	CMsgGameMatchSignOut m_SignOut;
+	CMsgGameMatchSignOutPermissionResponse m_SignOutPermission;
+	CMsgDOTAPlayerFailedToConnect m_FailedToConnect;
+	CMsgDOTARequestBatchPlayerResourcesResponse m_BatchPlayerResources;
+
+	struct InjectedMessage
+	{
+		GCFrame frame;
+		double flQueuedTime;
+	};
+	std::queue<InjectedMessage> m_GCMsgsToInject;
+	// Queue size when the last fake callback was handed out, to tell
+	// whether the game retrieved anything before freeing it.
+	size_t m_InjectQueuedAtNotify = 0;
+
+	// Milliseconds from InjectGCMessage to the game retrieving the message.
+	Histogram m_InjectLatency;
+	// Messages retrieved per fake callback cycle.
+	Histogram m_InjectPerPump;
+	uint32 m_InjectPumpCount = 0;
+	uint32 m_InjectNotifies = 0;
 
 	enum class SteamGCNotify
 	{
@@ -85,8 +170,8 @@ private:
 	};
 	SteamGCNotify m_Notify = SteamGCNotify::None;
 public:
-	subhook_t m_HookGetCallback;
-	subhook_t m_HookFreeCallback;
+	Detour m_GetCallbackDetour;
+	Detour m_FreeCallbackDetour;
 };
 
 extern GCManager g_GCMgr;
@@ -0,0 +1,92 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+// Counts samples in power-of-two buckets. Cheap enough to update on every
+// sample and good enough for rough percentiles. Bucket 0 holds zero and
+// bucket n holds [2^(n-1), 2^n).
+class Histogram
+{
+public:
+	static const int kBuckets = 40;
+public:
+	void Add(uint64 value)
+	{
+		int bucket = 0;
+		while (bucket < kBuckets - 1 && value >= (1ull << bucket))
+			++bucket;
+
+		++m_Buckets[bucket];
+		++m_Count;
+		m_Sum += value;
+		if (value > m_Max)
+			m_Max = value;
+	}
+
+	uint64 Count() const { return m_Count; }
+	uint64 Max() const { return m_Max; }
+	double Mean() const { return m_Count ? (double)m_Sum / m_Count : 0.0; }
+
+	// Upper bound of the bucket the given percentile (0-100) falls in.
+	uint64 Percentile(double pct) const
+	{
+		uint64 target = (uint64)(m_Count * pct / 100.0 + 0.5);
+		uint64 seen = 0;
+		for (int i = 0; i < kBuckets; ++i)
+		{
+			seen += m_Buckets[i];
+			if (seen >= target && seen > 0)
+			{
+				uint64 upper = i ? (1ull << i) - 1 : 0;
+				return upper < m_Max ? upper : m_Max;
+			}
+		}
+
+		return m_Max;
+	}
+
+	void Format(char *pszBuf, size_t len) const
+	{
+		snprintf(pszBuf, len, "n=%" PRIu64 " mean=%.1f p50<=%" PRIu64 " p90<=%" PRIu64 " p99<=%" PRIu64 " max=%" PRIu64,
+			m_Count, Mean(), Percentile(50.0), Percentile(90.0), Percentile(99.0), m_Max);
+	}
+
+	void Reset()
+	{
+		*this = Histogram();
+	}
+private:
+	uint64 m_Buckets[kBuckets] = {};
+	uint64 m_Count = 0;
+	uint64 m_Sum = 0;
+	uint64 m_Max = 0;
+};
@@ -23,91 +23,654 @@
  * code used.  Additionally, this exception is granted to all derivative works.
  */
 
+
 #include "httpmgr.h"
 
 #include "util.h"
 
-extern ConVar match_post_url;
+#include <algorithm>
+
+static ConVar d2lobby_http_transport("d2lobby_http_transport", "steam", FCVAR_RELEASE, "Where HTTP requests go: steam, simulated for testing without a backend, or discard");
 
 HTTPManager g_HTTPManager;
 
-#undef strdup
+CON_COMMAND(d2lobby_http_stats, "Prints HTTP request latency and size statistics per payload kind")
+{
+	g_HTTPManager.PrintStats();
+}
+
+CON_COMMAND(d2lobby_sink_add, "d2lobby_sink_add <name> <url> [kinds] - Adds an HTTP sink that payloads are also sent to")
+{
+	if (args.ArgC() < 3)
+	{
+		Msg("d2lobby_sink_add <name> <url> [kinds]\n");
+		return;
+	}
+
+	if (g_HTTPManager.FindSink(args[1]))
+	{
+		Msg("Sink %s already exists\n", args[1]);
+		return;
+	}
+
+	uint32 kinds = kAllPayloadKinds;
+	if (args.ArgC() >= 4 && !PayloadKindMaskFromString(args[3], kinds))
+	{
+		Msg("Invalid kinds \"%s\". Expected \"all\" or a comma separated list of payload kinds\n", args[3]);
+		return;
+	}
+
+	HTTPSink *pSink = g_HTTPManager.AddSink(args[1]);
+	pSink->SetOption("url", args[2]);
+	if (args.ArgC() >= 4)
+	{
+		pSink->SetOption("kinds", args[3]);
+	}
+}
+
+CON_COMMAND(d2lobby_sink_set, "d2lobby_sink_set <name> <option> <value> - Sets url, kinds, events, max_attempts, retry_delay, retry_max_delay, max_inflight, queue_budget, compression, format, batch_size or batch_delay for an HTTP sink")
+{
+	if (args.ArgC() < 4)
+	{
+		Msg("d2lobby_sink_set <name> <option> <value>\n");
+		return;
+	}
+
+	HTTPSink *pSink = g_HTTPManager.FindSink(args[1]);
+	if (!pSink)
+	{
+		Msg("No sink named %s\n", args[1]);
+		return;
+	}
+
+	if (!pSink->SetOption(args[2], args[3]))
+	{
+		Msg("Invalid option %s or value \"%s\"\n", args[2], args[3]);
+	}
+}
+
+CON_COMMAND(d2lobby_sink_remove, "d2lobby_sink_remove <name> - Removes an HTTP sink, discarding anything it has queued")
+{
+	if (args.ArgC() < 2)
+	{
+		Msg("d2lobby_sink_remove <name>\n");
+		return;
+	}
+
+	if (!g_HTTPManager.RemoveSink(args[1]))
+	{
+		Msg("No removable sink named %s\n", args[1]);
+	}
+}
+
+CON_COMMAND(d2lobby_sinks, "Lists HTTP sinks and their settings")
+{
+	g_HTTPManager.PrintSinks();
+}
+
+uint64 HTTPManager::AllocateInFlight(HTTPSink *pSink, const QueuedRequest &req, bool bProbe)
+{
+	uint32 index;
+	if (m_FreeInFlightSlots.size())
+	{
+		index = m_FreeInFlightSlots.back();
+		m_FreeInFlightSlots.pop_back();
+	}
+	else
+	{
+		index = (uint32)m_InFlight.size();
+		m_InFlight.emplace_back();
+	}
+
+	InFlightSlot &slot = m_InFlight[index];
+	slot.pSink = pSink;
+	slot.request = req;
+	slot.bUsed = true;
+	slot.bProbe = bProbe;
+	++m_InFlightCount;
+
+	return ((uint64)slot.generation << 32) | index;
+}
+
+void HTTPManager::FreeInFlight(uint64 requestId)
+{
+	InFlightSlot &slot = m_InFlight[(uint32)requestId];
+	slot.pSink = nullptr;
+	slot.request = QueuedRequest();
+	slot.bUsed = false;
+	++slot.generation;
+	--m_InFlightCount;
+
+	m_FreeInFlightSlots.push_back((uint32)requestId);
+}
+
+void HTTPManager::OnHTTPCompleted(uint64 requestId, int status, const uint8 *pResponse, uint32 responseSize)
+{
+	uint32 index = (uint32)requestId;
+	if (index >= m_InFlight.size() || !m_InFlight[index].bUsed || m_InFlight[index].generation != (uint32)(requestId >> 32))
+		return;
+
+	HTTPSink *pSink = m_InFlight[index].pSink;
+	QueuedRequest req = std::move(m_InFlight[index].request);
+	bool bProbe = m_InFlight[index].bProbe;
+	FreeInFlight(requestId);
+
+	// Its sink was removed while it was in flight.
+	if (!pSink)
+		return;
+
+	bool bSuccess = status >= 200 && status <= 299
+		&& responseSize >= 2 && pResponse[0] == 'o' && pResponse[1] == 'k';
+
+	req.flCompleteTime = Plat_FloatTime();
+	req.status = status;
+	RecordAttempt(req, bSuccess);
+
+	pSink->OnRequestCompleted(req, bProbe, bSuccess);
+
+	// A slot just opened up.
+	pSink->Pump();
+}
+
+bool HTTPManager::OnLoad()
+{
+	m_Sinks.push_back(new HTTPSink("match", true));
+
+	// A spool failure only costs durability, so it doesn't fail the load.
+	g_PayloadSpool.Open(m_SpoolReplay);
+	g_BodyCompressor.Start();
+
+	return true;
+}
 
-HTTPManager::TrackedRequest::TrackedRequest(HTTPRequestHandle hndl, SteamAPICall_t hCall, const char *pszText)
+void HTTPManager::OnUnload()
 {
-	m_hHTTPReq = hndl;
-	m_CallResult.SetGameserverFlag();
-	m_CallResult.Set(hCall, this, &TrackedRequest::OnHTTPRequestCompleted);
+	if (HasAnyPendingRequests())
+	{
+		UTIL_LogToFile("Discarding %u in-flight HTTP request(s) and everything queued\n", m_InFlightCount);
+	}
+
+	g_BodyCompressor.Stop();
 
-	m_pszText = strdup(pszText);
+	SteamHTTPTransport()->CancelAll();
+	SimulatedHTTPTransport()->CancelAll();
+	DiscardHTTPTransport()->CancelAll();
+	m_InFlight.clear();
+	m_FreeInFlightSlots.clear();
+	m_InFlightCount = 0;
 
-	g_HTTPManager.m_PendingRequests.push_back(this);
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		delete pSink;
+	}
+	m_Sinks.clear();
+
+	m_SpoolRefs.clear();
+	m_SpoolReplay.clear();
+
+	// Anything not yet acknowledged stays in the spool for the next load.
+	g_PayloadSpool.Close();
 }
 
-HTTPManager::TrackedRequest::~TrackedRequest()
+void HTTPManager::OnGameFrame()
 {
-	for (auto e = g_HTTPManager.m_PendingRequests.begin(); e != g_HTTPManager.m_PendingRequests.end(); ++e)
+	SteamHTTPTransport()->RunFrame();
+	SimulatedHTTPTransport()->RunFrame();
+	DiscardHTTPTransport()->RunFrame();
+
+	if (Transport()->IsAvailable() && m_SpoolReplay.size() && HasAnySink())
 	{
-		if (*e == this)
+		UTIL_LogToFile("Resending %u spooled payload(s)\n", (uint32)m_SpoolReplay.size());
+		for (auto &r : m_SpoolReplay)
 		{
-			g_HTTPManager.m_PendingRequests.erase(e);
-			break;
+			QueuedRequest req;
+			req.body = r.payload;
+			req.spoolIds.push_back(r.id);
+			req.kind = r.kind < (uint8)PayloadKind::Count ? (PayloadKind)r.kind : PayloadKind::Events;
+			req.flEnqueueTime = Plat_FloatTime();
+
+			PayloadRef bodies[(int)WireFormat::Count];
+			bodies[(int)WireFormat::JSON] = r.payload;
+			Admit(req, bodies, nullptr, 0, &r.settled);
 		}
+		m_SpoolReplay.clear();
+		m_SpoolReplay.shrink_to_fit();
+	}
+
+	CollectCompressed();
+
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		pSink->RunFrame();
 	}
+}
 
-	free(m_pszText);
+void HTTPManager::Post(const PayloadRef &payload, PayloadKind kind, const json_t *pSource, uint32 eventMask)
+{
+	PayloadRef bodies[(int)WireFormat::Count];
+	bodies[(int)WireFormat::JSON] = payload;
+	Post(bodies, kind, pSource, eventMask);
 }
 
-void HTTPManager::TrackedRequest::OnHTTPRequestCompleted(HTTPRequestCompleted_t *arg, bool bFailed)
+void HTTPManager::Post(const PayloadRef *pBodies, PayloadKind kind, const json_t *pSource, uint32 eventMask, bool bDiscard)
 {
-	if (bFailed || arg->m_eStatusCode < 200 || arg->m_eStatusCode > 299)
+	//	UTIL_MsgAndLog("Sending HTTP:\n%s\n", payload->Data());
+
+	if (!HasSinkFor(kind))
+		return;
+
+	PayloadRef bodies[(int)WireFormat::Count];
+	for (int f = 0; f < (int)WireFormat::Count; ++f)
 	{
-		g_HTTPManager.PostJSONToMatchUrl(m_pszText);
+		bodies[f] = pBodies[f];
 	}
-	else
+
+	const PayloadRef &payload = bodies[(int)WireFormat::JSON];
+
+	QueuedRequest req;
+	req.body = payload;
+	req.kind = kind;
+	req.flEnqueueTime = Plat_FloatTime();
+	req.bDiscard = bDiscard;
+
+	// Spooled before anything else so it survives a crash or restart while
+	// it is in flight or queued. The spool always holds the uncompressed body.
+	if (HTTPSink::IsSpooled(kind) && !bDiscard)
+	{
+		uint64 spoolId = g_PayloadSpool.Append(payload, (uint8)kind);
+		if (spoolId)
+		{
+			req.spoolIds.push_back(spoolId);
+		}
+	}
+
+	Admit(req, bodies, pSource, eventMask);
+}
+
+void HTTPManager::PostLiveUpdate(const PayloadRef &payload, const json_t *pSource, uint32 seq, uint32 baseSeq)
+{
+	QueuedRequest req;
+	req.body = payload;
+	req.kind = PayloadKind::Update;
+	req.flEnqueueTime = Plat_FloatTime();
+	req.liveSeq = seq;
+	req.liveBaseSeq = baseSeq;
+
+	PayloadRef bodies[(int)WireFormat::Count];
+	bodies[(int)WireFormat::JSON] = payload;
+	Admit(req, bodies, pSource, 0);
+}
+
+bool HTTPManager::IsLiveSinkBehind(uint32 seq) const
+{
+	for (HTTPSink *pSink : m_Sinks)
 	{
-		uint32 size;
-		http->GetHTTPResponseBodySize(arg->m_hRequest, &size);
+		if (pSink->Accepts(PayloadKind::Update) && !pSink->HasOutstanding(PayloadKind::Update) && pSink->LiveSeq() != seq)
+			return true;
+	}
+
+	return false;
+}
+
+void HTTPManager::Admit(const QueuedRequest &req, PayloadRef *pBodies, const json_t *pSource, uint32 eventMask, const std::vector<std::string> *pSettled)
+{
+	// Each format is encoded at most once and shared by the sinks using it.
+	uint32 sinks = 0;
+	uint32 settled = 0;
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (!pSink->Accepts(req.kind))
+			continue;
+
+		if (eventMask && pSink->EventMask() != eventMask)
+			continue;
+
+		if (req.liveSeq && (req.liveBaseSeq ? pSink->LiveSeq() != req.liveBaseSeq : pSink->LiveSeq() == req.liveSeq))
+			continue;
+
+		// A sink still working on an update skips this one and falls
+		// behind, so it gets a keyframe once it's done.
+		if (req.kind == PayloadKind::Update && pSink->HasOutstanding(PayloadKind::Update))
+			continue;
+
+		if (pSettled && std::find(pSettled->begin(), pSettled->end(), pSink->GetName()) != pSettled->end())
+		{
+			++settled;
+			continue;
+		}
+
+		WireFormat format = pSink->Format();
+		PayloadRef &body = pBodies[(int)format];
+		if (!body)
+		{
+			body = pSource ? EncodePayload(pSource, format) : EncodePayload(req.body, format);
+			if (!body)
+			{
+				UTIL_LogToFile("Couldn't encode %s payload as %s for sink %s\n", PayloadKindName(req.kind), WireFormatName(format), pSink->GetName());
+				continue;
+			}
+		}
+
+		QueuedRequest encoded = req;
+		encoded.body = body;
+		encoded.format = format;
 
-		uint8 *response = new uint8[size];
-		http->GetHTTPResponseBodyData(arg->m_hRequest, response, size);
+		pSink->Admit(encoded);
+		pSink->Pump();
+		++sinks;
+	}
 
-		if (size < 2 || response[0] != 'o' || response[1] != 'k')
+	// With no sink taking it, it stays in the spool, unless the only ones
+	// that would have are already done with it.
+	for (uint64 spoolId : req.spoolIds)
+	{
+		if (sinks)
+		{
+			m_SpoolRefs[spoolId] = sinks;
+		}
+		else if (settled)
 		{
-			g_HTTPManager.PostJSONToMatchUrl(m_pszText);
+			g_PayloadSpool.Acknowledge(spoolId);
 		}
 	}
+}
+
+void HTTPManager::CollectCompressed()
+{
+	g_BodyCompressor.Collect(m_CompressResults);
 
-	if (http)
+	// Every sink submits in order and the compressor finishes in order, so
+	// each result is the oldest job of exactly one sink.
+	for (auto &r : m_CompressResults)
 	{
-		http->ReleaseHTTPRequest(arg->m_hRequest);
+		for (HTTPSink *pSink : m_Sinks)
+		{
+			if (pSink->TakeCompressed(r))
+				break;
+		}
 	}
-	delete this;
+
+	m_CompressResults.clear();
+}
+
+IHTTPTransport *HTTPManager::Transport() const
+{
+	return HTTPTransportByName(d2lobby_http_transport.GetString());
+}
+
+bool HTTPManager::IsTransportAvailable() const
+{
+	return Transport()->IsAvailable();
 }
 
-void HTTPManager::PostJSONToMatchUrl(const char *pszText)
+bool HTTPManager::StartRequest(HTTPSink *pSink, const QueuedRequest &req, bool bProbe)
 {
-	//	UTIL_MsgAndLog("Sending HTTP:\n%s\n", pszText);
+	if (req.attempt == 1)
+	{
+		m_Stats[(int)req.kind].bodySize.Add(req.body->Size());
+	}
+
+	HTTPPost post;
+	post.pszUrl = pSink->GetUrl();
+	post.pszContentType = WireFormatContentType(req.format);
+	post.pszContentEncoding = ContentEncodingHeader(req.encoding);
+	post.body = req.body;
+
+	IHTTPTransport *pTransport = req.bDiscard ? DiscardHTTPTransport() : Transport();
 
-	if (!match_post_url.GetString()[0])
+	uint64 requestId = AllocateInFlight(pSink, req, bProbe);
+	if (pTransport->Post(requestId, post, this))
+		return true;
+
+	FreeInFlight(requestId);
+	return false;
+}
+
+void HTTPManager::OnSettled(HTTPSink *pSink, const QueuedRequest &req)
+{
+	for (uint64 spoolId : req.spoolIds)
 	{
+		ReleaseSpoolRef(spoolId, pSink->GetName());
+	}
+}
+
+void HTTPManager::ReleaseSpoolRef(uint64 spoolId, const char *pszSettledBy)
+{
+	auto ref = m_SpoolRefs.find(spoolId);
+	if (ref == m_SpoolRefs.end())
 		return;
+
+	if (--ref->second == 0)
+	{
+		g_PayloadSpool.Acknowledge(spoolId);
+		m_SpoolRefs.erase(ref);
+	}
+	else if (pszSettledBy)
+	{
+		// Other sinks still owe it. Don't send it here again if the
+		// plugin is reloaded before they're done.
+		g_PayloadSpool.Settle(spoolId, pszSettledBy);
+	}
+}
+
+bool HTTPManager::HasAnySink() const
+{
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (pSink->GetUrl()[0])
+			return true;
+	}
+
+	return false;
+}
+
+bool HTTPManager::HasSinkFor(PayloadKind kind) const
+{
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (pSink->Accepts(kind))
+			return true;
+	}
+
+	return false;
+}
+
+uint32 HTTPManager::GetEventMasks(uint32 *pMasks, uint32 *pFormats, uint32 maxMasks) const
+{
+	uint32 count = 0;
+	uint32 stored = 0;
+	for (size_t i = 0; i < m_Sinks.size(); ++i)
+	{
+		HTTPSink *pSink = m_Sinks[i];
+		if (!pSink->Accepts(PayloadKind::Events))
+			continue;
+
+		// Only count the first sink with each mask.
+		bool bSeen = false;
+		for (size_t j = 0; j < i && !bSeen; ++j)
+		{
+			bSeen = m_Sinks[j]->Accepts(PayloadKind::Events) && m_Sinks[j]->EventMask() == pSink->EventMask();
+		}
+
+		if (bSeen)
+			continue;
+
+		if (stored < maxMasks)
+		{
+			uint32 formats = 0;
+			for (size_t j = i; j < m_Sinks.size(); ++j)
+			{
+				if (m_Sinks[j]->Accepts(PayloadKind::Events) && m_Sinks[j]->EventMask() == pSink->EventMask())
+				{
+					formats |= 1 << (int)m_Sinks[j]->Format();
+				}
+			}
+
+			pMasks[stored] = pSink->EventMask();
+			pFormats[stored] = formats;
+			++stored;
+		}
+		++count;
+	}
+
+	return count;
+}
+
+bool HTTPManager::HasAnyPendingRequests() const
+{
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (pSink->HasAnyPending())
+			return true;
 	}
 
-	auto hReq = http->CreateHTTPRequest(k_EHTTPMethodPOST, match_post_url.GetString());
+	return false;
+}
+
+bool HTTPManager::IsBusy(PayloadKind kind) const
+{
+	bool bAny = false;
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (!pSink->Accepts(kind))
+			continue;
+
+		if (!pSink->HasOutstanding(kind))
+			return false;
+
+		bAny = true;
+	}
+
+	return bAny;
+}
+
+HTTPSink *HTTPManager::FindSink(const char *pszName) const
+{
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		if (!V_stricmp(pSink->GetName(), pszName))
+			return pSink;
+	}
+
+	return nullptr;
+}
+
+HTTPSink *HTTPManager::AddSink(const char *pszName)
+{
+	HTTPSink *pSink = new HTTPSink(pszName, false);
+	m_Sinks.push_back(pSink);
+	return pSink;
+}
+
+bool HTTPManager::RemoveSink(const char *pszName)
+{
+	HTTPSink *pSink = FindSink(pszName);
+	if (!pSink || pSink->IsMatchSink())
+		return false;
 
-	//	UTIL_MsgAndLog("HTTP request: %p\n", hReq);
+	// Completions for its requests are ignored from here on.
+	std::vector<uint64> spoolIds;
+	for (auto &slot : m_InFlight)
+	{
+		if (slot.bUsed && slot.pSink == pSink)
+		{
+			slot.pSink = nullptr;
+			spoolIds.insert(spoolIds.end(), slot.request.spoolIds.begin(), slot.request.spoolIds.end());
+		}
+	}
 
-	int size = strlen(pszText);
-	if (http->SetHTTPRequestRawPostBody(hReq, "application/json", (uint8 *)pszText, size))
+	// The other sinks no longer wait on it. Payloads only it still owed are
+	// acknowledged.
+	pSink->GetPendingSpoolIds(spoolIds);
+	for (uint64 spoolId : spoolIds)
 	{
-		SteamAPICall_t hCall;
-		http->SendHTTPRequest(hReq, &hCall);
+		ReleaseSpoolRef(spoolId, nullptr);
+	}
+
+	m_Sinks.erase(std::find(m_Sinks.begin(), m_Sinks.end(), pSink));
+	delete pSink;
+	return true;
+}
 
-		new TrackedRequest(hReq, hCall, pszText);
+void HTTPManager::PrintSinks() const
+{
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		pSink->PrintSettings();
+	}
+}
+
+void HTTPManager::RecordAttempt(const QueuedRequest &req, bool bSuccess)
+{
+	KindStats &stats = m_Stats[(int)req.kind];
+
+	stats.attemptLatency.Add((uint64)(MAX(0.0, req.flCompleteTime - req.flSendTime) * 1000.0));
+
+	if (bSuccess)
+	{
+		++stats.succeeded;
+		stats.deliveryLatency.Add((uint64)(MAX(0.0, req.flCompleteTime - req.flEnqueueTime) * 1000.0));
 	}
 	else
 	{
-		//		UTIL_MsgAndLog("Failed to SetHTTPRequestRawPostBody\n");
+		++stats.failed;
 	}
-}
\ No newline at end of file
+}
+
+void HTTPManager::RecordDropped(const QueuedRequest &req)
+{
+	++m_Stats[(int)req.kind].dropped;
+}
+
+void HTTPManager::ReportStats(void (*pfnOutput)(const char *)) const
+{
+	char szLine[512];
+	char szHistogram[256];
+
+	for (int k = 0; k < (int)PayloadKind::Count; ++k)
+	{
+		const KindStats &stats = m_Stats[k];
+
+		Q_snprintf(szLine, sizeof(szLine), "HTTP %s: %u succeeded, %u failed attempt(s), %u dropped\n",
+			PayloadKindName((PayloadKind)k), stats.succeeded, stats.failed, stats.dropped);
+		pfnOutput(szLine);
+
+		if (!stats.attemptLatency.Count())
+			continue;
+
+		stats.attemptLatency.Format(szHistogram, sizeof(szHistogram));
+		Q_snprintf(szLine, sizeof(szLine), "- attempt latency (ms): %s\n", szHistogram);
+		pfnOutput(szLine);
+
+		stats.deliveryLatency.Format(szHistogram, sizeof(szHistogram));
+		Q_snprintf(szLine, sizeof(szLine), "- delivery latency (ms): %s\n", szHistogram);
+		pfnOutput(szLine);
+
+		stats.bodySize.Format(szHistogram, sizeof(szHistogram));
+		Q_snprintf(szLine, sizeof(szLine), "- body size (bytes): %s\n", szHistogram);
+		pfnOutput(szLine);
+	}
+}
+
+void HTTPManager::PrintStats() const
+{
+	ReportStats([](const char *pszLine) { Msg("%s", pszLine); });
+}
+
+void HTTPManager::LogStats() const
+{
+	ReportStats([](const char *pszLine) { UTIL_LogToFile("%s", pszLine); });
+}
+
+void HTTPManager::PrintDebug() const
+{
+	Msg("HTTP requests in flight: %u, %u spooled payload(s) awaiting delivery\n", m_InFlightCount, (uint32)m_SpoolRefs.size());
+	for (HTTPSink *pSink : m_Sinks)
+	{
+		pSink->PrintDebug();
+	}
+
+	Transport()->PrintDebug();
+	g_BodyCompressor.PrintDebug();
+	g_PayloadSpool.PrintDebug();
+}
@@ -23,36 +23,133 @@
  * code used.  Additionally, this exception is granted to all derivative works.
  */
 
+
 #pragma once
 
+#include "compress.h"
 #include "d2lobby.h"
+#include "histogram.h"
+#include "payload.h"
+#include "pluginsystem.h"
+#include "sink.h"
+#include "spool.h"
+#include "transport.h"
 #include <steam/steam_gameserver.h>
 
+#include <unordered_map>
 #include <vector>
 
 class HTTPManager;
 extern HTTPManager g_HTTPManager;
 
-class HTTPManager
+// Hands each payload to every sink that takes its kind. The body is shared
+// between sinks, and each is spooled once and acknowledged when every sink
+// it went to has delivered it or given up on it.
+class HTTPManager : public IPluginSystem, public IHTTPCompletionHandler
 {
+public: // IPluginSystem
+	virtual const char *GetName() const override { return "HTTP Manager"; }
+	bool OnLoad() override;
+	void OnUnload() override;
+	void OnGameFrame() override;
+public: // IHTTPCompletionHandler
+	void OnHTTPCompleted(uint64 requestId, int status, const uint8 *pResponse, uint32 responseSize) override;
 public:
-	void PostJSONToMatchUrl(const char *pszText);
-	bool HasAnyPendingRequests() const { return m_PendingRequests.size() > 0; }
+	// payload is the JSON body. Sinks that want another wire format have it
+	// encoded from pSource, or from the JSON text if that isn't given. A
+	// nonzero eventMask limits an events payload to the sinks with exactly
+	// that event mask.
+	void Post(const PayloadRef &payload, PayloadKind kind, const json_t *pSource = nullptr, uint32 eventMask = 0);
+	// The same, for a payload the caller already wrote in some formats.
+	// pBodies is indexed by WireFormat. The JSON body is required and is
+	// what gets spooled. Formats left empty are encoded as above. With
+	// bDiscard the payload goes through the discard transport instead and
+	// isn't spooled.
+	void Post(const PayloadRef *pBodies, PayloadKind kind, const json_t *pSource = nullptr, uint32 eventMask = 0, bool bDiscard = false);
+	// Posts live scoreboard update seq. A delta (nonzero baseSeq) only goes
+	// to sinks whose last update was baseSeq. A keyframe goes to every sink
+	// that hasn't taken seq yet, so posting the delta first and then, if
+	// IsLiveSinkBehind(seq), the keyframe reaches each sink exactly once.
+	// Sinks with an update still outstanding take neither, so each has at
+	// most one in flight.
+	void PostLiveUpdate(const PayloadRef &payload, const json_t *pSource, uint32 seq, uint32 baseSeq);
+	// Whether a sink that could take an update now hasn't taken this one.
+	bool IsLiveSinkBehind(uint32 seq) const;
+	bool HasSinkFor(PayloadKind kind) const;
+	// Fills pMasks with the distinct event masks of sinks taking events and
+	// returns how many there are, which may be more than maxMasks. pFormats
+	// gets the wire formats the sinks with each mask use, as a bitmask.
+	uint32 GetEventMasks(uint32 *pMasks, uint32 *pFormats, uint32 maxMasks) const;
+	bool HasAnyPendingRequests() const;
+	// Whether every sink taking this kind still has one being compressed,
+	// queued or sent.
+	bool IsBusy(PayloadKind kind) const;
+	void PrintDebug() const;
+	void PrintStats() const;
+	void LogStats() const;
 
+	HTTPSink *FindSink(const char *pszName) const;
+	HTTPSink *AddSink(const char *pszName);
+	bool RemoveSink(const char *pszName);
+	void PrintSinks() const;
+public: // For HTTPSink
+	bool IsTransportAvailable() const;
+	bool StartRequest(HTTPSink *pSink, const QueuedRequest &req, bool bProbe);
+	// The sink delivered it or gave up on it. Requests it drops to stay in
+	// its queue budget aren't settled and are resent on the next load.
+	void OnSettled(HTTPSink *pSink, const QueuedRequest &req);
+	void RecordAttempt(const QueuedRequest &req, bool bSuccess);
+	void RecordDropped(const QueuedRequest &req);
 private:
-	class TrackedRequest
+	struct KindStats
+	{
+		uint32 succeeded = 0;
+		uint32 failed = 0;
+		uint32 dropped = 0;
+		// Milliseconds from send to completion, for every attempt.
+		Histogram attemptLatency;
+		// Milliseconds from first post to successful delivery.
+		Histogram deliveryLatency;
+		// Bytes on the wire, once per payload and sink.
+		Histogram bodySize;
+	};
+
+	// Slot in the in-flight table, shared by all sinks. Request ids are the
+	// slot index in the low 32 bits and the slot's generation in the high 32
+	// bits, so a stale id never matches a reused slot.
+	struct InFlightSlot
 	{
-	public:
-		TrackedRequest(const TrackedRequest &req) = delete;
-		TrackedRequest(HTTPRequestHandle hndl, SteamAPICall_t hCall, const char *pszText);
-		~TrackedRequest();
-	private:
-		void OnHTTPRequestCompleted(HTTPRequestCompleted_t *arg, bool bFailed);
-
-		HTTPRequestHandle m_hHTTPReq;
-		CCallResult<TrackedRequest, HTTPRequestCompleted_t> m_CallResult;
-		char *m_pszText;
+		HTTPSink *pSink = nullptr;
+		QueuedRequest request;
+		uint32 generation = 0;
+		bool bUsed = false;
+		bool bProbe = false;
 	};
 private:
-	std::vector<HTTPManager::TrackedRequest *> m_PendingRequests;
+	// pBodies holds a body per WireFormat, at least the JSON one, and is
+	// filled in as sinks need other formats. pSettled names sinks that
+	// already settled a replayed spool record.
+	void Admit(const QueuedRequest &req, PayloadRef *pBodies, const json_t *pSource, uint32 eventMask, const std::vector<std::string> *pSettled = nullptr);
+	// Drops one sink's claim on a spool record and acknowledges it once no
+	// sink has one. pszSettledBy names the sink if it delivered or gave up.
+	void ReleaseSpoolRef(uint64 spoolId, const char *pszSettledBy);
+	void CollectCompressed();
+	bool HasAnySink() const;
+	IHTTPTransport *Transport() const;
+	uint64 AllocateInFlight(HTTPSink *pSink, const QueuedRequest &req, bool bProbe);
+	void FreeInFlight(uint64 requestId);
+	void ReportStats(void (*pfnOutput)(const char *)) const;
+private:
+	// The first is always the match sink.
+	std::vector<HTTPSink *> m_Sinks;
+
+	std::vector<InFlightSlot> m_InFlight;
+	std::vector<uint32> m_FreeInFlightSlots;
+	uint32 m_InFlightCount = 0;
+	std::vector<BodyCompressor::Result> m_CompressResults;
+	std::vector<PayloadSpool::Record> m_SpoolReplay;
+	// Spool id to the number of sinks yet to deliver it.
+	std::unordered_map<uint64, uint32> m_SpoolRefs;
+
+	KindStats m_Stats[(int)PayloadKind::Count];
 };
@@ -0,0 +1,372 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "identity.h"
+
+#include "d2lobby.h"
+#include "util.h"
+
+#include <inttypes.h>
+
+PlayerIdentities g_PlayerIdentities;
+
+SH_DECL_EXTERN2_void(ConCommand, Dispatch, SH_NOATTRIB, 0, const CCommandContext &, const CCommand &);
+SH_DECL_EXTERN1_void(ISource2GameClients, SetCommandClient, SH_NOATTRIB, 0, CPlayerSlot);
+
+// The slow path. Only taken the first time a player id is seen, or after
+// its link was dropped.
+static AccountID_t ScriptGetSteamAccountId(int playerId)
+{
+	// Look up class def. It is the scope when looking up a class func.
+	// Then look up the class instance var. It is prepended to args when calling a class func, like a thiscall.
+
+	ScriptVariant_t varPRClassDef;
+	scriptvm->GetValue("CDOTA_PlayerResource", &varPRClassDef);
+
+	HSCRIPT hPRClassScope = varPRClassDef.m_hScript;
+	HSCRIPT steamAccountId = scriptvm->LookupFunction("GetSteamAccountID", hPRClassScope);
+
+	ScriptVariant_t varPRInstance;
+	scriptvm->GetValue("PlayerResource", &varPRInstance);
+
+	HSCRIPT hPRIntance = varPRInstance.m_hScript;
+
+	ScriptVariant_t ret;
+	scriptvm->Call<HSCRIPT, int>(steamAccountId, nullptr, true, &ret, hPRIntance, playerId);
+	return (AccountID_t)ret.m_float64;
+}
+
+bool PlayerIdentities::OnLoad()
+{
+	Reset();
+
+	// Player ids follow team slots, so a team switch can move them.
+	ConCommand *pJoinTeam = g_pCVar->FindCommand("jointeam");
+	if (pJoinTeam)
+	{
+		int h = SH_ADD_HOOK(ConCommand, Dispatch, pJoinTeam, SH_MEMBER(this, &PlayerIdentities::Hook_OnCmdJoinTeam), true);
+		m_Hooks.push_back(h);
+
+		h = SH_ADD_HOOK(ISource2GameClients, SetCommandClient, serverclients, SH_MEMBER(this, &PlayerIdentities::Hook_SetCommandClient), true);
+		m_Hooks.push_back(h);
+	}
+
+	return true;
+}
+
+void PlayerIdentities::OnUnload()
+{
+	for (int h : m_Hooks)
+	{
+		SH_REMOVE_HOOK_ID(h);
+	}
+	m_Hooks.clear();
+
+	Reset();
+}
+
+void PlayerIdentities::Hook_OnCmdJoinTeam(const CCommandContext &, const CCommand &)
+{
+	int entity = m_CommandClient.Get() + 1;
+	if (entity > 0 && entity <= kMaxClients && m_ByEntity[entity] != -1)
+	{
+		Identity &identity = m_Identities[m_ByEntity[entity]];
+		UnlinkPlayerId(identity);
+	}
+
+	RETURN_META(MRES_IGNORED);
+}
+
+void PlayerIdentities::Hook_SetCommandClient(CPlayerSlot slot)
+{
+	m_CommandClient = slot;
+	RETURN_META(MRES_IGNORED);
+}
+
+void PlayerIdentities::Reset()
+{
+	m_Identities.clear();
+	m_ByAccountId.clear();
+
+	for (int &i : m_ByPlayerId)
+	{
+		i = -1;
+	}
+
+	for (int &i : m_ByEntity)
+	{
+		i = -1;
+	}
+
+	memset(m_TeamSlots, 0, sizeof(m_TeamSlots));
+
+	LinkConnectedClients();
+}
+
+void PlayerIdentities::LinkConnectedClients()
+{
+	CGlobalVars *pGlobals = engine->GetServerGlobals();
+	if (!pGlobals)
+		return;
+
+	for (int slot = 0; slot < pGlobals->maxClients && slot < kMaxClients; ++slot)
+	{
+		const CSteamID *pSteamId = engine->GetClientSteamID(CPlayerSlot(slot));
+		if (!pSteamId)
+			continue;
+
+		OnClientConnected(CEntityIndex(slot + 1), *pSteamId, false);
+	}
+}
+
+PlayerIdentities::Identity *PlayerIdentities::Find(AccountID_t accountId)
+{
+	auto i = m_ByAccountId.find(accountId);
+	return i != m_ByAccountId.end() ? &m_Identities[i->second] : nullptr;
+}
+
+const PlayerIdentities::Identity *PlayerIdentities::Find(AccountID_t accountId) const
+{
+	auto i = m_ByAccountId.find(accountId);
+	return i != m_ByAccountId.end() ? &m_Identities[i->second] : nullptr;
+}
+
+PlayerIdentities::Identity &PlayerIdentities::FindOrAdd(const CSteamID &steamId)
+{
+	Identity *pIdentity = Find(steamId.GetAccountID());
+	if (pIdentity)
+		return *pIdentity;
+
+	m_ByAccountId[steamId.GetAccountID()] = (int)m_Identities.size();
+	m_Identities.emplace_back();
+	m_Identities.back().steamId = steamId;
+	return m_Identities.back();
+}
+
+void PlayerIdentities::UnlinkPlayerId(Identity &identity)
+{
+	if (identity.playerId == -1)
+		return;
+
+	m_ByPlayerId[identity.playerId] = -1;
+	identity.playerId = -1;
+	++m_Invalidations;
+}
+
+void PlayerIdentities::LinkEntity(Identity &identity, int entity)
+{
+	identity.entity = entity;
+	m_ByEntity[entity] = (int)(&identity - m_Identities.data());
+
+	if (identity.team >= 0 && identity.team <= kTeamDire)
+	{
+		m_TeamSlots[identity.team] |= 1ull << (entity - 1);
+	}
+}
+
+void PlayerIdentities::UnlinkEntity(Identity &identity)
+{
+	if (identity.entity == -1)
+		return;
+
+	if (identity.team >= 0 && identity.team <= kTeamDire)
+	{
+		m_TeamSlots[identity.team] &= ~(1ull << (identity.entity - 1));
+	}
+
+	m_ByEntity[identity.entity] = -1;
+	identity.entity = -1;
+}
+
+void PlayerIdentities::SetTeam(Identity &identity, int team)
+{
+	int entity = identity.entity;
+	if (entity != -1)
+	{
+		UnlinkEntity(identity);
+	}
+
+	identity.team = team;
+
+	if (entity != -1)
+	{
+		LinkEntity(identity, entity);
+	}
+}
+
+void PlayerIdentities::AddMember(const CSteamID &steamId, int team)
+{
+	Identity &identity = FindOrAdd(steamId);
+	identity.bMember = true;
+
+	if (identity.team != team)
+	{
+		OnTeamChanged(steamId, team);
+	}
+}
+
+void PlayerIdentities::OnClientConnected(CEntityIndex index, const CSteamID &steamId, bool bFakePlayer)
+{
+	int entity = index.Get();
+	if (entity <= 0 || entity > kMaxClients)
+		return;
+
+	if (bFakePlayer || !steamId.IsValid() || !steamId.BIndividualAccount())
+		return;
+
+	// A reconnect can come back on another entity.
+	Identity &identity = FindOrAdd(steamId);
+	UnlinkEntity(identity);
+
+	if (m_ByEntity[entity] != -1)
+	{
+		UnlinkEntity(m_Identities[m_ByEntity[entity]]);
+	}
+
+	LinkEntity(identity, entity);
+	identity.bConnected = true;
+}
+
+void PlayerIdentities::OnClientDisconnected(CEntityIndex index, const CSteamID &steamId)
+{
+	int entity = index.Get();
+	if (entity > 0 && entity <= kMaxClients)
+	{
+		if (m_ByEntity[entity] != -1)
+		{
+			UnlinkEntity(m_Identities[m_ByEntity[entity]]);
+		}
+	}
+
+	OnConnectionStateChanged(steamId, false);
+}
+
+void PlayerIdentities::OnConnectionStateChanged(const CSteamID &steamId, bool bConnected)
+{
+	Identity *pIdentity = Find(steamId.GetAccountID());
+	if (!pIdentity || pIdentity->bConnected == bConnected)
+		return;
+
+	pIdentity->bConnected = bConnected;
+	if (!bConnected)
+	{
+		UnlinkPlayerId(*pIdentity);
+	}
+}
+
+void PlayerIdentities::OnTeamChanged(const CSteamID &steamId, int team)
+{
+	Identity *pIdentity = Find(steamId.GetAccountID());
+	if (!pIdentity)
+		return;
+
+	SetTeam(*pIdentity, team);
+	UnlinkPlayerId(*pIdentity);
+}
+
+CSteamID PlayerIdentities::SteamIdFromPlayerId(int playerId)
+{
+	static CSteamID steamIdInvalid = CSteamID();
+
+	if (playerId < 0 || playerId >= kMaxTotalPlayerIds)
+		return steamIdInvalid;
+
+	if (m_ByPlayerId[playerId] != -1)
+		return m_Identities[m_ByPlayerId[playerId]].steamId;
+
+	if (!scriptvm)
+		return steamIdInvalid;
+
+	++m_Resolves;
+
+	Identity *pIdentity = Find(ScriptGetSteamAccountId(playerId));
+	if (!pIdentity || !pIdentity->bMember)
+		return steamIdInvalid;
+
+	// Whoever held this player id before has lost it.
+	UnlinkPlayerId(*pIdentity);
+	pIdentity->playerId = playerId;
+	m_ByPlayerId[playerId] = (int)(pIdentity - m_Identities.data());
+
+	return pIdentity->steamId;
+}
+
+CSteamID PlayerIdentities::SteamIdFromAccountId(AccountID_t accountId) const
+{
+	static CSteamID steamIdInvalid = CSteamID();
+
+	const Identity *pIdentity = Find(accountId);
+	return pIdentity && pIdentity->bMember ? pIdentity->steamId : steamIdInvalid;
+}
+
+CSteamID PlayerIdentities::SteamIdFromEntity(CEntityIndex index) const
+{
+	static CSteamID steamIdInvalid = CSteamID();
+
+	int entity = index.Get();
+	if (entity <= 0 || entity > kMaxClients || m_ByEntity[entity] == -1)
+		return steamIdInvalid;
+
+	return m_Identities[m_ByEntity[entity]].steamId;
+}
+
+int PlayerIdentities::GetTeam(const CSteamID &steamId) const
+{
+	const Identity *pIdentity = Find(steamId.GetAccountID());
+	return pIdentity ? pIdentity->team : kTeamUnassigned;
+}
+
+int PlayerIdentities::GetPlayerIdTeam(int playerId)
+{
+	if (playerId < 0 || playerId >= kMaxTotalPlayerIds)
+		return kTeamUnassigned;
+
+	if (m_ByPlayerId[playerId] == -1 && !SteamIdFromPlayerId(playerId).IsValid())
+		return kTeamUnassigned;
+
+	return m_Identities[m_ByPlayerId[playerId]].team;
+}
+
+bool PlayerIdentities::IsConnected(CEntityIndex index) const
+{
+	int entity = index.Get();
+	if (entity <= 0 || entity > kMaxClients || m_ByEntity[entity] == -1)
+		return false;
+
+	// The GC's view of who dropped wins over a client slot that hasn't been
+	// cleaned up yet.
+	return m_Identities[m_ByEntity[entity]].bConnected;
+}
+
+void PlayerIdentities::PrintDebug() const
+{
+	Msg("Player identities: %u, %u script lookup(s), %u invalidation(s)\n", (uint32)m_Identities.size(), m_Resolves, m_Invalidations);
+	for (auto &identity : m_Identities)
+	{
+		Msg("- %" PRIu64 ": team %d, player id %d, entity %d%s%s\n", identity.steamId.ConvertToUint64(), identity.team, identity.playerId, identity.entity,
+			identity.bMember ? ", member" : "", identity.bConnected ? ", connected" : "");
+	}
+}
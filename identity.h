@@ -0,0 +1,118 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "constants.h"
+#include "pluginsystem.h"
+
+#include <steam/steam_gameserver.h>
+
+#include <unordered_map>
+#include <vector>
+
+// Maps between the ids a player goes by: the game's player id, their
+// client entity index, their account id and their SteamID. Filled from the
+// lobby roster and client connects, with player ids resolved through
+// script once on first use rather than on every lookup.
+//
+// Links to a player id or entity are dropped when the player disconnects
+// or changes team, and the next lookup resolves them again.
+class PlayerIdentities : public IPluginSystem
+{
+public: // IPluginSystem
+	virtual const char *GetName() const override { return "Player Identities"; }
+	bool OnLoad() override;
+	void OnUnload() override;
+public:
+	void Hook_OnCmdJoinTeam(const CCommandContext &, const CCommand &);
+	void Hook_SetCommandClient(CPlayerSlot slot);
+public:
+	// Starts a new match's roster.
+	void Reset();
+	void AddMember(const CSteamID &steamId, int team);
+
+	// Fake clients (bots, SourceTV) and clients without a SteamID get no
+	// identity and never count as connected.
+	void OnClientConnected(CEntityIndex index, const CSteamID &steamId, bool bFakePlayer);
+	void OnClientDisconnected(CEntityIndex index, const CSteamID &steamId);
+	void OnConnectionStateChanged(const CSteamID &steamId, bool bConnected);
+	void OnTeamChanged(const CSteamID &steamId, int team);
+
+	// Invalid if the player id doesn't belong to a lobby member.
+	CSteamID SteamIdFromPlayerId(int playerId);
+	CSteamID SteamIdFromAccountId(AccountID_t accountId) const;
+	CSteamID SteamIdFromEntity(CEntityIndex index) const;
+	int GetTeam(const CSteamID &steamId) const;
+	// Same rules as SteamIdFromPlayerId.
+	int GetPlayerIdTeam(int playerId);
+	// Bit n is set if the client in slot n is on the team.
+	uint64 GetTeamSlots(int team) const { return team >= 0 && team <= kTeamDire ? m_TeamSlots[team] : 0; }
+	// Whether a real player is in the slot and connected, as far as both
+	// the server and the GC know.
+	bool IsConnected(CEntityIndex index) const;
+
+	void PrintDebug() const;
+private:
+	static const int kMaxClients = 64;
+
+	struct Identity
+	{
+		CSteamID steamId;
+		int team = kTeamUnassigned;
+		int playerId = -1;
+		int entity = -1;
+		bool bMember = false;
+		bool bConnected = false;
+	};
+private:
+	Identity *Find(AccountID_t accountId);
+	const Identity *Find(AccountID_t accountId) const;
+	Identity &FindOrAdd(const CSteamID &steamId);
+	void UnlinkPlayerId(Identity &identity);
+	void LinkEntity(Identity &identity, int entity);
+	void UnlinkEntity(Identity &identity);
+	void SetTeam(Identity &identity, int team);
+	// Links clients already on the server, for a load mid-match.
+	void LinkConnectedClients();
+private:
+	std::vector<int> m_Hooks;
+	CPlayerSlot m_CommandClient = 0;
+
+	// Indices into m_Identities, or -1. Entries are only removed by Reset,
+	// so indices stay valid for the whole match.
+	std::vector<Identity> m_Identities;
+	std::unordered_map<AccountID_t, int> m_ByAccountId;
+	int m_ByPlayerId[kMaxTotalPlayerIds];
+	int m_ByEntity[kMaxClients + 1];
+	// Client slots of identities with an entity, by team.
+	uint64 m_TeamSlots[kTeamDire + 1];
+
+	uint32 m_Resolves = 0;
+	uint32 m_Invalidations = 0;
+};
+
+extern PlayerIdentities g_PlayerIdentities;
@@ -0,0 +1,252 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "jsonwriter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Two digits at a time halves the number of divisions.
+static const char s_DigitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+// Writes value backwards ending at pEnd and returns where it starts.
+static char *FormatUInt(uint64 value, char *pEnd)
+{
+	char *p = pEnd;
+	while (value >= 100)
+	{
+		int pair = (int)(value % 100) * 2;
+		value /= 100;
+		*--p = s_DigitPairs[pair + 1];
+		*--p = s_DigitPairs[pair];
+	}
+
+	if (value >= 10)
+	{
+		int pair = (int)value * 2;
+		*--p = s_DigitPairs[pair + 1];
+		*--p = s_DigitPairs[pair];
+	}
+	else
+	{
+		*--p = (char)('0' + value);
+	}
+
+	return p;
+}
+
+JSONWriter::~JSONWriter()
+{
+	free(m_pData);
+}
+
+bool JSONWriter::Grow(size_t capacity)
+{
+	if (m_bFailed)
+		return false;
+
+	size_t newCapacity = m_Capacity ? m_Capacity * 2 : 256;
+	while (newCapacity < capacity)
+		newCapacity *= 2;
+
+	char *pData = (char *)realloc(m_pData, newCapacity);
+	if (!pData)
+	{
+		m_bFailed = true;
+		return false;
+	}
+
+	m_pData = pData;
+	m_Capacity = newCapacity;
+	return true;
+}
+
+void JSONWriter::Int(int64 value)
+{
+	BeforeValue();
+
+	char szBuf[24];
+	char *pEnd = szBuf + sizeof(szBuf);
+	char *p = FormatUInt(value < 0 ? 0 - (uint64)value : (uint64)value, pEnd);
+	if (value < 0)
+	{
+		*--p = '-';
+	}
+
+	Append(p, pEnd - p);
+}
+
+void JSONWriter::UInt(uint64 value)
+{
+	BeforeValue();
+
+	char szBuf[24];
+	char *pEnd = szBuf + sizeof(szBuf);
+	char *p = FormatUInt(value, pEnd);
+
+	Append(p, pEnd - p);
+}
+
+void JSONWriter::Real(double value, int decimals)
+{
+	BeforeValue();
+
+	// JSON has no representation for these.
+	if (!isfinite(value))
+	{
+		Append("0.0", 3);
+		return;
+	}
+
+	static const uint64 kScales[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000 };
+	decimals = decimals < 1 ? 1 : (decimals > 9 ? 9 : decimals);
+	uint64 scale = kScales[decimals];
+
+	bool bNegative = value < 0.0;
+	double magnitude = bNegative ? -value : value;
+
+	// Past this the fixed point value no longer fits, so fall back to the
+	// slow path.
+	if (magnitude * scale >= 9.0e18)
+	{
+		char szBuf[32];
+		int len = snprintf(szBuf, sizeof(szBuf), "%.17g", value);
+		Append(szBuf, len);
+		return;
+	}
+
+	uint64 fixed = (uint64)(magnitude * scale + 0.5);
+
+	char szBuf[48];
+	char *pEnd = szBuf + sizeof(szBuf);
+	char *p = pEnd;
+
+	uint64 fraction = fixed % scale;
+	for (int i = 0; i < decimals; ++i)
+	{
+		*--p = (char)('0' + fraction % 10);
+		fraction /= 10;
+	}
+	*--p = '.';
+	p = FormatUInt(fixed / scale, p);
+	if (bNegative && fixed)
+	{
+		*--p = '-';
+	}
+
+	Append(p, pEnd - p);
+}
+
+void JSONWriter::Bool(bool value)
+{
+	BeforeValue();
+
+	if (value)
+	{
+		Append("true", 4);
+	}
+	else
+	{
+		Append("false", 5);
+	}
+}
+
+void JSONWriter::Null()
+{
+	BeforeValue();
+	Append("null", 4);
+}
+
+void JSONWriter::String(const char *pszValue)
+{
+	static const char kHex[] = "0123456789abcdef";
+
+	BeforeValue();
+
+	size_t len = strlen(pszValue);
+	// Worst case every byte becomes \u00XX.
+	if (!Reserve(len * 6 + 2))
+		return;
+
+	char *p = m_pData + m_Size;
+	*p++ = '"';
+	for (size_t i = 0; i < len; ++i)
+	{
+		unsigned char c = (unsigned char)pszValue[i];
+		if (c == '"' || c == '\\')
+		{
+			*p++ = '\\';
+			*p++ = c;
+		}
+		else if (c < 0x20)
+		{
+			*p++ = '\\';
+			switch (c)
+			{
+			case '\n':
+				*p++ = 'n';
+				break;
+			case '\r':
+				*p++ = 'r';
+				break;
+			case '\t':
+				*p++ = 't';
+				break;
+			default:
+				*p++ = 'u';
+				*p++ = '0';
+				*p++ = '0';
+				*p++ = kHex[c >> 4];
+				*p++ = kHex[c & 15];
+				break;
+			}
+		}
+		else
+		{
+			*p++ = c;
+		}
+	}
+	*p++ = '"';
+
+	m_Size = p - m_pData;
+}
+
+void JSONWriter::Raw(const char *pData, size_t len)
+{
+	BeforeValue();
+	Append(pData, len);
+}
@@ -0,0 +1,164 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <stddef.h>
+#include <string.h>
+
+// Writes compact JSON straight into a growable buffer. Reset() keeps the
+// memory, so a writer that is reused allocates nothing once it has grown to
+// its working size.
+//
+// Keys must be string literals. Their length is known at compile time and
+// they are written without escaping.
+//
+// If the buffer can't grow, the writer keeps what it has, ignores every
+// later write and reports Failed() until the next Reset().
+class JSONWriter
+{
+public:
+	JSONWriter() = default;
+	~JSONWriter();
+
+	JSONWriter(const JSONWriter &) = delete;
+	JSONWriter &operator=(const JSONWriter &) = delete;
+
+	void Reset()
+	{
+		m_Size = 0;
+		m_Depth = 0;
+		m_Commas = 0;
+		m_bAfterKey = false;
+		m_bFailed = false;
+	}
+
+	bool Failed() const { return m_bFailed; }
+	const char *Data() const { return m_pData; }
+	size_t Size() const { return m_Size; }
+	size_t Capacity() const { return m_Capacity; }
+
+	void BeginObject() { BeforeValue(); Put('{'); Push(); }
+	void EndObject() { --m_Depth; Put('}'); }
+	void BeginArray() { BeforeValue(); Put('['); Push(); }
+	void EndArray() { --m_Depth; Put(']'); }
+
+	template <size_t N>
+	void Key(const char (&szKey)[N])
+	{
+		Comma();
+		if (!Reserve(N + 2))
+			return;
+
+		m_pData[m_Size++] = '"';
+		memcpy(m_pData + m_Size, szKey, N - 1);
+		m_Size += N - 1;
+		m_pData[m_Size++] = '"';
+		m_pData[m_Size++] = ':';
+		m_bAfterKey = true;
+	}
+
+	void Int(int64 value);
+	void UInt(uint64 value);
+	// Fixed point with the given number of decimals, which is all event
+	// times and the like need and far cheaper than printf's %g.
+	void Real(double value, int decimals = 3);
+	void Bool(bool value);
+	void Null();
+	void String(const char *pszValue);
+	// An already encoded JSON value.
+	void Raw(const char *pData, size_t len);
+private:
+	void BeforeValue()
+	{
+		if (m_bAfterKey)
+		{
+			m_bAfterKey = false;
+			return;
+		}
+
+		if (m_Depth)
+		{
+			Comma();
+		}
+	}
+
+	void Comma()
+	{
+		uint64 bit = 1ull << m_Depth;
+		if (m_Commas & bit)
+		{
+			Put(',');
+		}
+		m_Commas |= bit;
+	}
+
+	void Push()
+	{
+		++m_Depth;
+		m_Commas &= ~(1ull << m_Depth);
+	}
+
+	void Put(char c)
+	{
+		if (Reserve(1))
+		{
+			m_pData[m_Size++] = c;
+		}
+	}
+
+	void Append(const char *pData, size_t len)
+	{
+		if (Reserve(len))
+		{
+			memcpy(m_pData + m_Size, pData, len);
+			m_Size += len;
+		}
+	}
+
+	bool Reserve(size_t len)
+	{
+		if (m_Size + len > m_Capacity)
+			return Grow(m_Size + len);
+
+		return !m_bFailed;
+	}
+
+	bool Grow(size_t capacity);
+private:
+	char *m_pData = nullptr;
+	size_t m_Size = 0;
+	size_t m_Capacity = 0;
+
+	// Bit n is set once a value has been written at depth n, meaning the
+	// next one needs a comma.
+	uint64 m_Commas = 0;
+	int m_Depth = 0;
+	bool m_bAfterKey = false;
+	bool m_bFailed = false;
+};
@@ -0,0 +1,341 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "livestats.h"
+
+#include "d2lobby.h"
+#include "httpmgr.h"
+#include "lobbymgr.h"
+#include "matchstats.h"
+#include "pb2json.h"
+#include "util.h"
+
+#include <jansson.h>
+#include <generated_proto/dota_gcmessages_msgid.pb.h>
+
+static ConVar d2lobby_enable_live_stats("d2lobby_enable_live_stats", "1");
+static ConVar d2lobby_live_stats_delta("d2lobby_live_stats_delta", "0", FCVAR_RELEASE, "Send only what changed between live scoreboard updates");
+static ConVar d2lobby_live_stats_min_interval("d2lobby_live_stats_min_interval", "1.0", FCVAR_RELEASE, "Minimum seconds between live scoreboard posts", true, 0.0f, false, 0.0f);
+static ConVar d2lobby_live_stats_keyframe_interval("d2lobby_live_stats_keyframe_interval", "30", FCVAR_RELEASE, "Send a full live scoreboard update every this many updates", true, 1.0f, false, 0.0f);
+
+LiveScoreboard g_LiveScoreboard;
+
+CON_COMMAND(d2lobby_live_stats_keyframe, "Sends the next live scoreboard update in full")
+{
+	g_LiveScoreboard.RequestKeyframe();
+}
+
+// Advances on its own every update, so on its own it isn't a change.
+static const char *const kClockField = "duration";
+
+static bool IsObjectArrayOfSameSize(json_t *pOld, json_t *pNew)
+{
+	if (!json_is_array(pOld) || !json_is_array(pNew) || json_array_size(pOld) != json_array_size(pNew))
+		return false;
+
+	for (size_t i = 0; i < json_array_size(pNew); ++i)
+	{
+		if (!json_is_object(json_array_get(pOld, i)) || !json_is_object(json_array_get(pNew, i)))
+			return false;
+	}
+
+	return true;
+}
+
+// Adds to pDelta what changed from pOld to pNew. Returns whether anything did.
+static bool DiffObjects(json_t *pOld, json_t *pNew, json_t *pDelta)
+{
+	bool bChanged = false;
+
+	const char *pszKey;
+	json_t *pNewValue;
+	json_object_foreach(pNew, pszKey, pNewValue)
+	{
+		json_t *pOldValue = json_object_get(pOld, pszKey);
+
+		if (json_is_object(pOldValue) && json_is_object(pNewValue))
+		{
+			json_t *pSub = json_object();
+			if (DiffObjects(pOldValue, pNewValue, pSub))
+			{
+				json_object_set(pDelta, pszKey, pSub);
+				bChanged = true;
+			}
+			json_decref(pSub);
+		}
+		else if (IsObjectArrayOfSameSize(pOldValue, pNewValue))
+		{
+			json_t *pSub = json_object();
+			for (size_t i = 0; i < json_array_size(pNewValue); ++i)
+			{
+				json_t *pElement = json_object();
+				if (DiffObjects(json_array_get(pOldValue, i), json_array_get(pNewValue, i), pElement))
+				{
+					char szIndex[16];
+					Q_snprintf(szIndex, sizeof(szIndex), "%u", (uint32)i);
+					json_object_set(pSub, szIndex, pElement);
+				}
+				json_decref(pElement);
+			}
+
+			if (json_object_size(pSub))
+			{
+				json_object_set(pDelta, pszKey, pSub);
+				bChanged = true;
+			}
+			json_decref(pSub);
+		}
+		else if (!pOldValue || !json_equal(pOldValue, pNewValue))
+		{
+			json_object_set(pDelta, pszKey, pNewValue);
+			bChanged = true;
+		}
+	}
+
+	json_t *pOldValue;
+	json_object_foreach(pOld, pszKey, pOldValue)
+	{
+		if (!json_object_get(pNew, pszKey))
+		{
+			json_object_set_new(pDelta, pszKey, json_null());
+			bChanged = true;
+		}
+	}
+
+	return bChanged;
+}
+
+bool LiveScoreboard::OnLoad()
+{
+	Reset();
+	g_GCMgr.Subscribe(this, GCDirection::Outgoing, k_EMsgGCLiveScoreboardUpdate);
+	return true;
+}
+
+void LiveScoreboard::OnUnload()
+{
+	g_GCMgr.Unsubscribe(this);
+	Reset();
+}
+
+GCMessageAction LiveScoreboard::OnGCMessage(GCDirection dir, GCMessageView &msg)
+{
+	// Never sent on to the GC. Only parsed if it's going to be used.
+	// Set league_id in lobby for this to work (1 is fine)
+	if (d2lobby_enable_live_stats.GetBool() && msg.ParseBody(m_Incoming))
+	{
+		Submit(m_Incoming);
+	}
+
+	return GCMessageAction::Block;
+}
+
+void LiveScoreboard::Reset()
+{
+	ResetDeltaState();
+
+	m_Latest.Clear();
+	m_bHaveLatest = false;
+	m_flLastSendTime = 0.0;
+}
+
+void LiveScoreboard::ResetDeltaState()
+{
+	if (m_pPrevious)
+	{
+		json_decref(m_pPrevious);
+		m_pPrevious = nullptr;
+	}
+
+	m_Seq = 0;
+	m_UpdatesSinceKeyframe = 0;
+	m_bKeyframeRequested = false;
+	m_bStatsSent = false;
+}
+
+void LiveScoreboard::Submit(CMsgDOTALiveScoreboardUpdate &msg)
+{
+	if (m_bHaveLatest)
+	{
+		++m_Coalesced;
+	}
+
+	m_Latest.Swap(&msg);
+	m_bHaveLatest = true;
+}
+
+void LiveScoreboard::OnGameFrame()
+{
+	if (!m_bHaveLatest || g_HTTPManager.IsBusy(PayloadKind::Update))
+		return;
+
+	if (Plat_FloatTime() - m_flLastSendTime < d2lobby_live_stats_min_interval.GetFloat())
+		return;
+
+	SendLatest();
+}
+
+void LiveScoreboard::SendLatest()
+{
+	m_bHaveLatest = false;
+	m_flLastSendTime = Plat_FloatTime();
+
+	json_t *pJson = Encode(m_Latest);
+	if (!pJson)
+		return;
+
+	uint32 baseSeq = (uint32)json_integer_value(json_object_get(pJson, "base_seq"));
+	PostUpdate(pJson, baseSeq);
+	json_decref(pJson);
+
+	// A sink that lost an earlier update, or has none yet, can't apply the
+	// delta. It gets this update as a keyframe instead, while the others
+	// carry on with deltas.
+	if (baseSeq && g_HTTPManager.IsLiveSinkBehind(m_Seq))
+	{
+		json_t *pKeyframe = json_deep_copy(m_pPrevious);
+		json_object_set_new(pKeyframe, "keyframe", json_true());
+		json_object_set_new(pKeyframe, "seq", json_integer(m_Seq));
+		++m_CatchUpKeyframes;
+
+		PostUpdate(pKeyframe, 0);
+		json_decref(pKeyframe);
+	}
+}
+
+void LiveScoreboard::PostUpdate(json_t *pJson, uint32 baseSeq)
+{
+	json_object_set_new(pJson, "status", json_string("update"));
+	json_object_set_new(pJson, "match_id", json_integer(g_LobbyMgr.MatchId()));
+
+	// Deltas only carry the match stats when they've changed. Full updates
+	// always do.
+	bool bFull = !baseSeq;
+	if (bFull || !m_bStatsSent || g_MatchStats.Serial() != m_StatsSerial)
+	{
+		json_object_set_new(pJson, "match_stats", g_MatchStats.ToJSON());
+		m_StatsSerial = g_MatchStats.Serial();
+		m_bStatsSent = true;
+	}
+
+	PayloadRef payload = Payload::FromJSON(pJson, JSON_COMPACT);
+
+	UTIL_MsgAndLogPayload(*payload, "Sending live update:\n");
+
+	g_HTTPManager.PostLiveUpdate(payload, pJson, m_Seq, baseSeq);
+}
+
+json_t *LiveScoreboard::Encode(const CMsgDOTALiveScoreboardUpdate &msg)
+{
+	json_t *pCurrent = parse_msg(&msg);
+
+	if (!d2lobby_live_stats_delta.GetBool())
+	{
+		ResetDeltaState();
+		return pCurrent;
+	}
+
+	json_t *pOut;
+	if (!m_pPrevious || m_bKeyframeRequested
+		|| m_UpdatesSinceKeyframe + 1 >= (uint32)d2lobby_live_stats_keyframe_interval.GetInt())
+	{
+		pOut = json_deep_copy(pCurrent);
+		json_object_set_new(pOut, "keyframe", json_true());
+
+		m_UpdatesSinceKeyframe = 0;
+		m_bKeyframeRequested = false;
+		++m_Keyframes;
+	}
+	else
+	{
+		// The clock alone doesn't count as a change, but goes along with
+		// any other one.
+		json_t *pClock = json_object_get(pCurrent, kClockField);
+		json_t *pPrevClock = json_object_get(m_pPrevious, kClockField);
+		if (pClock)
+		{
+			json_incref(pClock);
+			json_object_del(pCurrent, kClockField);
+		}
+		if (pPrevClock)
+		{
+			json_incref(pPrevClock);
+			json_object_del(m_pPrevious, kClockField);
+		}
+
+		pOut = json_object();
+		bool bChanged = DiffObjects(m_pPrevious, pCurrent, pOut);
+
+		if (pClock)
+		{
+			json_object_set_new(pCurrent, kClockField, pClock);
+		}
+		if (pPrevClock)
+		{
+			json_decref(pPrevClock);
+		}
+
+		if (!bChanged)
+		{
+			// Keep the old snapshot so the next delta is still against what
+			// the backend has, except for the clock.
+			if (pClock)
+			{
+				json_object_set(m_pPrevious, kClockField, pClock);
+			}
+			json_decref(pCurrent);
+			json_decref(pOut);
+			++m_Skipped;
+			return nullptr;
+		}
+
+		if (pClock)
+		{
+			json_object_set(pOut, kClockField, pClock);
+		}
+		json_object_set_new(pOut, "base_seq", json_integer(m_Seq));
+
+		++m_UpdatesSinceKeyframe;
+		++m_Deltas;
+	}
+
+	++m_Seq;
+	json_object_set_new(pOut, "seq", json_integer(m_Seq));
+
+	if (m_pPrevious)
+	{
+		json_decref(m_pPrevious);
+	}
+	m_pPrevious = pCurrent;
+
+	return pOut;
+}
+
+void LiveScoreboard::PrintDebug() const
+{
+	Msg("Live scoreboard: seq %u, %u keyframe(s) (%u for sinks behind), %u delta(s), %u unchanged update(s) skipped, %u replaced before sending%s\n",
+		m_Seq, m_Keyframes, m_CatchUpKeyframes, m_Deltas, m_Skipped, m_Coalesced, m_bHaveLatest ? ", one waiting" : "");
+}
@@ -0,0 +1,105 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "gcmgr.h"
+#include "pluginsystem.h"
+
+#include <basetypes.h>
+
+#include <generated_proto/dota_gcmessages_server.pb.h>
+
+struct json_t;
+
+// Turns live scoreboard updates into the JSON that is posted to the match
+// url. With d2lobby_live_stats_delta on, only what changed since the
+// previous update is sent:
+//
+// - Nested messages (teams) contain only their changed fields.
+// - Repeated messages whose count didn't change (players) are sent as an
+//   object mapping the index to that element's changed fields.
+// - Any other changed value is sent whole, and removed fields as null.
+//
+// Updates also carry "match_stats", the running totals from MatchStats,
+// whenever they have changed since the last update and on every full one.
+//
+// Every update carries "seq". Deltas also carry "base_seq", the update they
+// apply to, and full updates carry "keyframe": true. A keyframe is sent to
+// every sink each d2lobby_live_stats_keyframe_interval updates and when
+// requested. Each sink tracks the last update it took, and one that lost
+// an update or joined late gets the next one as a keyframe on its own.
+//
+// Updates are coalesced into a single slot: a newer scoreboard replaces one
+// that hasn't been sent yet, only one is outstanding at a time, and sends
+// are at least d2lobby_live_stats_min_interval seconds apart. Encoding
+// happens when the slot is sent, so deltas are always against what was
+// actually posted.
+class LiveScoreboard : public IPluginSystem, public IGCMessageHandler
+{
+public:
+	virtual const char *GetName() const override { return "Live Scoreboard"; }
+	bool OnLoad() override;
+	void OnUnload() override;
+	void OnGameFrame() override;
+public: // IGCMessageHandler
+	GCMessageAction OnGCMessage(GCDirection dir, GCMessageView &msg) override;
+public:
+	// Takes the contents of msg.
+	void Submit(CMsgDOTALiveScoreboardUpdate &msg);
+	void RequestKeyframe() { m_bKeyframeRequested = true; }
+	void PrintDebug() const;
+private:
+	void Reset();
+	void ResetDeltaState();
+	void SendLatest();
+	// Adds the match fields and posts it. baseSeq is 0 for full updates.
+	void PostUpdate(json_t *pJson, uint32 baseSeq);
+	// Returns the JSON to send, or nullptr if nothing changed.
+	json_t *Encode(const CMsgDOTALiveScoreboardUpdate &msg);
+private:
+	CMsgDOTALiveScoreboardUpdate m_Latest;
+	// Parsed into, then swapped with m_Latest, so the two are reused.
+	CMsgDOTALiveScoreboardUpdate m_Incoming;
+	bool m_bHaveLatest = false;
+	double m_flLastSendTime = 0.0;
+	uint32 m_Coalesced = 0;
+
+	json_t *m_pPrevious = nullptr;
+	uint32 m_Seq = 0;
+	uint32 m_UpdatesSinceKeyframe = 0;
+	bool m_bKeyframeRequested = false;
+	// Match stats serial in the last update that carried them.
+	uint32 m_StatsSerial = 0;
+	bool m_bStatsSent = false;
+
+	uint32 m_Keyframes = 0;
+	uint32 m_CatchUpKeyframes = 0;
+	uint32 m_Deltas = 0;
+	uint32 m_Skipped = 0;
+};
+
+extern LiveScoreboard g_LiveScoreboard;
@@ -26,11 +26,18 @@
 #include "lobbymgr.h"
 
 #include "d2lobby.h"
+#include "eventlog.h"
 #include "gcmgr.h"
+#include "httpmgr.h"
+#include "identity.h"
+#include "livestats.h"
+#include "matchstats.h"
+#include "msgcapture.h"
 #include "util.h"
 
 #include <inttypes.h>
 
+#include <generated_proto/dota_gcmessages_msgid.pb.h>
 #include <generated_proto/gcsystemmsgs.pb.h>
 
 SH_DECL_HOOK0(IServerGCLobby, LobbyAllowsCheats, const, 0, bool);
@@ -90,6 +97,13 @@ CON_COMMAND(set_custom_min_players, "")
 CON_COMMAND(d2lobby_debug, "")
 {
 	g_LobbyMgr.PrintDebug();
+	g_HTTPManager.PrintDebug();
+	g_LiveScoreboard.PrintDebug();
+	g_PlayerIdentities.PrintDebug();
+	g_EventLogger.PrintDebug();
+	g_MatchStats.PrintDebug();
+	g_MessageCapture.PrintDebug();
+	g_GCMgr.PrintDebug();
 }
 
 extern ConVar match_post_url;
@@ -99,14 +113,35 @@ bool LobbyManager::OnLoad()
 	m_Lobby.Clear();
 	m_CustomLobby.Clear();
 	int hookid = SH_ADD_HOOK(IServerGCLobby, LobbyAllowsCheats, gamedll->GetServerGCLobby(), SH_MEMBER(this, &LobbyManager::Hook_LobbyAllowsCheats), false);
+	g_GCMgr.Subscribe(this, GCDirection::Outgoing, k_EMsgGCConnectedPlayers);
 	return hookid != 0;
 }
 
 void LobbyManager::OnUnload()
 {
+	g_GCMgr.Unsubscribe(this);
 	SH_REMOVE_HOOK(IServerGCLobby, LobbyAllowsCheats, gamedll->GetServerGCLobby(), SH_MEMBER(this, &LobbyManager::Hook_LobbyAllowsCheats), false);
 }
 
+GCMessageAction LobbyManager::OnGCMessage(GCDirection dir, GCMessageView &msg)
+{
+	msg.ParseBody(m_ConnectedPlayers);
+
+	UTIL_MsgAndLog("Intercepted outgoing k_EMsgGCConnectedPlayers (%s)\n", CMsgConnectedPlayers_SendReason_Name(m_ConnectedPlayers.send_reason()).c_str());
+
+	HandleConnectedPlayers(m_ConnectedPlayers);
+
+	return GCMessageAction::Block;
+}
+
+void LobbyManager::OnGameFrame()
+{
+	if (m_bLobbyDirty)
+	{
+		SendLobbySOUpdate();
+	}
+}
+
 void LobbyManager::PrintDebug()
 {
 	Msg("Radiant players:\n");
@@ -142,6 +177,7 @@ void LobbyManager::PrintDebug()
 	Msg("Match POST Url: \"%s\"\n", match_post_url.GetString());
 	Msg("Match Type: %d (%s)\n", m_LobbyType, CSODOTALobby_LobbyType_Name(m_LobbyType).c_str());
 	Msg("Game Mode: %d (%s)\n", m_GameMode, DOTA_GameMode_Name((DOTA_GameMode)m_GameMode).c_str());
+	Msg("Lobby Updates: %u sent, %u unchanged\n", m_LobbyUpdatesSent, m_LobbyUpdatesSkipped);
 }
 
 CON_COMMAND(reset_all, "")
@@ -406,9 +442,7 @@ void LobbyManager::CheckInjectLobby()
 		auto *pObject = sub.add_objects();
 		pObject->set_type_id(2004);
 
-		std::string data;
-		m_Lobby.SerializeToString(&data);
-		pObject->add_object_data(data);
+		m_Lobby.SerializeToString(pObject->add_object_data());
 
 		m_LobbyOwner.set_id(k_LobbyId);
 		m_LobbyOwner.set_type(3);
@@ -417,17 +451,9 @@ void LobbyManager::CheckInjectLobby()
 		sub.mutable_owner_soid()->set_type(3);
 		sub.set_version(s_LobbyVersion);
 
-		uint32 emsg = k_ESOMsg_CacheSubscribed | 0x80000000;
-		int headerSize = 0;
-
-		std::string message;
-		message.append((const char *)&emsg, sizeof(uint32));
-		message.append((const char *)&headerSize, sizeof(int));
-		sub.AppendToString(&message);
-
 		Msg("Adding CacheSubscribed message to the queue\n");
 
-		g_GCMgr.InjectGCMessage(message);
+		g_GCMgr.InjectGCMessage(GCFrame::Build(k_ESOMsg_CacheSubscribed | kGCProtoBufFlag, sub));
 	}
 
 	{
@@ -446,17 +472,9 @@ void LobbyManager::CheckInjectLobby()
 		obj.mutable_owner_soid()->set_id(k_LobbyId);
 		m_Lobby.SerializeToString(obj.mutable_object_data());
 
-		uint32 emsg = k_ESOMsg_Create | 0x80000000;
-		int headerSize = 0;
-
-		std::string message;
-		message.append((const char *)&emsg, sizeof(uint32));
-		message.append((const char *)&headerSize, sizeof(int));
-		obj.AppendToString(&message);
-
 		Msg("Adding SOCreate message to the queue\n");
 
-		g_GCMgr.InjectGCMessage(message);
+		g_GCMgr.InjectGCMessage(GCFrame::Build(k_ESOMsg_Create | kGCProtoBufFlag, obj));
 	}
 
 	{
@@ -467,26 +485,8 @@ void LobbyManager::CheckInjectLobby()
 
 		m_Lobby.set_state(CSODOTALobby_State_SERVERSETUP);
 
-		CMsgSOMultipleObjects objs;
-		auto obj = objs.add_objects_modified();
-		obj->set_type_id(2004);
-		m_Lobby.SerializeToString(obj->mutable_object_data());
-		objs.set_version(++s_LobbyVersion);
-		objs.set_service_id(0);
-		objs.mutable_owner_soid()->set_type(3);
-		objs.mutable_owner_soid()->set_id(k_LobbyId);
-
-		uint32 emsg = k_ESOMsg_UpdateMultiple | 0x80000000;
-		int headerSize = 0;
-
-		std::string message;
-		message.append((const char *)&emsg, sizeof(uint32));
-		message.append((const char *)&headerSize, sizeof(int));
-		objs.AppendToString(&message);
-
-		Msg("[Stub] Adding SOUpdateMultiple message to the queue\n");
-
-		g_GCMgr.InjectGCMessage(message);
+		// Not left for the frame, so it goes out with the two above.
+		SendLobbySOUpdate();
 	}
 
 	m_bLobbyInjected = true;
@@ -496,12 +496,16 @@ void LobbyManager::PopulateLobbyData()
 {
 	int i;
 
+	g_PlayerIdentities.Reset();
+	g_MatchStats.Reset();
+
 	i = 1;
 	for (auto &p : m_RadiantPlayers)
 	{
 		auto *pMember = m_Lobby.add_members();
 		pMember->set_id(p->SteamId().ConvertToUint64());
 		pMember->set_team(DOTA_GC_TEAM_GOOD_GUYS);
+		g_PlayerIdentities.AddMember(p->SteamId(), kTeamRadiant);
 		pMember->set_name(p->Name());
 		pMember->set_slot(i++); // 1-5, 1-5
 		pMember->set_party_id(1);
@@ -518,6 +522,7 @@ void LobbyManager::PopulateLobbyData()
 		auto *pMember = m_Lobby.add_members();
 		pMember->set_id(p->SteamId().ConvertToUint64());
 		pMember->set_team(DOTA_GC_TEAM_BAD_GUYS);
+		g_PlayerIdentities.AddMember(p->SteamId(), kTeamDire);
 		pMember->set_name(p->Name());
 		pMember->set_slot(i++); // 1-5, 1-5
 		pMember->set_party_id(2);
@@ -534,6 +539,7 @@ void LobbyManager::PopulateLobbyData()
 		auto *pMember = m_Lobby.add_members();
 		pMember->set_id(p->SteamId().ConvertToUint64());
 		pMember->set_team(DOTA_GC_TEAM_SPECTATOR);
+		g_PlayerIdentities.AddMember(p->SteamId(), kTeamSpectators);
 		pMember->set_name(p->Name());
 		pMember->set_slot(i++); // 1-5, 1-5
 		pMember->set_party_id(3);
@@ -666,7 +672,7 @@ void LobbyManager::UpdatePlayerName(const CSteamID &sid, const char *pszName)
 		if (m.id() == sid.ConvertToUint64())
 		{
 			m.set_name(pszName);
-			SendLobbySOUpdate();
+			MarkLobbyDirty();
 			break;
 		}
 	}
@@ -700,38 +706,44 @@ void LobbyManager::FinalizeLobby()
 	m_Lobby.set_state(CSODOTALobby_State_RUN);
 	m_Lobby.set_match_id(g_LobbyMgr.MatchId());
 
-	SendLobbySOUpdate();
+	MarkLobbyDirty();
 }
 
 void LobbyManager::SendLobbySOUpdate()
 {
-	CMsgSOMultipleObjects objs;
-	auto obj = objs.add_objects_modified();
-	obj->set_type_id(k_LobbySOType);
-	m_Lobby.SerializeToString(obj->mutable_object_data());
-	objs.set_version(++s_LobbyVersion);
-	objs.set_service_id(0);
-	objs.mutable_owner_soid()->set_type(k_LobbyOwnerType);
-	objs.mutable_owner_soid()->set_id(k_LobbyId);
+	m_bLobbyDirty = false;
+
+	// Only the lobby bytes and the version change between updates.
+	if (!m_SOUpdate.objects_modified_size())
+	{
+		m_SOUpdate.add_objects_modified()->set_type_id(k_LobbySOType);
+		m_SOUpdate.set_service_id(0);
+		m_SOUpdate.mutable_owner_soid()->set_type(k_LobbyOwnerType);
+		m_SOUpdate.mutable_owner_soid()->set_id(k_LobbyId);
+	}
 
-	uint32 emsg = k_ESOMsg_UpdateMultiple | 0x80000000;
-	int headerSize = 0;
+	std::string *pData = m_SOUpdate.mutable_objects_modified(0)->mutable_object_data();
+	m_Lobby.SerializeToString(pData);
+	if (*pData == m_LastSentLobby)
+	{
+		++m_LobbyUpdatesSkipped;
+		return;
+	}
 
-	std::string message;
-	message.append((const char *)&emsg, sizeof(uint32));
-	message.append((const char *)&headerSize, sizeof(int));
-	objs.AppendToString(&message);
+	m_LastSentLobby = *pData;
+	++m_LobbyUpdatesSent;
+	m_SOUpdate.set_version(++s_LobbyVersion);
 
 	Msg("[Stub] Adding SOUpdateMultiple message to the queue\n");
 
-	g_GCMgr.InjectGCMessage(message);
+	g_GCMgr.InjectGCMessage(GCFrame::Build(k_ESOMsg_UpdateMultiple | kGCProtoBufFlag, m_SOUpdate));
 }
 
 void LobbyManager::EnterPostGame(EMatchOutcome outcome)
 {
 	m_Lobby.set_state(CSODOTALobby_State_POSTGAME);
 	m_Lobby.set_match_outcome(outcome);
-	SendLobbySOUpdate();
+	MarkLobbyDirty();
 }
 
 void LobbyManager::DeleteLobby()
@@ -747,17 +759,9 @@ void LobbyManager::DeleteLobby()
 	objs.mutable_owner_soid()->set_type(3);
 	objs.mutable_owner_soid()->set_id(k_LobbyId);
 
-	uint32 emsg = k_ESOMsg_UpdateMultiple | 0x80000000;
-	int headerSize = 0;
-
-	std::string message;
-	message.append((const char *)&emsg, sizeof(uint32));
-	message.append((const char *)&headerSize, sizeof(int));
-	objs.AppendToString(&message);
-
 	Msg("[Stub] Adding SOUpdateMultiple message to the queue\n");
 
-	g_GCMgr.InjectGCMessage(message);
+	g_GCMgr.InjectGCMessage(GCFrame::Build(k_ESOMsg_UpdateMultiple | kGCProtoBufFlag, objs));
 }
 
 void LobbyManager::OnPlayerConnected(const CSteamID &steamId)
@@ -821,6 +825,8 @@ void LobbyManager::HandleConnectedPlayers(const CMsgConnectedPlayers &msg)
 {
 	for (auto &connected : msg.connected_players())
 	{
+		g_PlayerIdentities.OnConnectionStateChanged(CSteamID((uint64)connected.steam_id()), true);
+
 		for (auto &p : *m_Lobby.mutable_members())
 		{
 			if (p.id() == connected.steam_id())
@@ -834,6 +840,8 @@ void LobbyManager::HandleConnectedPlayers(const CMsgConnectedPlayers &msg)
 
 	for (auto &disconnected : msg.disconnected_players())
 	{
+		g_PlayerIdentities.OnConnectionStateChanged(CSteamID((uint64)disconnected.steam_id()), false);
+
 		for (auto &p : *m_Lobby.mutable_members())
 		{
 			if (p.id() == disconnected.steam_id())
@@ -847,18 +855,6 @@ void LobbyManager::HandleConnectedPlayers(const CMsgConnectedPlayers &msg)
 	m_Lobby.set_first_blood_happened(msg.first_blood_happened());
 	m_Lobby.set_game_state(msg.game_state());
 
-	SendLobbySOUpdate();
+	MarkLobbyDirty();
 }
 
-CSteamID LobbyManager::MemberSteamIdFromAccountId(AccountID_t aid)
-{
-	for (auto m : m_Lobby.members())
-	{
-		CSteamID sid = CSteamID((uint64)m.id());
-		if (sid.GetAccountID() == aid)
-			return sid;
-	}
-
-	static CSteamID steamIdInvalid = CSteamID();
-	return steamIdInvalid;
-}
@@ -28,18 +28,22 @@
 #include "pluginsystem.h"
 
 #include "constants.h"
+#include "gcmgr.h"
 
 #include <generated_proto/dota_gcmessages_common.pb.h>
 #include <generated_proto/dota_gcmessages_server.pb.h>
 
 #include <vector>
 
-class LobbyManager : public IPluginSystem
+class LobbyManager : public IPluginSystem, public IGCMessageHandler
 {
 public:
 	virtual const char *GetName() const override { return "Lobby Manager"; }
 	virtual bool OnLoad() override;
 	virtual void OnUnload() override;
+	virtual void OnGameFrame() override;
+public: // IGCMessageHandler
+	GCMessageAction OnGCMessage(GCDirection dir, GCMessageView &msg) override;
 public:
 	bool AddRadiantPlayer(const CSteamID &steamId, const char *pszName, const char *pszHero);
 	bool AddDirePlayer(const CSteamID &steamId, const char *pszName, const char *pszHero);
@@ -50,8 +54,6 @@ public:
 	void SetGameMode(uint32 mode);
 	void SetMatchType(uint32 matchType);
 
-	CSteamID MemberSteamIdFromAccountId(AccountID_t id);
-
 	void CheckInjectLobby();
 
 	DOTA_GameState GetGameState() const { return m_Lobby.game_state(); }
@@ -87,6 +89,13 @@ public:
 		return m_MatchId;
 	}
 
+	// Once a match id is given or a lobby injected, the server is running a
+	// match and the game thread belongs to it.
+	inline bool IsMatchActive() const
+	{
+		return m_MatchId != 0 || m_bLobbyInjected;
+	}
+
 	inline const google::protobuf::RepeatedPtrField<CDOTALobbyMember> &LobbyMembers()
 	{
 		return m_Lobby.members();
@@ -94,6 +103,8 @@ public:
 
 private:
 	void PopulateLobbyData();
+	// Changes to the lobby are sent once per frame, as one update.
+	void MarkLobbyDirty() { m_bLobbyDirty = true; }
 	void SendLobbySOUpdate();
 private:
 	class Player
@@ -184,6 +195,16 @@ public:
 	CSODOTALobby m_CustomLobby;
 private:
 	CMsgSOIDOwner m_LobbyOwner;
+	// Reused for every lobby update, so the lobby is serialized into the
+	// same object_data buffer each time.
+	CMsgSOMultipleObjects m_SOUpdate;
+	CMsgConnectedPlayers m_ConnectedPlayers;
+	// Lobby bytes of the last update sent. An update that would send the
+	// same bytes is skipped.
+	std::string m_LastSentLobby;
+	bool m_bLobbyDirty = false;
+	uint32 m_LobbyUpdatesSent = 0;
+	uint32 m_LobbyUpdatesSkipped = 0;
 
 	const uint64 k_LobbyId = 24210021764591890;
 	const int k_LobbySOType = 2004;
@@ -56,12 +56,15 @@ bool Logger::OnLoad()
 
 void Logger::OnUnload()
 {
+	std::lock_guard<std::mutex> lock(m_Mutex);
 	if (m_pLogFile)
 		filesystem->Close(m_pLogFile);
+	m_pLogFile = nullptr;
 }
 
 void Logger::SetMatchId(uint64 matchId)
 {
+	std::lock_guard<std::mutex> lock(m_Mutex);
 	if (m_pLogFile)
 	{
 		filesystem->Close(m_pLogFile);
@@ -97,3 +100,9 @@ void Logger::InternalLogToFile(const char *pszText)
 
 	filesystem->FPrintf(m_pLogFile, "%s", string);
 }
+
+void Logger::InternalLogPayload(const Payload &payload)
+{
+	filesystem->Write(payload.Data(), payload.Size(), m_pLogFile);
+	filesystem->Write("\n", 1, m_pLogFile);
+}
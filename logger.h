@@ -25,9 +25,12 @@
 
 #pragma once
 
+#include "payload.h"
 #include "pluginsystem.h"
 #include <filesystem.h>
 
+#include <mutex>
+
 class Logger : IPluginSystem
 {
 public:
@@ -36,8 +39,10 @@ public:
 	virtual void OnUnload() override;
 public:
 	void SetMatchId(uint64 matchId);
+	// All of these can be called from any thread.
 	void LogToFile(const char *pszText)
 	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
 		if (m_pLogFile)
 		{
 			InternalLogToFile(pszText);
@@ -46,17 +51,34 @@ public:
 	template <typename ... Ts>
 	void LogToFilef(const char *pMsg, Ts ... ts)
 	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (m_pLogFile)
+		{
+			static char string[1024];
+			Q_snprintf(string, sizeof(string), pMsg, ts...);
+			InternalLogToFile(string);
+		}
+	}
+	// Logs a formatted line followed by the whole payload, however long.
+	template <typename ... Ts>
+	void LogPayloadf(const Payload &payload, const char *pMsg, Ts ... ts)
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
 		if (m_pLogFile)
 		{
 			static char string[1024];
 			Q_snprintf(string, sizeof(string), pMsg, ts...);
 			InternalLogToFile(string);
+			InternalLogPayload(payload);
 		}
 	}
 private:
 	void InternalLogToFile(const char *pszText);
+	void InternalLogPayload(const Payload &payload);
 	void OpenNewLog(const char *pszFileName);
 private:
+	// Guards the file handle and the format buffers.
+	std::mutex m_Mutex;
 	FileHandle_t m_pLogFile = nullptr;
 };
 
@@ -0,0 +1,276 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "matchstats.h"
+
+#include "identity.h"
+#include "util.h"
+
+#include <jansson.h>
+
+MatchStats g_MatchStats;
+
+bool MatchStats::OnLoad()
+{
+	Reset();
+	return true;
+}
+
+void MatchStats::Reset()
+{
+	memset(m_Players, 0, sizeof(m_Players));
+	memset(m_Teams, 0, sizeof(m_Teams));
+	++m_Serial;
+}
+
+MatchStats::PlayerStats *MatchStats::Player(int playerId)
+{
+	if (playerId < 0 || playerId >= kMaxGamePlayerIds)
+		return nullptr;
+
+	PlayerStats &player = m_Players[playerId];
+	player.bSeen = true;
+	++m_Serial;
+	return &player;
+}
+
+MatchStats::TeamStats *MatchStats::Team(int team)
+{
+	if (team != kTeamRadiant && team != kTeamDire)
+		return nullptr;
+
+	++m_Serial;
+	return &m_Teams[team - kTeamRadiant];
+}
+
+MatchStats::TeamStats *MatchStats::PlayerTeam(PlayerStats &player, int playerId)
+{
+	if (player.team == kTeamUnassigned)
+	{
+		player.team = g_PlayerIdentities.GetPlayerIdTeam(playerId);
+	}
+
+	return Team(player.team);
+}
+
+void MatchStats::OnHeroKill(int victimId, const int *pKillers, int killerCount)
+{
+	if (PlayerStats *pVictim = Player(victimId))
+	{
+		++pVictim->deaths;
+		if (TeamStats *pTeam = PlayerTeam(*pVictim, victimId))
+		{
+			++pTeam->deaths;
+		}
+	}
+
+	// The first is the killer, the rest assisted.
+	for (int i = 0; i < killerCount; ++i)
+	{
+		PlayerStats *pKiller = Player(pKillers[i]);
+		if (!pKiller)
+			continue;
+
+		if (i == 0)
+		{
+			++pKiller->kills;
+			if (TeamStats *pTeam = PlayerTeam(*pKiller, pKillers[i]))
+			{
+				++pTeam->kills;
+			}
+		}
+		else
+		{
+			++pKiller->assists;
+		}
+	}
+}
+
+void MatchStats::OnTowerKill(int playerId, int team)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->towerKills;
+	}
+
+	if (TeamStats *pTeam = Team(team))
+	{
+		++pTeam->towerKills;
+	}
+}
+
+void MatchStats::OnTowerDeny(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->towerDenies;
+	}
+}
+
+void MatchStats::OnCourierKill(int team)
+{
+	if (TeamStats *pTeam = Team(team))
+	{
+		++pTeam->courierKills;
+	}
+}
+
+void MatchStats::OnRoshanKill(int team)
+{
+	if (TeamStats *pTeam = Team(team))
+	{
+		++pTeam->roshanKills;
+	}
+}
+
+void MatchStats::OnBuyback(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->buybacks;
+		if (TeamStats *pTeam = PlayerTeam(*pPlayer, playerId))
+		{
+			++pTeam->buybacks;
+		}
+	}
+}
+
+void MatchStats::OnFirstBlood(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		pPlayer->bFirstBlood = true;
+	}
+}
+
+void MatchStats::OnRuneBottled(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->runesBottled;
+	}
+}
+
+void MatchStats::OnRuneUsed(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->runesUsed;
+	}
+}
+
+void MatchStats::OnAegisPickup(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->aegisPickups;
+	}
+}
+
+void MatchStats::OnAegisSteal(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->aegisSteals;
+	}
+}
+
+void MatchStats::OnAegisDeny(int playerId)
+{
+	if (PlayerStats *pPlayer = Player(playerId))
+	{
+		++pPlayer->aegisDenies;
+	}
+}
+
+json_t *MatchStats::ToJSON()
+{
+	json_t *pPlayers = json_array();
+	for (int i = 0; i < kMaxGamePlayerIds; ++i)
+	{
+		const PlayerStats &p = m_Players[i];
+		if (!p.bSeen)
+			continue;
+
+		json_t *pPlayer = json_object();
+		json_object_set_new(pPlayer, "player_id", json_integer(i));
+		json_object_set_new(pPlayer, "steam_id", json_integer(UTIL_PlayerIdToSteamId(i).ConvertToUint64()));
+		json_object_set_new(pPlayer, "kills", json_integer(p.kills));
+		json_object_set_new(pPlayer, "deaths", json_integer(p.deaths));
+		json_object_set_new(pPlayer, "assists", json_integer(p.assists));
+		json_object_set_new(pPlayer, "tower_kills", json_integer(p.towerKills));
+		json_object_set_new(pPlayer, "tower_denies", json_integer(p.towerDenies));
+		json_object_set_new(pPlayer, "buybacks", json_integer(p.buybacks));
+		json_object_set_new(pPlayer, "runes_bottled", json_integer(p.runesBottled));
+		json_object_set_new(pPlayer, "runes_used", json_integer(p.runesUsed));
+		json_object_set_new(pPlayer, "aegis_pickups", json_integer(p.aegisPickups));
+		json_object_set_new(pPlayer, "aegis_steals", json_integer(p.aegisSteals));
+		json_object_set_new(pPlayer, "aegis_denies", json_integer(p.aegisDenies));
+		json_object_set_new(pPlayer, "first_blood", json_boolean(p.bFirstBlood));
+		json_array_append_new(pPlayers, pPlayer);
+	}
+
+	json_t *pTeams = json_object();
+	for (int t = 0; t < 2; ++t)
+	{
+		const TeamStats &s = m_Teams[t];
+
+		json_t *pTeam = json_object();
+		json_object_set_new(pTeam, "kills", json_integer(s.kills));
+		json_object_set_new(pTeam, "deaths", json_integer(s.deaths));
+		json_object_set_new(pTeam, "tower_kills", json_integer(s.towerKills));
+		json_object_set_new(pTeam, "roshan_kills", json_integer(s.roshanKills));
+		json_object_set_new(pTeam, "courier_kills", json_integer(s.courierKills));
+		json_object_set_new(pTeam, "buybacks", json_integer(s.buybacks));
+		json_object_set_new(pTeams, t == 0 ? "radiant" : "dire", pTeam);
+	}
+
+	json_t *pStats = json_object();
+	json_object_set_new(pStats, "players", pPlayers);
+	json_object_set_new(pStats, "teams", pTeams);
+	return pStats;
+}
+
+void MatchStats::PrintDebug() const
+{
+	Msg("Match stats (serial %u):\n", m_Serial);
+	for (int i = 0; i < kMaxGamePlayerIds; ++i)
+	{
+		const PlayerStats &p = m_Players[i];
+		if (!p.bSeen)
+			continue;
+
+		Msg("- player %d (team %d): %u/%u/%u, %u tower(s), %u buyback(s), %u rune(s)\n",
+			i, p.team, p.kills, p.deaths, p.assists, p.towerKills, p.buybacks, p.runesBottled + p.runesUsed);
+	}
+
+	for (int t = 0; t < 2; ++t)
+	{
+		const TeamStats &s = m_Teams[t];
+		Msg("- %s: %u kill(s), %u death(s), %u tower(s), %u roshan, %u courier(s)\n",
+			t == 0 ? "radiant" : "dire", s.kills, s.deaths, s.towerKills, s.roshanKills, s.courierKills);
+	}
+}
@@ -0,0 +1,108 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "constants.h"
+#include "pluginsystem.h"
+
+#include <basetypes.h>
+
+struct json_t;
+
+// Running per-player and per-team totals for the match, updated as each
+// game event comes in so the backend doesn't have to rebuild them from the
+// event stream. Attached to live updates and to the completed payload.
+//
+// Player ids index straight into a fixed array. A player's team is looked
+// up once and cached.
+class MatchStats : public IPluginSystem
+{
+public: // IPluginSystem
+	virtual const char *GetName() const override { return "Match Stats"; }
+	bool OnLoad() override;
+public:
+	// Starts a new match.
+	void Reset();
+
+	void OnHeroKill(int victimId, const int *pKillers, int killerCount);
+	void OnTowerKill(int playerId, int team);
+	void OnTowerDeny(int playerId);
+	void OnCourierKill(int team);
+	void OnRoshanKill(int team);
+	void OnBuyback(int playerId);
+	void OnFirstBlood(int playerId);
+	void OnRuneBottled(int playerId);
+	void OnRuneUsed(int playerId);
+	void OnAegisPickup(int playerId);
+	void OnAegisSteal(int playerId);
+	void OnAegisDeny(int playerId);
+
+	// Bumped by every change.
+	uint32 Serial() const { return m_Serial; }
+	json_t *ToJSON();
+	void PrintDebug() const;
+private:
+	struct PlayerStats
+	{
+		uint32 kills;
+		uint32 deaths;
+		uint32 assists;
+		uint32 towerKills;
+		uint32 towerDenies;
+		uint32 buybacks;
+		uint32 runesBottled;
+		uint32 runesUsed;
+		uint32 aegisPickups;
+		uint32 aegisSteals;
+		uint32 aegisDenies;
+		bool bFirstBlood;
+		// kTeamUnassigned until looked up.
+		int team;
+		bool bSeen;
+	};
+
+	struct TeamStats
+	{
+		uint32 kills;
+		uint32 deaths;
+		uint32 towerKills;
+		uint32 roshanKills;
+		uint32 courierKills;
+		uint32 buybacks;
+	};
+private:
+	PlayerStats *Player(int playerId);
+	TeamStats *Team(int team);
+	TeamStats *PlayerTeam(PlayerStats &player, int playerId);
+private:
+	PlayerStats m_Players[kMaxGamePlayerIds];
+	// Radiant and Dire
+	TeamStats m_Teams[2];
+	uint32 m_Serial = 0;
+};
+
+extern MatchStats g_MatchStats;
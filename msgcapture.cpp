@@ -0,0 +1,488 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "msgcapture.h"
+
+#include "d2lobby.h"
+#include "eventlog.h"
+#include "lobbymgr.h"
+#include "matchstats.h"
+#include "util.h"
+
+#include <inttypes.h>
+
+#include <generated_proto/dota_usermessages.pb.h>
+
+#ifdef D2LOBBY_COUNT_ALLOCS
+#include <new>
+#include <stdlib.h>
+#endif
+
+MessageCapture g_MessageCapture;
+
+#define CAPTURE_DIR "d2lobby_logs/captures"
+
+static const uint8 kCaptureMagic[4] = { 'D', '2', 'L', 'C' };
+static const uint32 kCaptureVersion = 2;
+static const size_t kRecordHeaderSize = 15;
+static const size_t kCaptureFlushSize = 64 * 1024;
+
+#ifdef D2LOBBY_COUNT_ALLOCS
+// Replaces the global allocator for the whole process, so only for builds
+// made to measure. The count is per thread, so the game thread's own
+// allocations are all that's measured.
+static thread_local uint64 s_Allocations = 0;
+
+void *operator new(size_t size)
+{
+	++s_Allocations;
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+static uint64 AllocationCount()
+{
+	return s_Allocations;
+}
+#else
+static uint64 AllocationCount()
+{
+	return 0;
+}
+#endif
+
+CON_COMMAND(d2lobby_capture_start, "d2lobby_capture_start [name] - Records the user messages the event logger handles to d2lobby_logs/captures/<name>.bin")
+{
+	char szName[64];
+	if (args.ArgC() >= 2)
+	{
+		V_strncpy(szName, args[1], sizeof(szName));
+	}
+	else
+	{
+		Q_snprintf(szName, sizeof(szName), "%" PRIu64, g_LobbyMgr.MatchId());
+	}
+
+	g_MessageCapture.StartCapture(szName);
+}
+
+CON_COMMAND(d2lobby_capture_stop, "Stops recording user messages")
+{
+	g_MessageCapture.StopCapture();
+}
+
+CON_COMMAND(d2lobby_replay, "d2lobby_replay <name> [speed] - Feeds a capture through the event logger. Speed 0 (the default) is as fast as possible, 1 is real time")
+{
+	if (args.ArgC() < 2)
+	{
+		Msg("d2lobby_replay <name> [speed]\n");
+		return;
+	}
+
+	g_MessageCapture.StartReplay(args[1], args.ArgC() >= 3 ? atof(args[2]) : 0.0f);
+}
+
+CON_COMMAND(d2lobby_replay_stop, "Stops a capture replay and reports what was fed so far")
+{
+	g_MessageCapture.StopReplay();
+}
+
+static const char *UserMessageName(uint16 id)
+{
+	switch (id)
+	{
+	case DOTA_UM_ChatEvent:
+		return "ChatEvent";
+	case DOTA_UM_ChatWheel:
+		return "ChatWheel";
+	case DOTA_UM_GamerulesStateChanged:
+		return "GamerulesStateChanged";
+	default:
+		return nullptr;
+	}
+}
+
+static void WriteLE(uint8 *p, uint32 value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+	{
+		p[i] = (uint8)(value >> (i * 8));
+	}
+}
+
+static uint32 ReadLE(const uint8 *p, int bytes)
+{
+	uint32 value = 0;
+	for (int i = 0; i < bytes; ++i)
+	{
+		value |= (uint32)p[i] << (i * 8);
+	}
+	return value;
+}
+
+void MessageCapture::OnUnload()
+{
+	StopCapture();
+
+	// The event logger may already be unloaded, so it isn't drained here.
+	// It drops whatever it hasn't sent anyway.
+	m_bReplaying = false;
+	m_ReplayData.clear();
+	m_ReplayData.shrink_to_fit();
+
+	for (auto &m : m_ReplayMessages)
+	{
+		delete m.second;
+	}
+	m_ReplayMessages.clear();
+}
+
+bool MessageCapture::StartCapture(const char *pszName)
+{
+	if (IsCapturing())
+	{
+		Msg("Already capturing\n");
+		return false;
+	}
+
+	filesystem->CreateDirHierarchy(CAPTURE_DIR, "DEFAULT_WRITE_PATH");
+
+	char szPath[260];
+	Q_snprintf(szPath, sizeof(szPath), CAPTURE_DIR "/%s.bin", pszName);
+
+	m_hCaptureFile = filesystem->Open(szPath, "wb", "DEFAULT_WRITE_PATH");
+	if (m_hCaptureFile == FILESYSTEM_INVALID_HANDLE)
+	{
+		UTIL_MsgAndLog("Couldn't open \"%s\" for capture\n", szPath);
+		return false;
+	}
+
+	uint8 header[8];
+	memcpy(header, kCaptureMagic, sizeof(kCaptureMagic));
+	WriteLE(header + 4, kCaptureVersion, 4);
+	filesystem->Write(header, sizeof(header), m_hCaptureFile);
+
+	m_flCaptureStartTime = Plat_FloatTime();
+	m_Captured = 0;
+	m_CapturedBytes = sizeof(header);
+
+	UTIL_MsgAndLog("Capturing user messages to \"%s\"\n", szPath);
+	return true;
+}
+
+void MessageCapture::StopCapture()
+{
+	if (!IsCapturing())
+		return;
+
+	FlushCapture();
+	filesystem->Close(m_hCaptureFile);
+	m_hCaptureFile = FILESYSTEM_INVALID_HANDLE;
+
+	UTIL_MsgAndLog("Captured %u user message(s), %" PRIu64 " bytes\n", m_Captured, m_CapturedBytes);
+}
+
+void MessageCapture::Capture(uint16 id, const void *pData, int clientCount, const unsigned char *clients)
+{
+	if (!UserMessageName(id))
+		return;
+
+	auto *pMessage = (const google::protobuf::Message *)pData;
+	m_CaptureMessage.clear();
+	if (!pMessage->SerializeToString(&m_CaptureMessage))
+		return;
+
+	uint8 recipients = (uint8)MIN(MAX(clientCount, 0), 255);
+	uint32 ms = (uint32)((Plat_FloatTime() - m_flCaptureStartTime) * 1000.0);
+	uint32 tick = (uint32)engine->GetServerGlobals()->tickcount;
+
+	size_t start = m_CaptureBuffer.size();
+	m_CaptureBuffer.resize(start + kRecordHeaderSize + recipients + m_CaptureMessage.size());
+
+	uint8 *p = m_CaptureBuffer.data() + start;
+	WriteLE(p, ms, 4);
+	WriteLE(p + 4, tick, 4);
+	WriteLE(p + 8, id, 2);
+	p[10] = recipients;
+	WriteLE(p + 11, (uint32)m_CaptureMessage.size(), 4);
+	p += kRecordHeaderSize;
+
+	if (recipients)
+	{
+		memcpy(p, clients, recipients);
+		p += recipients;
+	}
+	memcpy(p, m_CaptureMessage.data(), m_CaptureMessage.size());
+
+	++m_Captured;
+
+	if (m_CaptureBuffer.size() >= kCaptureFlushSize)
+	{
+		FlushCapture();
+	}
+}
+
+void MessageCapture::FlushCapture()
+{
+	if (m_CaptureBuffer.empty())
+		return;
+
+	filesystem->Write(m_CaptureBuffer.data(), (int)m_CaptureBuffer.size(), m_hCaptureFile);
+	m_CapturedBytes += m_CaptureBuffer.size();
+	m_CaptureBuffer.clear();
+}
+
+google::protobuf::Message *MessageCapture::ReplayMessage(uint16 id)
+{
+	auto i = m_ReplayMessages.find(id);
+	if (i != m_ReplayMessages.end())
+		return i->second;
+
+	google::protobuf::Message *pMessage = nullptr;
+	switch (id)
+	{
+	case DOTA_UM_ChatEvent:
+		pMessage = new CDOTAUserMsg_ChatEvent;
+		break;
+	case DOTA_UM_ChatWheel:
+		pMessage = new CDOTAUserMsg_ChatWheel;
+		break;
+	case DOTA_UM_GamerulesStateChanged:
+		pMessage = new CDOTAUserMsg_GamerulesStateChanged;
+		break;
+	}
+
+	m_ReplayMessages[id] = pMessage;
+	return pMessage;
+}
+
+bool MessageCapture::StartReplay(const char *pszName, float flSpeed)
+{
+	if (m_bReplaying)
+	{
+		Msg("A replay is already running\n");
+		return false;
+	}
+
+	// It goes through the same event logger and match stats as a real match.
+	if (g_LobbyMgr.IsMatchActive())
+	{
+		Msg("Can't replay while a lobby or match is active\n");
+		return false;
+	}
+
+	char szPath[260];
+	Q_snprintf(szPath, sizeof(szPath), CAPTURE_DIR "/%s.bin", pszName);
+
+	FileHandle_t hFile = filesystem->Open(szPath, "rb", "DEFAULT_WRITE_PATH");
+	if (hFile == FILESYSTEM_INVALID_HANDLE)
+	{
+		Msg("Couldn't open \"%s\"\n", szPath);
+		return false;
+	}
+
+	m_ReplayData.resize(filesystem->Size(hFile));
+	int read = filesystem->Read(m_ReplayData.data(), (int)m_ReplayData.size(), hFile);
+	filesystem->Close(hFile);
+
+	if (read != (int)m_ReplayData.size() || m_ReplayData.size() < 8
+		|| memcmp(m_ReplayData.data(), kCaptureMagic, sizeof(kCaptureMagic)) || ReadLE(m_ReplayData.data() + 4, 4) != kCaptureVersion)
+	{
+		Msg("\"%s\" isn't a capture file\n", szPath);
+		m_ReplayData.clear();
+		return false;
+	}
+
+	m_ReplayPos = 8;
+	m_bReplaying = true;
+	m_flReplaySpeed = MAX(flSpeed, 0.0f);
+	m_flReplayStartTime = Plat_FloatTime();
+	m_ReplayState = 0;
+	m_ReplayStats.clear();
+
+	g_EventLogger.SetReplaying(true);
+
+	UTIL_MsgAndLog("Replaying \"%s\" (%u bytes) at %s\n", szPath, (uint32)m_ReplayData.size(), m_flReplaySpeed > 0.0f ? "the recorded pace" : "full speed");
+
+	if (m_flReplaySpeed <= 0.0f)
+	{
+		while (ReplayNext(true))
+		{
+		}
+		FinishReplay();
+	}
+
+	return true;
+}
+
+void MessageCapture::StopReplay()
+{
+	if (m_bReplaying)
+	{
+		FinishReplay();
+	}
+}
+
+void MessageCapture::OnGameFrame()
+{
+	if (!m_bReplaying)
+		return;
+
+	if (g_LobbyMgr.IsMatchActive())
+	{
+		UTIL_MsgAndLog("Stopping the replay, a lobby or match has started\n");
+		FinishReplay();
+		return;
+	}
+
+	while (ReplayNext(false))
+	{
+	}
+
+	if (m_ReplayPos >= m_ReplayData.size())
+	{
+		FinishReplay();
+	}
+}
+
+bool MessageCapture::ReplayNext(bool bAll)
+{
+	if (m_ReplayPos + kRecordHeaderSize > m_ReplayData.size())
+	{
+		m_ReplayPos = m_ReplayData.size();
+		return false;
+	}
+
+	const uint8 *p = m_ReplayData.data() + m_ReplayPos;
+	uint32 ms = ReadLE(p, 4);
+	int tick = (int)ReadLE(p + 4, 4);
+	uint16 id = (uint16)ReadLE(p + 8, 2);
+	uint8 recipients = p[10];
+	uint32 size = ReadLE(p + 11, 4);
+
+	size_t recordSize = kRecordHeaderSize + recipients + size;
+	if (m_ReplayPos + recordSize > m_ReplayData.size())
+	{
+		Msg("Capture is truncated\n");
+		m_ReplayPos = m_ReplayData.size();
+		return false;
+	}
+
+	if (!bAll && (Plat_FloatTime() - m_flReplayStartTime) * m_flReplaySpeed * 1000.0 < ms)
+		return false;
+
+	m_ReplayPos += recordSize;
+
+	const unsigned char *clients = p + kRecordHeaderSize;
+	google::protobuf::Message *pMessage = ReplayMessage(id);
+	if (!pMessage || !pMessage->ParseFromArray(clients + recipients, size))
+		return true;
+
+	// Only the event logger's share of the work is measured, not parsing.
+	uint64 allocs = AllocationCount();
+	double flStart = Plat_FloatTime();
+
+	if (id == DOTA_UM_GamerulesStateChanged)
+	{
+		uint32 state = ((CDOTAUserMsg_GamerulesStateChanged *)pMessage)->state();
+		g_EventLogger.OnDOTAGameStateChange(m_ReplayState, state);
+		m_ReplayState = state;
+	}
+	// Duplicates are found by the tick the message was captured on, not
+	// the server's current one, which doesn't move during a full speed
+	// replay.
+	g_EventLogger.OnGameEvent(id, pMessage, recipients, clients, MAX(tick, 0));
+
+	double flElapsed = Plat_FloatTime() - flStart;
+	allocs = AllocationCount() - allocs;
+
+	ReplayStats &stats = m_ReplayStats[id];
+	stats.cpuNs.Add((uint64)(flElapsed * 1e9));
+	stats.allocs.Add(allocs);
+
+	return true;
+}
+
+void MessageCapture::FinishReplay()
+{
+	m_bReplaying = false;
+	m_ReplayData.clear();
+	m_ReplayData.shrink_to_fit();
+
+	// Everything the replay logged is handed to the sinks before the event
+	// logger goes back to sending for real, and the stats it counted don't
+	// carry into the next match.
+	g_EventLogger.SetReplaying(false);
+	g_MatchStats.Reset();
+
+	UTIL_MsgAndLog("Replay finished after %.3fs\n", Plat_FloatTime() - m_flReplayStartTime);
+	ReportReplay();
+}
+
+void MessageCapture::ReportReplay() const
+{
+	char szBuf[256];
+	for (auto &s : m_ReplayStats)
+	{
+		UTIL_MsgAndLog("Replayed %s:\n", UserMessageName(s.first));
+		s.second.cpuNs.Format(szBuf, sizeof(szBuf));
+		UTIL_MsgAndLog("- cpu ns: %s\n", szBuf);
+#ifdef D2LOBBY_COUNT_ALLOCS
+		s.second.allocs.Format(szBuf, sizeof(szBuf));
+		UTIL_MsgAndLog("- allocations: %s\n", szBuf);
+#endif
+	}
+}
+
+void MessageCapture::PrintDebug() const
+{
+	if (IsCapturing())
+	{
+		Msg("Capturing: %u user message(s), %" PRIu64 " bytes\n", m_Captured, m_CapturedBytes + m_CaptureBuffer.size());
+	}
+
+	if (m_bReplaying)
+	{
+		Msg("Replaying: %u/%u bytes fed\n", (uint32)m_ReplayPos, (uint32)m_ReplayData.size());
+	}
+}
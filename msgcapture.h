@@ -0,0 +1,121 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "histogram.h"
+#include "pluginsystem.h"
+
+#include <basetypes.h>
+#include <filesystem.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace google { namespace protobuf { class Message; } }
+
+// Records the user messages EventLogger handles to a file under
+// d2lobby_logs/captures, and plays such a file back through EventLogger to
+// reproduce a match's event load offline.
+//
+// The file is "D2LC" and a uint32 version, then one record per message:
+//
+//   uint32 milliseconds since the capture started
+//   uint32 server tick the message was sent on
+//   uint16 message id
+//   uint8  recipient count
+//   uint32 message size
+//   uint8  recipient slots[recipient count]
+//   uint8  serialized message[message size]
+//
+// All little endian. Replays only run with no lobby or match active, since
+// they feed the live event logger and match stats. The event batches they
+// produce go through the discard transport, and the game thread CPU time
+// spent on each message is reported. Allocations are counted too when built
+// with D2LOBBY_COUNT_ALLOCS.
+class MessageCapture : public IPluginSystem
+{
+public: // IPluginSystem
+	virtual const char *GetName() const override { return "Message Capture"; }
+	void OnUnload() override;
+	void OnGameFrame() override;
+public:
+	bool StartCapture(const char *pszName);
+	void StopCapture();
+	bool IsCapturing() const { return m_hCaptureFile != FILESYSTEM_INVALID_HANDLE; }
+
+	void OnMessage(uint16 id, const void *pData, int clientCount = 0, const unsigned char *clients = nullptr)
+	{
+		if (IsCapturing())
+		{
+			Capture(id, pData, clientCount, clients);
+		}
+	}
+
+	// A speed of 0 replays the whole file at once. Otherwise messages are
+	// fed on the game frame they are due, at that multiple of real time.
+	bool StartReplay(const char *pszName, float flSpeed);
+	void StopReplay();
+	bool IsReplaying() const { return m_bReplaying; }
+
+	void PrintDebug() const;
+private:
+	struct ReplayStats
+	{
+		Histogram cpuNs;
+		Histogram allocs;
+	};
+private:
+	void Capture(uint16 id, const void *pData, int clientCount, const unsigned char *clients);
+	void FlushCapture();
+	// Feeds the next record if it is due. Returns false when there are none
+	// left or the next isn't due yet.
+	bool ReplayNext(bool bAll);
+	void FinishReplay();
+	void ReportReplay() const;
+	google::protobuf::Message *ReplayMessage(uint16 id);
+private:
+	FileHandle_t m_hCaptureFile = FILESYSTEM_INVALID_HANDLE;
+	std::vector<uint8> m_CaptureBuffer;
+	std::string m_CaptureMessage;
+	double m_flCaptureStartTime = 0.0;
+	uint32 m_Captured = 0;
+	uint64 m_CapturedBytes = 0;
+
+	std::vector<uint8> m_ReplayData;
+	size_t m_ReplayPos = 0;
+	bool m_bReplaying = false;
+	float m_flReplaySpeed = 0.0f;
+	double m_flReplayStartTime = 0.0;
+	uint32 m_ReplayState = 0;
+	// Reused for every record of the same id, so parsing doesn't allocate
+	// once they have grown.
+	std::map<uint16, google::protobuf::Message *> m_ReplayMessages;
+	std::map<uint16, ReplayStats> m_ReplayStats;
+};
+
+extern MessageCapture g_MessageCapture;
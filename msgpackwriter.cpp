@@ -0,0 +1,220 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "msgpackwriter.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+MessagePackWriter::~MessagePackWriter()
+{
+	free(m_pData);
+}
+
+bool MessagePackWriter::Grow(size_t capacity)
+{
+	if (m_bFailed)
+		return false;
+
+	size_t newCapacity = m_Capacity ? m_Capacity * 2 : 256;
+	while (newCapacity < capacity)
+		newCapacity *= 2;
+
+	char *pData = (char *)realloc(m_pData, newCapacity);
+	if (!pData)
+	{
+		m_bFailed = true;
+		return false;
+	}
+
+	m_pData = pData;
+	m_Capacity = newCapacity;
+	return true;
+}
+
+void MessagePackWriter::PutBigEndian(uint8 tag, uint64 value, int bytes)
+{
+	if (!Reserve(1 + bytes))
+		return;
+
+	m_pData[m_Size++] = (char)tag;
+	for (int i = bytes - 1; i >= 0; --i)
+	{
+		m_pData[m_Size++] = (char)(uint8)(value >> (i * 8));
+	}
+}
+
+void MessagePackWriter::BeginContainer(uint8 tag)
+{
+	BeforeValue();
+
+	// Deeper than anything written here. Marked failed rather than
+	// writing past the count table.
+	if (m_Depth == kMaxDepth)
+	{
+		m_bFailed = true;
+		return;
+	}
+
+	++m_Depth;
+	m_Headers[m_Depth] = m_Size;
+	m_Counts[m_Depth] = 0;
+	PutBigEndian(tag, 0, 4);
+}
+
+void MessagePackWriter::EndContainer()
+{
+	if (!m_Depth)
+		return;
+
+	if (!m_bFailed)
+	{
+		uint32 count = m_Counts[m_Depth];
+		char *p = m_pData + m_Headers[m_Depth] + 1;
+		p[0] = (char)(uint8)(count >> 24);
+		p[1] = (char)(uint8)(count >> 16);
+		p[2] = (char)(uint8)(count >> 8);
+		p[3] = (char)(uint8)count;
+	}
+
+	--m_Depth;
+}
+
+void MessagePackWriter::Int(int64 value)
+{
+	if (value >= 0)
+	{
+		UInt((uint64)value);
+		return;
+	}
+
+	BeforeValue();
+
+	if (value >= -32)
+	{
+		Put((uint8)(int8)value);
+	}
+	else if (value >= -0x80)
+	{
+		PutBigEndian(0xD0, (uint64)value, 1);
+	}
+	else if (value >= -0x8000)
+	{
+		PutBigEndian(0xD1, (uint64)value, 2);
+	}
+	else if (value >= -0x80000000LL)
+	{
+		PutBigEndian(0xD2, (uint64)value, 4);
+	}
+	else
+	{
+		PutBigEndian(0xD3, (uint64)value, 8);
+	}
+}
+
+void MessagePackWriter::UInt(uint64 value)
+{
+	BeforeValue();
+
+	if (value <= 0x7F)
+	{
+		Put((uint8)value);
+	}
+	else if (value <= 0xFF)
+	{
+		PutBigEndian(0xCC, value, 1);
+	}
+	else if (value <= 0xFFFF)
+	{
+		PutBigEndian(0xCD, value, 2);
+	}
+	else if (value <= 0xFFFFFFFFULL)
+	{
+		PutBigEndian(0xCE, value, 4);
+	}
+	else
+	{
+		PutBigEndian(0xCF, value, 8);
+	}
+}
+
+void MessagePackWriter::Real(double value, int decimals)
+{
+	BeforeValue();
+
+	// Same as the JSON writer, which has no representation for these.
+	if (!isfinite(value))
+	{
+		value = 0.0;
+	}
+
+	uint64 bits;
+	memcpy(&bits, &value, sizeof(bits));
+	PutBigEndian(0xCB, bits, 8);
+}
+
+void MessagePackWriter::Bool(bool value)
+{
+	BeforeValue();
+	Put(value ? 0xC3 : 0xC2);
+}
+
+void MessagePackWriter::Null()
+{
+	BeforeValue();
+	Put(0xC0);
+}
+
+void MessagePackWriter::String(const char *pszValue)
+{
+	BeforeValue();
+
+	size_t len = strlen(pszValue);
+	if (len < 32)
+	{
+		Put((uint8)(0xA0 | len));
+	}
+	else if (len <= 0xFF)
+	{
+		PutBigEndian(0xD9, len, 1);
+	}
+	else if (len <= 0xFFFF)
+	{
+		PutBigEndian(0xDA, len, 2);
+	}
+	else
+	{
+		PutBigEndian(0xDB, len, 4);
+	}
+
+	Append(pszValue, len);
+}
+
+void MessagePackWriter::Raw(const char *pData, size_t len)
+{
+	BeforeValue();
+	Append(pData, len);
+}
@@ -0,0 +1,155 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <stddef.h>
+#include <string.h>
+
+// Writes MessagePack straight into a growable buffer, with the same calls
+// as JSONWriter so one piece of code can write either format. Reset() keeps
+// the memory.
+//
+// Element counts aren't known when a map or array starts, so containers
+// always get the 32-bit header and its count is filled in when they end.
+// Reals are always float64 and the decimals argument is ignored.
+//
+// If the buffer can't grow, the writer keeps what it has, ignores every
+// later write and reports Failed() until the next Reset().
+class MessagePackWriter
+{
+public:
+	MessagePackWriter() = default;
+	~MessagePackWriter();
+
+	MessagePackWriter(const MessagePackWriter &) = delete;
+	MessagePackWriter &operator=(const MessagePackWriter &) = delete;
+
+	void Reset()
+	{
+		m_Size = 0;
+		m_Depth = 0;
+		m_bAfterKey = false;
+		m_bFailed = false;
+	}
+
+	bool Failed() const { return m_bFailed; }
+	const char *Data() const { return m_pData; }
+	size_t Size() const { return m_Size; }
+	size_t Capacity() const { return m_Capacity; }
+
+	void BeginObject() { BeginContainer(0xDF); }
+	void EndObject() { EndContainer(); }
+	void BeginArray() { BeginContainer(0xDD); }
+	void EndArray() { EndContainer(); }
+
+	template <size_t N>
+	void Key(const char (&szKey)[N])
+	{
+		static_assert(N - 1 < 32, "Keys are written as fixstr");
+
+		// Maps count pairs, so the key counts and its value doesn't.
+		++m_Counts[m_Depth];
+		if (!Reserve(N))
+			return;
+
+		m_pData[m_Size++] = (char)(0xA0 | (N - 1));
+		memcpy(m_pData + m_Size, szKey, N - 1);
+		m_Size += N - 1;
+		m_bAfterKey = true;
+	}
+
+	void Int(int64 value);
+	void UInt(uint64 value);
+	void Real(double value, int decimals = 3);
+	void Bool(bool value);
+	void Null();
+	void String(const char *pszValue);
+	// An already encoded MessagePack value.
+	void Raw(const char *pData, size_t len);
+private:
+	static const int kMaxDepth = 32;
+
+	void BeforeValue()
+	{
+		if (m_bAfterKey)
+		{
+			m_bAfterKey = false;
+			return;
+		}
+
+		if (m_Depth)
+		{
+			++m_Counts[m_Depth];
+		}
+	}
+
+	void BeginContainer(uint8 tag);
+	void EndContainer();
+
+	void Put(uint8 c)
+	{
+		if (Reserve(1))
+		{
+			m_pData[m_Size++] = (char)c;
+		}
+	}
+
+	void PutBigEndian(uint8 tag, uint64 value, int bytes);
+
+	void Append(const char *pData, size_t len)
+	{
+		if (Reserve(len))
+		{
+			memcpy(m_pData + m_Size, pData, len);
+			m_Size += len;
+		}
+	}
+
+	bool Reserve(size_t len)
+	{
+		if (m_Size + len > m_Capacity)
+			return Grow(m_Size + len);
+
+		return !m_bFailed;
+	}
+
+	bool Grow(size_t capacity);
+private:
+	char *m_pData = nullptr;
+	size_t m_Size = 0;
+	size_t m_Capacity = 0;
+
+	// Per open container, where its header is and how many elements (or
+	// pairs) it has so far. Index 0 is the top level.
+	size_t m_Headers[kMaxDepth + 1];
+	uint32 m_Counts[kMaxDepth + 1];
+	int m_Depth = 0;
+	bool m_bAfterKey = false;
+	bool m_bFailed = false;
+};
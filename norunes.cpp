@@ -33,7 +33,7 @@
 #include <generated_proto/dota_clientmessages.pb.h>
 #include <generated_proto/dota_gcmessages_common.pb.h>
 
-#include <subhook.h>
+#include "detour.h"
 
 static NoRunes s_NoRunes;
 
@@ -71,7 +71,7 @@ const int INDEX_COURIER = 45;
 const int INDEX_FLYING_COURIER = 84;
 
 
-static subhook_t s_AEOHook;
+static Detour s_AEODetour;
 void *s_pAEOFunc;
 
 class GenericClass {};
@@ -124,15 +124,7 @@ void CDOTAPlayer::AddExecuteOrders_Hook(const CDOTAClientMsg_ExecuteOrders *pOrd
 			}
 		}
 	}
-#if defined( __x86_64__ ) || defined ( _M_X64 )
-	subhook_remove(s_AEOHook);
-	s_ThiscallHelper.pVoid = s_pAEOFunc;
 	(this->*s_ThiscallHelper.mfp)(pOrders);
-	subhook_install(s_AEOHook);
-#else
-	s_ThiscallHelper.pVoid = subhook_get_trampoline(s_AEOHook);
-	(this->*s_ThiscallHelper.mfp)(pOrders);
-#endif
 }
 
 bool NoRunes::OnLoad()
@@ -150,22 +142,26 @@ bool NoRunes::OnLoad()
 		return false;
 	}
 
-	s_AEOHook = subhook_new(s_pAEOFunc, GetCodeAddress(&CDOTAPlayer::AddExecuteOrders_Hook),
-#if defined( __x86_64__ ) || defined( _M_X64 )
-		SUBHOOK_OPTION_64BIT_OFFSET
-#else
-		subhook_options_t(0)
-#endif
-	);
-	subhook_install(s_AEOHook);
+	if (!s_AEODetour.Create(s_pAEOFunc, GetCodeAddress(&CDOTAPlayer::AddExecuteOrders_Hook)))
+	{
+		Msg("Couldn't create AddExecuteOrders detour!\n");
+		return false;
+	}
+
+	s_ThiscallHelper.pVoid = s_AEODetour.Trampoline();
+	if (!s_AEODetour.Install())
+	{
+		Msg("Couldn't install AddExecuteOrders detour!\n");
+		s_AEODetour.Free();
+		return false;
+	}
 
 	return true;
 }
 
 void NoRunes::OnUnload()
 {
-	subhook_remove(s_AEOHook);
-	subhook_free(s_AEOHook);
+	s_AEODetour.Free();
 }
 
 void NoRunes::OnDOTAGameStateChange(uint32 oldState, uint32 state)
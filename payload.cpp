@@ -0,0 +1,123 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "payload.h"
+
+#include <jansson.h>
+
+#include <new>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+size_t Payload::HeaderSize()
+{
+	return offsetof(Payload, m_Data);
+}
+
+void Payload::Release()
+{
+	if (--m_RefCount == 0)
+	{
+		this->~Payload();
+		free(this);
+	}
+}
+
+PayloadRef Payload::Empty()
+{
+	// Never allocated and never freed. It keeps its first reference for
+	// good, so the count can't reach zero.
+	alignas(Payload) static char s_Block[sizeof(Payload)] = {};
+	static Payload *s_pEmpty = new (s_Block) Payload(0);
+
+	s_pEmpty->AddRef();
+	return PayloadRef(s_pEmpty);
+}
+
+PayloadRef Payload::Copy(const char *pData, size_t size)
+{
+	void *pMem = malloc(HeaderSize() + size + 1);
+	if (!pMem)
+		return Empty();
+
+	Payload *pPayload = new (pMem) Payload((uint32)size);
+	memcpy(pPayload->m_Data, pData, size);
+	pPayload->m_Data[size] = '\0';
+
+	return PayloadRef(pPayload);
+}
+
+namespace
+{
+	// The header is only constructed once the dump is done, so the block
+	// can be grown with realloc while jansson writes into it.
+	struct DumpBuffer
+	{
+		char *pBlock = nullptr;
+		size_t size = 0;
+		size_t capacity = 0;
+	};
+}
+
+int Payload::DumpCallback(const char *pBuffer, size_t size, void *pData)
+{
+	auto *pDump = (DumpBuffer *)pData;
+
+	if (pDump->size + size + 1 > pDump->capacity)
+	{
+		size_t capacity = pDump->capacity ? pDump->capacity * 2 : 1024;
+		while (pDump->size + size + 1 > capacity)
+			capacity *= 2;
+
+		char *pBlock = (char *)realloc(pDump->pBlock, HeaderSize() + capacity);
+		if (!pBlock)
+			return -1;
+
+		pDump->pBlock = pBlock;
+		pDump->capacity = capacity;
+	}
+
+	memcpy(pDump->pBlock + HeaderSize() + pDump->size, pBuffer, size);
+	pDump->size += size;
+
+	return 0;
+}
+
+PayloadRef Payload::FromJSON(const json_t *pJson, size_t flags)
+{
+	DumpBuffer dump;
+	if (json_dump_callback(pJson, DumpCallback, &dump, flags) != 0 || !dump.pBlock)
+	{
+		free(dump.pBlock);
+		return Empty();
+	}
+
+	Payload *pPayload = new (dump.pBlock) Payload((uint32)dump.size);
+	pPayload->m_Data[dump.size] = '\0';
+
+	return PayloadRef(pPayload);
+}
@@ -0,0 +1,104 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <basetypes.h>
+
+#include <atomic>
+#include <utility>
+
+struct json_t;
+class PayloadRef;
+
+// Immutable bytes of an outgoing payload with a known size. Created once and
+// then shared by reference between the log, the spool, the compressor and
+// every HTTP attempt. Always NUL terminated, so text payloads can be used as
+// C strings. The reference count is atomic since payloads are handed to
+// worker threads.
+class Payload
+{
+public:
+	// Both return the shared empty payload if memory runs out, so there is
+	// always a body to hand on.
+	static PayloadRef Copy(const char *pData, size_t size);
+	// Serializes straight into the payload buffer, no intermediate string.
+	static PayloadRef FromJSON(const json_t *pJson, size_t flags);
+	static PayloadRef Empty();
+
+	const char *Data() const { return m_Data; }
+	uint32 Size() const { return m_Size; }
+private:
+	friend class PayloadRef;
+
+	Payload(uint32 size) : m_RefCount(1), m_Size(size) {}
+	Payload(const Payload &) = delete;
+
+	static size_t HeaderSize();
+	static int DumpCallback(const char *pBuffer, size_t size, void *pData);
+
+	void AddRef() { ++m_RefCount; }
+	void Release();
+private:
+	std::atomic<int> m_RefCount;
+	uint32 m_Size;
+	char m_Data[1];
+};
+
+class PayloadRef
+{
+public:
+	PayloadRef() = default;
+	PayloadRef(const PayloadRef &other) : m_pPayload(other.m_pPayload)
+	{
+		if (m_pPayload)
+			m_pPayload->AddRef();
+	}
+	PayloadRef(PayloadRef &&other) : m_pPayload(other.m_pPayload)
+	{
+		other.m_pPayload = nullptr;
+	}
+	~PayloadRef()
+	{
+		if (m_pPayload)
+			m_pPayload->Release();
+	}
+
+	PayloadRef &operator=(PayloadRef other)
+	{
+		std::swap(m_pPayload, other.m_pPayload);
+		return *this;
+	}
+
+	explicit operator bool() const { return m_pPayload != nullptr; }
+	const Payload *operator->() const { return m_pPayload; }
+	const Payload &operator*() const { return *m_pPayload; }
+private:
+	friend class Payload;
+	explicit PayloadRef(Payload *pPayload) : m_pPayload(pPayload) {}
+private:
+	Payload *m_pPayload = nullptr;
+};
@@ -40,6 +40,7 @@ public:
 	virtual void OnUnload() {}
 	virtual void OnServerActivated() {}
 	virtual void OnLevelShutdown() {}
+	virtual void OnGameFrame() {}
 	virtual void OnDOTAGameStateChange(uint32 oldState, uint32 newState) {}
 };
 
@@ -0,0 +1,70 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+
+// Fixed capacity queue for exactly one producer thread and one consumer
+// thread. Push and Pop never block or allocate. Push fails when full.
+template <typename T, size_t N>
+class SPSCRing
+{
+	static_assert((N & (N - 1)) == 0, "Ring capacity must be a power of two");
+public:
+	bool Push(const T &item)
+	{
+		size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head - m_Tail.load(std::memory_order_acquire) == N)
+			return false;
+
+		m_Items[head & (N - 1)] = item;
+		m_Head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	bool Pop(T &item)
+	{
+		size_t tail = m_Tail.load(std::memory_order_relaxed);
+		if (tail == m_Head.load(std::memory_order_acquire))
+			return false;
+
+		item = m_Items[tail & (N - 1)];
+		m_Tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Only exact when called from the producer or the consumer with the
+	// other side idle.
+	size_t Size() const { return m_Head.load(std::memory_order_acquire) - m_Tail.load(std::memory_order_acquire); }
+	static size_t Capacity() { return N; }
+private:
+	// Kept on separate cache lines so the two threads don't contend.
+	alignas(64) std::atomic<size_t> m_Head{ 0 };
+	alignas(64) std::atomic<size_t> m_Tail{ 0 };
+	alignas(64) T m_Items[N];
+};
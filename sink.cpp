@@ -0,0 +1,785 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "sink.h"
+
+#include "eventlog.h"
+#include "httpmgr.h"
+#include "util.h"
+
+#include <vstdlib/random.h>
+
+#include <string>
+
+extern ConVar match_post_url;
+
+static ConVar d2lobby_http_max_attempts("d2lobby_http_max_attempts", "8", FCVAR_RELEASE, "Attempts made to deliver a request before it is dropped", true, 1.0f, false, 0.0f);
+static ConVar d2lobby_http_retry_delay("d2lobby_http_retry_delay", "1.0", FCVAR_RELEASE, "Base delay in seconds before the first retry. Doubles with each attempt", true, 0.01f, false, 0.0f);
+static ConVar d2lobby_http_retry_max_delay("d2lobby_http_retry_max_delay", "60.0", FCVAR_RELEASE, "Upper bound in seconds on the retry delay");
+static ConVar d2lobby_http_breaker_threshold("d2lobby_http_breaker_threshold", "5", FCVAR_RELEASE, "Consecutive failures after which sending is suspended", true, 1.0f, false, 0.0f);
+static ConVar d2lobby_http_breaker_cooldown("d2lobby_http_breaker_cooldown", "30.0", FCVAR_RELEASE, "Seconds sending stays suspended before a single probe request is let through");
+static ConVar d2lobby_http_max_inflight("d2lobby_http_max_inflight", "4", FCVAR_RELEASE, "Max HTTP requests in flight at once, per sink", true, 1.0f, false, 0.0f);
+static ConVar d2lobby_http_compression("d2lobby_http_compression", "none", FCVAR_RELEASE, "Compression for large request bodies: none or gzip");
+static ConVar d2lobby_http_compression_min_size("d2lobby_http_compression_min_size", "8192", FCVAR_RELEASE, "Request bodies smaller than this many bytes are sent uncompressed");
+static ConVar d2lobby_http_compression_level("d2lobby_http_compression_level", "6", FCVAR_RELEASE, "Compression level, 1 (fastest) to 9 (smallest)", true, 1.0f, true, 9.0f);
+static ConVar d2lobby_http_format("d2lobby_http_format", "json", FCVAR_RELEASE, "Wire format for request bodies: json or msgpack");
+static ConVar d2lobby_http_queue_budget("d2lobby_http_queue_budget", "16777216", FCVAR_RELEASE, "Max bytes of request bodies waiting in a sink's send queues");
+
+const char *PayloadKindName(PayloadKind kind)
+{
+	switch (kind)
+	{
+	case PayloadKind::Startup:
+		return "startup";
+	case PayloadKind::Events:
+		return "events";
+	case PayloadKind::Update:
+		return "update";
+	case PayloadKind::Completed:
+		return "completed";
+	case PayloadKind::LoadFailed:
+		return "load_failed";
+	case PayloadKind::Shutdown:
+		return "shutdown";
+	default:
+		return "unknown";
+	}
+}
+
+bool PayloadKindMaskFromString(const char *pszKinds, uint32 &mask)
+{
+	if (!V_stricmp(pszKinds, "all"))
+	{
+		mask = kAllPayloadKinds;
+		return true;
+	}
+
+	uint32 result = 0;
+	const char *p = pszKinds;
+	while (*p)
+	{
+		const char *pszEnd = strchr(p, ',');
+		size_t len = pszEnd ? (size_t)(pszEnd - p) : strlen(p);
+
+		int k = 0;
+		for (; k < (int)PayloadKind::Count; ++k)
+		{
+			const char *pszName = PayloadKindName((PayloadKind)k);
+			if (strlen(pszName) == len && !V_strnicmp(p, pszName, len))
+				break;
+		}
+
+		if (k == (int)PayloadKind::Count)
+			return false;
+
+		result |= 1 << k;
+		p += len;
+		if (*p == ',')
+		{
+			++p;
+		}
+	}
+
+	if (!result)
+		return false;
+
+	mask = result;
+	return true;
+}
+
+HTTPSink::HTTPSink(const char *pszName, bool bMatchSink)
+	: m_Name(pszName), m_bMatchSink(bMatchSink), m_EventMask(kAllEventTypes)
+{
+}
+
+const char *HTTPSink::GetUrl() const
+{
+	if (m_Url.empty() && m_bMatchSink)
+		return match_post_url.GetString();
+
+	return m_Url.c_str();
+}
+
+bool HTTPSink::Accepts(PayloadKind kind) const
+{
+	return GetUrl()[0] && (m_KindMask & (1 << (int)kind));
+}
+
+bool HTTPSink::SetOption(const char *pszOption, const char *pszValue)
+{
+	if (!V_stricmp(pszOption, "url"))
+	{
+		m_Url = pszValue;
+	}
+	else if (!V_stricmp(pszOption, "kinds"))
+	{
+		return PayloadKindMaskFromString(pszValue, m_KindMask);
+	}
+	else if (!V_stricmp(pszOption, "events"))
+	{
+		return EventTypeMaskFromString(pszValue, m_EventMask);
+	}
+	else if (!V_stricmp(pszOption, "max_attempts"))
+	{
+		m_MaxAttempts = atoi(pszValue);
+	}
+	else if (!V_stricmp(pszOption, "retry_delay"))
+	{
+		m_flRetryDelay = atof(pszValue);
+	}
+	else if (!V_stricmp(pszOption, "retry_max_delay"))
+	{
+		m_flRetryMaxDelay = atof(pszValue);
+	}
+	else if (!V_stricmp(pszOption, "max_inflight"))
+	{
+		m_MaxInFlight = atoi(pszValue);
+	}
+	else if (!V_stricmp(pszOption, "queue_budget"))
+	{
+		m_QueueBudget = atoi(pszValue);
+	}
+	else if (!V_stricmp(pszOption, "compression"))
+	{
+		m_Compression = pszValue;
+	}
+	else if (!V_stricmp(pszOption, "format"))
+	{
+		m_Format = pszValue;
+	}
+	else if (!V_stricmp(pszOption, "batch_size"))
+	{
+		m_BatchSize = MAX(1, atoi(pszValue));
+	}
+	else if (!V_stricmp(pszOption, "batch_delay"))
+	{
+		m_flBatchDelay = MAX(0.0f, (float)atof(pszValue));
+	}
+	else
+	{
+		return false;
+	}
+
+	return true;
+}
+
+int HTTPSink::MaxAttempts() const
+{
+	return m_MaxAttempts > 0 ? m_MaxAttempts : d2lobby_http_max_attempts.GetInt();
+}
+
+float HTTPSink::RetryDelay() const
+{
+	return m_flRetryDelay > 0.0f ? m_flRetryDelay : d2lobby_http_retry_delay.GetFloat();
+}
+
+float HTTPSink::RetryMaxDelay() const
+{
+	return m_flRetryMaxDelay >= 0.0f ? m_flRetryMaxDelay : d2lobby_http_retry_max_delay.GetFloat();
+}
+
+int HTTPSink::MaxInFlight() const
+{
+	return m_MaxInFlight > 0 ? m_MaxInFlight : d2lobby_http_max_inflight.GetInt();
+}
+
+size_t HTTPSink::QueueBudget() const
+{
+	return (size_t)MAX(0, m_QueueBudget >= 0 ? m_QueueBudget : d2lobby_http_queue_budget.GetInt());
+}
+
+ContentEncoding HTTPSink::Encoding() const
+{
+	return ContentEncodingFromName(m_Compression.size() ? m_Compression.c_str() : d2lobby_http_compression.GetString());
+}
+
+WireFormat HTTPSink::Format() const
+{
+	return WireFormatFromName(m_Format.size() ? m_Format.c_str() : d2lobby_http_format.GetString());
+}
+
+HTTPSink::Lane HTTPSink::LaneForKind(PayloadKind kind)
+{
+	switch (kind)
+	{
+	case PayloadKind::Completed:
+	case PayloadKind::LoadFailed:
+		return Lane::MatchResult;
+	case PayloadKind::Startup:
+	case PayloadKind::Shutdown:
+		return Lane::Lifecycle;
+	case PayloadKind::Update:
+		return Lane::LiveStats;
+	case PayloadKind::Events:
+	default:
+		return Lane::Events;
+	}
+}
+
+HTTPSink::DropPolicy HTTPSink::LaneDropPolicy(Lane lane)
+{
+	switch (lane)
+	{
+	case Lane::Events:
+		return DropPolicy::DropOldest;
+	case Lane::LiveStats:
+		return DropPolicy::DropSuperseded;
+	default:
+		return DropPolicy::Never;
+	}
+}
+
+bool HTTPSink::IsSpooled(PayloadKind kind)
+{
+	// Live state would be stale by the next load.
+	return LaneDropPolicy(LaneForKind(kind)) != DropPolicy::DropSuperseded;
+}
+
+const char *HTTPSink::LaneName(Lane lane)
+{
+	switch (lane)
+	{
+	case Lane::MatchResult:
+		return "match result";
+	case Lane::Lifecycle:
+		return "lifecycle";
+	case Lane::Events:
+		return "events";
+	case Lane::LiveStats:
+		return "live stats";
+	default:
+		return "unknown";
+	}
+}
+
+void HTTPSink::Admit(const QueuedRequest &req)
+{
+	++m_Outstanding[(int)req.kind];
+
+	if (req.liveSeq)
+	{
+		m_LiveSeq = req.liveSeq;
+	}
+
+	if (req.kind != PayloadKind::Events || m_BatchSize <= 1)
+	{
+		Compress(req);
+		return;
+	}
+
+	// Discarded payloads are never merged with real ones.
+	if (m_Batch.size() && m_Batch.front().bDiscard != req.bDiscard)
+	{
+		FlushBatch();
+	}
+
+	if (m_Batch.empty())
+	{
+		m_flBatchStartTime = Plat_FloatTime();
+	}
+
+	m_Batch.push_back(req);
+
+	if ((int)m_Batch.size() >= m_BatchSize)
+	{
+		FlushBatch();
+	}
+}
+
+void HTTPSink::FlushBatch()
+{
+	if (m_Batch.empty())
+		return;
+
+	QueuedRequest req;
+	req.kind = PayloadKind::Events;
+	req.format = m_Batch.front().format;
+	req.flEnqueueTime = m_Batch.front().flEnqueueTime;
+	req.bDiscard = m_Batch.front().bDiscard;
+
+	if (m_Batch.size() == 1)
+	{
+		req.body = m_Batch.front().body;
+		req.spoolIds = m_Batch.front().spoolIds;
+	}
+	else
+	{
+		// The events of every batch go into one container of the same shape
+		// the backend gets from a single batch.
+		std::vector<PayloadRef> bodies;
+		bodies.reserve(m_Batch.size());
+		for (auto &b : m_Batch)
+		{
+			bodies.push_back(b.body);
+			req.spoolIds.insert(req.spoolIds.end(), b.spoolIds.begin(), b.spoolIds.end());
+		}
+
+		req.body = MergePayloadArrays(bodies.data(), bodies.size(), "events", req.format);
+		if (!req.body)
+		{
+			UTIL_LogToFile("HTTP sink %s couldn't merge %u event batch(es), sending them one by one\n", GetName(), (uint32)m_Batch.size());
+
+			std::vector<QueuedRequest> batch;
+			batch.swap(m_Batch);
+			for (auto &b : batch)
+			{
+				Compress(b);
+			}
+			return;
+		}
+	}
+
+	// The batch goes out as one request.
+	m_Outstanding[(int)PayloadKind::Events] -= (uint32)m_Batch.size() - 1;
+	m_Batch.clear();
+
+	Compress(req);
+}
+
+void HTTPSink::Compress(const QueuedRequest &req)
+{
+	ContentEncoding encoding = Encoding();
+
+	// While anything is with the compressor, everything has to go through
+	// it so that later payloads can't overtake earlier ones.
+	if (encoding == ContentEncoding::Identity && m_Compressing.empty())
+	{
+		Enqueue(req);
+		return;
+	}
+
+	if ((int)req.body->Size() < d2lobby_http_compression_min_size.GetInt())
+	{
+		encoding = ContentEncoding::Identity;
+	}
+
+	CompressingRequest c;
+	c.ticket = g_BodyCompressor.Submit(req.body, encoding, d2lobby_http_compression_level.GetInt());
+	c.request = req;
+	m_Compressing.push_back(c);
+}
+
+bool HTTPSink::TakeCompressed(BodyCompressor::Result &result)
+{
+	if (m_Compressing.empty() || m_Compressing.front().ticket != result.ticket)
+		return false;
+
+	QueuedRequest req = std::move(m_Compressing.front().request);
+	m_Compressing.pop_front();
+
+	if (result.body)
+	{
+		req.body = std::move(result.body);
+	}
+	req.encoding = result.encoding;
+
+	Enqueue(req);
+	return true;
+}
+
+void HTTPSink::Enqueue(const QueuedRequest &req)
+{
+	auto &lane = m_Lanes[(int)LaneForKind(req.kind)];
+
+	// Only the newest live state is worth sending, but a delta needs the
+	// update before it, so only a full update replaces what is queued.
+	if (LaneDropPolicy(LaneForKind(req.kind)) == DropPolicy::DropSuperseded && !req.liveBaseSeq)
+	{
+		// Dropping them doesn't put this sink behind, since it gets this
+		// full update instead.
+		uint32 liveSeq = m_LiveSeq;
+		while (lane.requests.size() && lane.requests.front().attempt == 0)
+		{
+			Drop(lane.requests.front());
+			lane.bytes -= lane.requests.front().body->Size();
+			--m_QueuedRequests;
+			m_QueuedBytes -= lane.requests.front().body->Size();
+			++m_Replaced;
+			lane.requests.pop_front();
+		}
+		m_LiveSeq = liveSeq;
+	}
+
+	lane.requests.push_back(req);
+	lane.bytes += req.body->Size();
+
+	++m_QueuedRequests;
+	m_QueuedBytes += req.body->Size();
+
+	EnforceQueueBudget();
+}
+
+void HTTPSink::EnforceQueueBudget()
+{
+	size_t budget = QueueBudget();
+	if (m_QueuedBytes <= budget)
+		return;
+
+	uint32 dropped = 0;
+
+	// Lowest priority lane gives way first.
+	for (int l = (int)Lane::Count - 1; l >= 0 && m_QueuedBytes > budget; --l)
+	{
+		DropPolicy policy = LaneDropPolicy((Lane)l);
+		if (policy == DropPolicy::Never)
+			continue;
+
+		auto &lane = m_Lanes[l];
+		while (m_QueuedBytes > budget && lane.requests.size())
+		{
+			QueuedRequest &req = lane.requests.front();
+			Drop(req);
+
+			lane.bytes -= req.body->Size();
+			++lane.dropped;
+			--m_QueuedRequests;
+			m_QueuedBytes -= req.body->Size();
+			++dropped;
+
+			lane.requests.pop_front();
+		}
+	}
+
+	if (dropped)
+	{
+		UTIL_LogToFile("HTTP sink %s over its queue budget, dropped %u request(s)\n", GetName(), dropped);
+	}
+
+	// Only lanes that are never dropped are left, and they alone don't fit.
+	if (m_QueuedBytes > budget && !m_bWarnedOverBudget)
+	{
+		UTIL_LogToFile("HTTP sink %s has %u bytes queued that can't be dropped, over its budget of %u bytes\n", GetName(), (uint32)m_QueuedBytes, (uint32)budget);
+		m_bWarnedOverBudget = true;
+	}
+}
+
+bool HTTPSink::PopNextDue(float flNow, QueuedRequest &req)
+{
+	for (int l = 0; l < (int)Lane::Count; ++l)
+	{
+		if ((Lane)l == Lane::LiveStats && m_bLiveInFlight)
+			continue;
+
+		auto &lane = m_Lanes[l];
+		for (auto r = lane.requests.begin(); r != lane.requests.end(); ++r)
+		{
+			if (r->flNextAttemptTime > flNow)
+				continue;
+
+			req = std::move(*r);
+			lane.requests.erase(r);
+			lane.bytes -= req.body->Size();
+
+			--m_QueuedRequests;
+			m_QueuedBytes -= req.body->Size();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void HTTPSink::RunFrame()
+{
+	if (m_Batch.size() && Plat_FloatTime() - m_flBatchStartTime >= m_flBatchDelay)
+	{
+		FlushBatch();
+	}
+
+	Pump();
+}
+
+void HTTPSink::Pump()
+{
+	if (!m_QueuedRequests || !g_HTTPManager.IsTransportAvailable())
+		return;
+
+	float flNow = Plat_FloatTime();
+
+	if (m_BreakerState == BreakerState::Open)
+	{
+		if (flNow - m_flBreakerOpenedTime < d2lobby_http_breaker_cooldown.GetFloat())
+			return;
+
+		UTIL_LogToFile("HTTP sink %s circuit breaker half-open, sending probe request\n", GetName());
+		m_BreakerState = BreakerState::HalfOpen;
+	}
+
+	while ((int)m_InFlightCount < MaxInFlight())
+	{
+		// While half-open, only a single probe may be outstanding.
+		if (m_BreakerState == BreakerState::Open || (m_BreakerState == BreakerState::HalfOpen && m_bProbeInFlight))
+			break;
+
+		QueuedRequest req;
+		if (!PopNextDue(flNow, req))
+			break;
+
+		if (!SendRequest(req, m_BreakerState == BreakerState::HalfOpen))
+			break;
+	}
+}
+
+bool HTTPSink::SendRequest(const QueuedRequest &req, bool bProbe)
+{
+	QueuedRequest sent = req;
+	++sent.attempt;
+	sent.flSendTime = Plat_FloatTime();
+
+	if (g_HTTPManager.StartRequest(this, sent, bProbe))
+	{
+		++m_InFlightCount;
+		if (bProbe)
+		{
+			m_bProbeInFlight = true;
+		}
+		if (LaneForKind(sent.kind) == Lane::LiveStats)
+		{
+			m_bLiveInFlight = true;
+		}
+
+		return true;
+	}
+
+	UTIL_LogToFile("Failed to start HTTP request to sink %s (attempt %d)\n", GetName(), sent.attempt);
+
+	sent.flCompleteTime = sent.flSendTime;
+	sent.status = 0;
+	g_HTTPManager.RecordAttempt(sent, false);
+
+	OnRequestFailed(sent, bProbe);
+	return false;
+}
+
+void HTTPSink::OnRequestCompleted(QueuedRequest &req, bool bProbe, bool bSuccess)
+{
+	--m_InFlightCount;
+	if (LaneForKind(req.kind) == Lane::LiveStats)
+	{
+		m_bLiveInFlight = false;
+	}
+
+	if (bSuccess)
+	{
+		OnRequestSucceeded(req, bProbe);
+	}
+	else
+	{
+		UTIL_LogToFile("HTTP request to sink %s failed (attempt %d, status %d)\n", GetName(), req.attempt, req.status);
+		OnRequestFailed(req, bProbe);
+	}
+}
+
+void HTTPSink::OnRequestSucceeded(const QueuedRequest &req, bool bProbe)
+{
+	++m_Delivered;
+
+	g_HTTPManager.OnSettled(this, req);
+	Retire(req);
+
+	if (bProbe)
+	{
+		m_bProbeInFlight = false;
+	}
+
+	m_iConsecutiveFailures = 0;
+
+	if (m_BreakerState != BreakerState::Closed)
+	{
+		UTIL_LogToFile("HTTP sink %s circuit breaker closed\n", GetName());
+		m_BreakerState = BreakerState::Closed;
+	}
+}
+
+void HTTPSink::OnRequestFailed(QueuedRequest &req, bool bProbe)
+{
+	++m_FailedAttempts;
+	++m_iConsecutiveFailures;
+
+	if (bProbe)
+	{
+		m_bProbeInFlight = false;
+	}
+
+	if ((bProbe && m_BreakerState == BreakerState::HalfOpen)
+		|| (m_BreakerState == BreakerState::Closed && m_iConsecutiveFailures >= d2lobby_http_breaker_threshold.GetInt()))
+	{
+		UTIL_LogToFile("HTTP sink %s circuit breaker opened after %d consecutive failure(s)\n", GetName(), m_iConsecutiveFailures);
+		m_BreakerState = BreakerState::Open;
+		m_flBreakerOpenedTime = Plat_FloatTime();
+	}
+
+	// By the time a retry of live state went out, newer state would be
+	// waiting to replace it. A client error other than a timeout or rate
+	// limit means the backend will never take this body.
+	bool bRetry = LaneDropPolicy(LaneForKind(req.kind)) != DropPolicy::DropSuperseded
+		&& !(req.status >= 400 && req.status <= 499 && req.status != 408 && req.status != 429);
+
+	if (!bRetry || req.attempt >= MaxAttempts())
+	{
+		UTIL_LogToFile("Giving up on HTTP request to sink %s after %d attempt(s)\n", GetName(), req.attempt);
+
+		// Settled so that it isn't sent here again on every load.
+		g_HTTPManager.OnSettled(this, req);
+		Drop(req);
+		return;
+	}
+
+	// Exponential backoff with jitter so that many servers failing at once
+	// don't all come back at the same moment.
+	float flDelay = RetryDelay() * (float)(1 << MIN(req.attempt - 1, 16));
+	flDelay = MIN(flDelay, RetryMaxDelay());
+	flDelay *= RandomFloat(0.5f, 1.0f);
+
+	req.flNextAttemptTime = Plat_FloatTime() + flDelay;
+	Enqueue(req);
+}
+
+void HTTPSink::Drop(const QueuedRequest &req)
+{
+	++m_Dropped;
+	g_HTTPManager.RecordDropped(req);
+	Retire(req);
+
+	// The backend can't apply later deltas without this one, so this sink
+	// gets a keyframe next. Other sinks carry on with deltas.
+	if (req.kind == PayloadKind::Update)
+	{
+		m_LiveSeq = 0;
+	}
+}
+
+void HTTPSink::Retire(const QueuedRequest &req)
+{
+	--m_Outstanding[(int)req.kind];
+}
+
+void HTTPSink::GetPendingSpoolIds(std::vector<uint64> &spoolIds) const
+{
+	for (auto &b : m_Batch)
+	{
+		spoolIds.insert(spoolIds.end(), b.spoolIds.begin(), b.spoolIds.end());
+	}
+
+	for (auto &c : m_Compressing)
+	{
+		spoolIds.insert(spoolIds.end(), c.request.spoolIds.begin(), c.request.spoolIds.end());
+	}
+
+	for (auto &lane : m_Lanes)
+	{
+		for (auto &r : lane.requests)
+		{
+			spoolIds.insert(spoolIds.end(), r.spoolIds.begin(), r.spoolIds.end());
+		}
+	}
+}
+
+
+const char *HTTPSink::BreakerStateName(BreakerState state)
+{
+	switch (state)
+	{
+	case BreakerState::Closed:
+		return "closed";
+	case BreakerState::Open:
+		return "open";
+	case BreakerState::HalfOpen:
+		return "half-open";
+	}
+
+	return "unknown";
+}
+
+void HTTPSink::PrintSettings() const
+{
+	char szKinds[128] = "";
+	for (int k = 0; k < (int)PayloadKind::Count; ++k)
+	{
+		if (m_KindMask & (1 << k))
+		{
+			if (szKinds[0])
+			{
+				V_strncat(szKinds, ",", sizeof(szKinds));
+			}
+			V_strncat(szKinds, PayloadKindName((PayloadKind)k), sizeof(szKinds));
+		}
+	}
+
+	char szEvents[512] = "";
+	if (m_EventMask == kAllEventTypes)
+	{
+		V_strncpy(szEvents, "all", sizeof(szEvents));
+	}
+	else
+	{
+		for (int t = 0; t < (int)EventType::Count; ++t)
+		{
+			if (m_EventMask & (1 << t))
+			{
+				if (szEvents[0])
+				{
+					V_strncat(szEvents, ",", sizeof(szEvents));
+				}
+				V_strncat(szEvents, EventTypeName((EventType)t), sizeof(szEvents));
+			}
+		}
+	}
+
+	Msg("Sink %s: %s\n", GetName(), GetUrl()[0] ? GetUrl() : "(no url)");
+	Msg("- kinds: %s\n", szKinds);
+	Msg("- events: %s\n", szEvents);
+	Msg("- max_attempts %d, retry_delay %.2f, retry_max_delay %.2f\n", MaxAttempts(), RetryDelay(), RetryMaxDelay());
+	Msg("- max_inflight %d, queue_budget %u, format %s, compression %s\n", MaxInFlight(), (uint32)QueueBudget(), WireFormatName(Format()), ContentEncodingHeader(Encoding()) ? ContentEncodingHeader(Encoding()) : "none");
+	Msg("- batch_size %d, batch_delay %.2f\n", m_BatchSize, m_flBatchDelay);
+}
+
+void HTTPSink::PrintDebug() const
+{
+	float flNow = Plat_FloatTime();
+
+	Msg("HTTP sink %s: %u delivered, %u failed attempt(s), %u dropped (%u superseded)\n", GetName(), m_Delivered, m_FailedAttempts, m_Dropped, m_Replaced);
+	Msg("- circuit breaker: %s (%d consecutive failure(s))\n", BreakerStateName(m_BreakerState), m_iConsecutiveFailures);
+	if (m_BreakerState == BreakerState::Open)
+	{
+		Msg("  - probe allowed in %.1fs\n", MAX(0.0f, m_flBreakerOpenedTime + d2lobby_http_breaker_cooldown.GetFloat() - flNow));
+	}
+
+	Msg("- in flight: %u/%d\n", m_InFlightCount, MaxInFlight());
+	Msg("- queued: %u (%u/%u bytes), %u waiting on compression, %u batched\n", (uint32)m_QueuedRequests, (uint32)m_QueuedBytes, (uint32)QueueBudget(), (uint32)m_Compressing.size(), (uint32)m_Batch.size());
+	for (int l = 0; l < (int)Lane::Count; ++l)
+	{
+		auto &lane = m_Lanes[l];
+		Msg("  - %s: %u queued, %u bytes, %u dropped\n", LaneName((Lane)l), (uint32)lane.requests.size(), (uint32)lane.bytes, lane.dropped);
+		for (auto &r : lane.requests)
+		{
+			if (r.attempt > 0)
+			{
+				Msg("    - %s, %u bytes, %d attempt(s) made, last status %d, next in %.1fs\n", PayloadKindName(r.kind), r.body->Size(), r.attempt, r.status, MAX(0.0f, r.flNextAttemptTime - flNow));
+			}
+		}
+	}
+}
@@ -0,0 +1,242 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "compress.h"
+#include "payload.h"
+#include "wireformat.h"
+
+#include <basetypes.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+// What a payload is. Decides which lane it is queued in and which sinks
+// take it.
+enum class PayloadKind : uint8
+{
+	Startup,
+	Events,
+	Update,
+	Completed,
+	LoadFailed,
+	Shutdown,
+
+	Count
+};
+
+static const uint32 kAllPayloadKinds = (1 << (int)PayloadKind::Count) - 1;
+
+const char *PayloadKindName(PayloadKind kind);
+
+// Parses a comma separated list of kind names, or "all".
+bool PayloadKindMaskFromString(const char *pszKinds, uint32 &mask);
+
+struct QueuedRequest
+{
+	PayloadRef body;
+	// Spool records delivered by this request. More than one when batched.
+	std::vector<uint64> spoolIds;
+	PayloadKind kind = PayloadKind::Events;
+	WireFormat format = WireFormat::JSON;
+	ContentEncoding encoding = ContentEncoding::Identity;
+	int attempt = 0;
+	float flNextAttemptTime = 0.0f;
+
+	// Of the latest attempt, except enqueue time which is when the payload
+	// was first posted. Doubles since these feed millisecond histograms and
+	// a float loses that precision after a few hours.
+	double flEnqueueTime = 0.0;
+	double flSendTime = 0.0;
+	double flCompleteTime = 0.0;
+	int status = 0;
+
+	// Live scoreboard updates with a seq. A delta has the seq it applies
+	// to as its base, a keyframe has none.
+	uint32 liveSeq = 0;
+	uint32 liveBaseSeq = 0;
+
+	// Sent through the discard transport whatever d2lobby_http_transport
+	// is, and never spooled. Set for what a capture replay posts.
+	bool bDiscard = false;
+};
+
+// One destination for payloads, with its own url, kind filter, queues,
+// retry policy, circuit breaker and batching. Sinks never wait on each
+// other. Settings left unset fall back to the d2lobby_http_* convars.
+class HTTPSink
+{
+public:
+	// The match sink posts to match_post_url unless given a url of its own.
+	HTTPSink(const char *pszName, bool bMatchSink);
+
+	const char *GetName() const { return m_Name.c_str(); }
+	const char *GetUrl() const;
+	bool IsMatchSink() const { return m_bMatchSink; }
+	bool Accepts(PayloadKind kind) const;
+	// The event types wanted in events payloads, as an EventType bitmask.
+	uint32 EventMask() const { return m_EventMask; }
+	WireFormat Format() const;
+
+	// Applies one d2lobby_sink_set option. Returns false if it's unknown or
+	// the value doesn't parse.
+	bool SetOption(const char *pszOption, const char *pszValue);
+
+	void Admit(const QueuedRequest &req);
+	// Takes the compression result if it is for this sink's oldest job.
+	bool TakeCompressed(BodyCompressor::Result &result);
+	void RunFrame();
+	void Pump();
+
+	void OnRequestCompleted(QueuedRequest &req, bool bProbe, bool bSuccess);
+
+	bool HasAnyPending() const { return m_InFlightCount > 0 || m_QueuedRequests > 0 || m_Compressing.size() > 0 || m_Batch.size() > 0; }
+	bool HasOutstanding(PayloadKind kind) const { return m_Outstanding[(int)kind] > 0; }
+	// Seq of the last live update admitted, or 0 if it has none that later
+	// deltas can apply to.
+	uint32 LiveSeq() const { return m_LiveSeq; }
+
+	// Appends the spool ids of everything batched, being compressed or
+	// queued. In-flight requests are tracked by the caller.
+	void GetPendingSpoolIds(std::vector<uint64> &spoolIds) const;
+	void PrintSettings() const;
+	void PrintDebug() const;
+
+	// Whether payloads of this kind are written to the spool before sending.
+	static bool IsSpooled(PayloadKind kind);
+private:
+	// Lanes are serviced strictly in this order.
+	enum class Lane
+	{
+		MatchResult,
+		Lifecycle,
+		Events,
+		LiveStats,
+
+		Count
+	};
+
+	// What to do with a lane's queued bodies when over the memory budget.
+	enum class DropPolicy
+	{
+		Never,
+		// Oldest first. They stay unacknowledged in the spool and are sent
+		// again to this sink on the next load.
+		DropOldest,
+		// Live state that the source regenerates. Never spooled or retried,
+		// sent one at a time, replaced when a full update is queued behind
+		// it, and the sink takes a keyframe next when one is lost.
+		DropSuperseded,
+	};
+
+	struct CompressingRequest
+	{
+		uint64 ticket;
+		QueuedRequest request;
+	};
+
+	struct LaneQueue
+	{
+		std::deque<QueuedRequest> requests;
+		size_t bytes = 0;
+		uint32 dropped = 0;
+	};
+
+	enum class BreakerState
+	{
+		Closed,
+		Open,
+		HalfOpen,
+	};
+private:
+	void FlushBatch();
+	void Compress(const QueuedRequest &req);
+	void Enqueue(const QueuedRequest &req);
+	bool PopNextDue(float flNow, QueuedRequest &req);
+	void EnforceQueueBudget();
+	bool SendRequest(const QueuedRequest &req, bool bProbe);
+	void OnRequestSucceeded(const QueuedRequest &req, bool bProbe);
+	void OnRequestFailed(QueuedRequest &req, bool bProbe);
+	void Drop(const QueuedRequest &req);
+	void Retire(const QueuedRequest &req);
+
+	int MaxAttempts() const;
+	float RetryDelay() const;
+	float RetryMaxDelay() const;
+	int MaxInFlight() const;
+	size_t QueueBudget() const;
+	ContentEncoding Encoding() const;
+
+	static Lane LaneForKind(PayloadKind kind);
+	static DropPolicy LaneDropPolicy(Lane lane);
+	static const char *LaneName(Lane lane);
+	static const char *BreakerStateName(BreakerState state);
+private:
+	std::string m_Name;
+	bool m_bMatchSink;
+
+	// Settings. Negative or empty means use the convar.
+	std::string m_Url;
+	uint32 m_KindMask = kAllPayloadKinds;
+	uint32 m_EventMask;
+	int m_MaxAttempts = -1;
+	float m_flRetryDelay = -1.0f;
+	float m_flRetryMaxDelay = -1.0f;
+	int m_MaxInFlight = -1;
+	int m_QueueBudget = -1;
+	std::string m_Compression;
+	std::string m_Format;
+	// Event payloads are held until this many are waiting or the oldest has
+	// waited batch_delay seconds, then their events are merged into one
+	// payload.
+	int m_BatchSize = 1;
+	float m_flBatchDelay = 0.0f;
+
+	std::vector<QueuedRequest> m_Batch;
+	double m_flBatchStartTime = 0.0;
+	std::deque<CompressingRequest> m_Compressing;
+	LaneQueue m_Lanes[(int)Lane::Count];
+	size_t m_QueuedRequests = 0;
+	size_t m_QueuedBytes = 0;
+	uint32 m_InFlightCount = 0;
+	uint32 m_Outstanding[(int)PayloadKind::Count] = {};
+	uint32 m_LiveSeq = 0;
+	// Live updates go out one at a time, so they can't land out of order.
+	bool m_bLiveInFlight = false;
+
+	BreakerState m_BreakerState = BreakerState::Closed;
+	int m_iConsecutiveFailures = 0;
+	float m_flBreakerOpenedTime = 0.0f;
+	bool m_bProbeInFlight = false;
+
+	uint32 m_Delivered = 0;
+	uint32 m_FailedAttempts = 0;
+	uint32 m_Dropped = 0;
+	uint32 m_Replaced = 0;
+	bool m_bWarnedOverBudget = false;
+};
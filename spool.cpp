@@ -0,0 +1,464 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+#include "spool.h"
+
+#include "d2lobby.h"
+#include "util.h"
+
+#include <filesystem.h>
+
+#include <algorithm>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+static ConVar d2lobby_spool_segment_size("d2lobby_spool_segment_size", "1048576", FCVAR_RELEASE, "Size in bytes at which a new spool segment is started");
+static ConVar d2lobby_spool_commit_interval("d2lobby_spool_commit_interval", "50", FCVAR_RELEASE, "Milliseconds between spool group commits", true, 1.0f, false, 0.0f);
+
+PayloadSpool g_PayloadSpool;
+
+#define SPOOL_DIR "d2lobby_logs/spool"
+
+static const uint32 kSpoolMagic = 0x534C3244; // "D2LS"
+static const size_t kEagerCommitBytes = 256 * 1024;
+
+enum SpoolRecordType : uint8
+{
+	kSpoolRecordData = 1,
+	kSpoolRecordAck = 2,
+	kSpoolRecordSettled = 3,
+};
+
+struct SpoolRecordHeader
+{
+	uint32 magic;
+	uint8 type;
+	uint8 kind;
+	uint8 reserved[2];
+	uint32 length;
+	uint32 crc;
+	uint64 id;
+};
+
+static uint32 SpoolCRC32(const char *pData, size_t len)
+{
+	static uint32 table[256];
+	static bool bTableBuilt = false;
+	if (!bTableBuilt)
+	{
+		for (uint32 i = 0; i < 256; ++i)
+		{
+			uint32 c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : (c >> 1);
+			table[i] = c;
+		}
+		bTableBuilt = true;
+	}
+
+	uint32 crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < len; ++i)
+		crc = table[(crc ^ (uint8)pData[i]) & 0xFF] ^ (crc >> 8);
+
+	return crc ^ 0xFFFFFFFF;
+}
+
+static void SyncFile(FILE *f)
+{
+	fflush(f);
+#ifdef _WIN32
+	_commit(_fileno(f));
+#else
+	fsync(fileno(f));
+#endif
+}
+
+bool PayloadSpool::Open(std::vector<Record> &replay)
+{
+	filesystem->CreateDirHierarchy(SPOOL_DIR, "DEFAULT_WRITE_PATH");
+	if (!filesystem->RelativePathToFullPath(SPOOL_DIR, "DEFAULT_WRITE_PATH", m_szSpoolPath, sizeof(m_szSpoolPath)))
+	{
+		UTIL_MsgAndLog("Couldn't resolve \"" SPOOL_DIR "\", outgoing payloads will not be spooled\n");
+		return false;
+	}
+
+	std::vector<uint32> segments;
+	FileFindHandle_t hFind;
+	for (const char *pszFile = filesystem->FindFirstEx(SPOOL_DIR "/*.spl", "DEFAULT_WRITE_PATH", &hFind); pszFile; pszFile = filesystem->FindNext(hFind))
+	{
+		uint32 segment = strtoul(pszFile, nullptr, 10);
+		if (segment)
+			segments.push_back(segment);
+	}
+	filesystem->FindClose(hFind);
+
+	std::sort(segments.begin(), segments.end());
+
+	std::map<uint64, Record> records;
+	for (uint32 segment : segments)
+	{
+		ReadSegment(segment, records);
+	}
+
+	for (auto &r : records)
+	{
+		replay.push_back(std::move(r.second));
+	}
+
+	// Always start a fresh segment rather than appending after a possibly torn tail.
+	m_CurrentSegment = segments.empty() ? 1 : segments.back() + 1;
+	m_CurrentSegmentBytes = 0;
+	m_LiveRecords[m_CurrentSegment] = 0;
+
+	m_CommitIntervalMs = d2lobby_spool_commit_interval.GetInt();
+	m_bStopWriter = false;
+	m_Writer = std::thread(&PayloadSpool::WriterThread, this);
+	m_bOpen = true;
+
+	// Whatever is still unacknowledged is copied forward, so a payload that
+	// outlives a run never keeps the segments after it alive. The writer
+	// commits these before it deletes the old segments.
+	for (auto &r : replay)
+	{
+		QueueWrite(kSpoolRecordData, r.kind, r.id, r.payload);
+		for (auto &sink : r.settled)
+		{
+			QueueWrite(kSpoolRecordSettled, 0, r.id, Payload::Copy(sink.data(), sink.size()));
+		}
+
+		++m_LiveRecords[m_CurrentSegment];
+		m_RecordSegment[r.id] = m_CurrentSegment;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_PendingDeletes.insert(m_PendingDeletes.end(), segments.begin(), segments.end());
+	}
+
+	if (replay.size())
+	{
+		UTIL_LogToFile("Spool holds %u unacknowledged payload(s) from a previous run\n", (uint32)replay.size());
+	}
+
+	return true;
+}
+
+void PayloadSpool::Close()
+{
+	if (!m_bOpen)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_bStopWriter = true;
+	}
+	m_WakeWriter.notify_one();
+	m_Writer.join();
+
+	if (m_pSegmentFile)
+	{
+		fclose(m_pSegmentFile);
+		m_pSegmentFile = nullptr;
+	}
+	m_OpenSegment = 0;
+
+	m_LiveRecords.clear();
+	m_RecordSegment.clear();
+	m_bOpen = false;
+}
+
+void PayloadSpool::ReadSegment(uint32 segment, std::map<uint64, Record> &records)
+{
+	char szPath[300];
+	SegmentPath(segment, szPath, sizeof(szPath));
+
+	FILE *f = fopen(szPath, "rb");
+	if (!f)
+		return;
+
+	fseek(f, 0, SEEK_END);
+	size_t size = (size_t)ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	std::vector<char> buf(size);
+	size = fread(buf.data(), 1, size, f);
+	fclose(f);
+
+	size_t pos = 0;
+	while (pos + sizeof(SpoolRecordHeader) <= size)
+	{
+		SpoolRecordHeader hdr;
+		memcpy(&hdr, &buf[pos], sizeof(hdr));
+
+		const char *pData = &buf[pos + sizeof(hdr)];
+		if (hdr.magic != kSpoolMagic || hdr.length > size - pos - sizeof(hdr) || SpoolCRC32(pData, hdr.length) != hdr.crc)
+			break;
+
+		if (hdr.type == kSpoolRecordData)
+		{
+			auto &r = records[hdr.id];
+			r.id = hdr.id;
+			r.kind = hdr.kind;
+			r.payload = Payload::Copy(pData, hdr.length);
+		}
+		else if (hdr.type == kSpoolRecordSettled)
+		{
+			auto r = records.find(hdr.id);
+			if (r != records.end())
+			{
+				std::string sink(pData, hdr.length);
+				if (std::find(r->second.settled.begin(), r->second.settled.end(), sink) == r->second.settled.end())
+				{
+					r->second.settled.push_back(std::move(sink));
+				}
+			}
+		}
+		else if (hdr.type == kSpoolRecordAck)
+		{
+			records.erase(hdr.id);
+		}
+
+		m_NextId = MAX(m_NextId, hdr.id + 1);
+		pos += sizeof(hdr) + hdr.length;
+	}
+
+	if (pos != size)
+	{
+		UTIL_LogToFile("Spool segment %u is damaged after byte %u, ignoring the rest\n", segment, (uint32)pos);
+	}
+}
+
+uint64 PayloadSpool::Append(const PayloadRef &payload, uint8 kind)
+{
+	if (!m_bOpen)
+		return 0;
+
+	if (m_CurrentSegmentBytes >= (uint64)d2lobby_spool_segment_size.GetInt())
+	{
+		++m_CurrentSegment;
+		m_CurrentSegmentBytes = 0;
+		m_LiveRecords[m_CurrentSegment] = 0;
+		TrimSegments();
+	}
+
+	uint64 id = m_NextId++;
+	QueueWrite(kSpoolRecordData, kind, id, payload);
+
+	++m_LiveRecords[m_CurrentSegment];
+	m_RecordSegment[id] = m_CurrentSegment;
+
+	return id;
+}
+
+void PayloadSpool::Settle(uint64 id, const char *pszSink)
+{
+	if (!m_bOpen || !id || m_RecordSegment.find(id) == m_RecordSegment.end())
+		return;
+
+	QueueWrite(kSpoolRecordSettled, 0, id, Payload::Copy(pszSink, strlen(pszSink)));
+}
+
+void PayloadSpool::Acknowledge(uint64 id)
+{
+	if (!m_bOpen || !id)
+		return;
+
+	auto r = m_RecordSegment.find(id);
+	if (r == m_RecordSegment.end())
+		return;
+
+	uint32 segment = r->second;
+	m_RecordSegment.erase(r);
+
+	QueueWrite(kSpoolRecordAck, 0, id, PayloadRef());
+
+	--m_LiveRecords[segment];
+	TrimSegments();
+}
+
+void PayloadSpool::QueueWrite(uint8 type, uint8 kind, uint64 id, const PayloadRef &payload)
+{
+	size_t len = sizeof(SpoolRecordHeader) + (payload ? payload->Size() : 0);
+
+	bool bWake;
+	{
+		std::lock_guard<std::mutex> lock(m_Mutex);
+
+		PendingWrite write;
+		write.segment = m_CurrentSegment;
+		write.type = type;
+		write.kind = kind;
+		write.id = id;
+		write.payload = payload;
+		m_PendingWrites.push_back(std::move(write));
+
+		m_PendingBytes += len;
+		bWake = m_PendingBytes >= kEagerCommitBytes;
+	}
+
+	if (bWake)
+	{
+		m_WakeWriter.notify_one();
+	}
+
+	m_CurrentSegmentBytes += len;
+}
+
+void PayloadSpool::TrimSegments()
+{
+	// Only ever delete from the front. Later segments may hold acks for
+	// records in earlier ones, and dropping those acks would resurrect
+	// already delivered payloads on the next load. Records still live at
+	// the next load are carried forward, so nothing pins the front for
+	// longer than one run.
+	while (m_LiveRecords.size() > 1)
+	{
+		auto oldest = m_LiveRecords.begin();
+		if (oldest->first == m_CurrentSegment || oldest->second > 0)
+			break;
+
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_PendingDeletes.push_back(oldest->first);
+		}
+		m_LiveRecords.erase(oldest);
+	}
+}
+
+void PayloadSpool::SegmentPath(uint32 segment, char *pszPath, size_t len) const
+{
+	Q_snprintf(pszPath, len, "%s/%08u.spl", m_szSpoolPath, segment);
+}
+
+void PayloadSpool::WriterThread()
+{
+	std::vector<PendingWrite> writes;
+	std::vector<uint32> deletes;
+
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	for (;;)
+	{
+		m_WakeWriter.wait_for(lock, std::chrono::milliseconds(m_CommitIntervalMs), [this] {
+			return m_bStopWriter || m_PendingBytes >= kEagerCommitBytes;
+		});
+
+		writes.swap(m_PendingWrites);
+		deletes.swap(m_PendingDeletes);
+		m_PendingBytes = 0;
+		bool bStop = m_bStopWriter;
+
+		lock.unlock();
+
+		uint32 errors = m_WriteErrors;
+		CommitWrites(writes);
+		writes.clear();
+
+		// If a carried forward record didn't make it to disk, its old
+		// segment has to stay. The next load reads both and keeps one.
+		if (m_WriteErrors != errors)
+		{
+			deletes.clear();
+		}
+
+		for (uint32 segment : deletes)
+		{
+			if (segment == m_OpenSegment && m_pSegmentFile)
+			{
+				fclose(m_pSegmentFile);
+				m_pSegmentFile = nullptr;
+				m_OpenSegment = 0;
+			}
+
+			char szPath[300];
+			SegmentPath(segment, szPath, sizeof(szPath));
+			remove(szPath);
+		}
+		deletes.clear();
+
+		lock.lock();
+
+		if (bStop && m_PendingWrites.empty() && m_PendingDeletes.empty())
+			break;
+	}
+}
+
+void PayloadSpool::CommitWrites(std::vector<PendingWrite> &writes)
+{
+	for (auto &w : writes)
+	{
+		if (w.segment != m_OpenSegment || !m_pSegmentFile)
+		{
+			if (m_pSegmentFile)
+			{
+				SyncFile(m_pSegmentFile);
+				fclose(m_pSegmentFile);
+			}
+
+			char szPath[300];
+			SegmentPath(w.segment, szPath, sizeof(szPath));
+			m_pSegmentFile = fopen(szPath, "ab");
+			m_OpenSegment = w.segment;
+		}
+
+		const char *pData = w.payload ? w.payload->Data() : nullptr;
+		uint32 len = w.payload ? w.payload->Size() : 0;
+
+		SpoolRecordHeader hdr = {};
+		hdr.magic = kSpoolMagic;
+		hdr.type = w.type;
+		hdr.kind = w.kind;
+		hdr.length = len;
+		hdr.crc = SpoolCRC32(pData, len);
+		hdr.id = w.id;
+
+		if (!m_pSegmentFile
+			|| fwrite(&hdr, sizeof(hdr), 1, m_pSegmentFile) != 1
+			|| (len && fwrite(pData, 1, len, m_pSegmentFile) != len))
+		{
+			++m_WriteErrors;
+		}
+	}
+
+	if (m_pSegmentFile && writes.size())
+	{
+		SyncFile(m_pSegmentFile);
+	}
+}
+
+void PayloadSpool::PrintDebug() const
+{
+	if (!m_bOpen)
+	{
+		Msg("Payload spool: not open\n");
+		return;
+	}
+
+	Msg("Payload spool: %u unacknowledged record(s) across %u segment(s), writing segment %u (%u write error(s))\n",
+		(uint32)m_RecordSegment.size(), (uint32)m_LiveRecords.size(), m_CurrentSegment, (uint32)m_WriteErrors);
+}
@@ -0,0 +1,124 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+#pragma once
+
+#include "payload.h"
+
+#include <basetypes.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Append-only store for outgoing payloads, kept in numbered segment files
+// under d2lobby_logs/spool. Every payload is written before it is sent. Each
+// sink that delivers it or gives up on it writes a settled record, and an
+// ack record is written once every sink it went to is done with it. Anything
+// without an ack is handed back for resending the next time the plugin
+// loads, along with the sinks that already settled it.
+//
+// Writes are buffered and committed (write + fsync) by a background thread
+// every few milliseconds, so the game thread never blocks on disk I/O.
+class PayloadSpool
+{
+public:
+	struct Record
+	{
+		uint64 id;
+		uint8 kind;
+		PayloadRef payload;
+		// Names of the sinks that delivered or gave up on it.
+		std::vector<std::string> settled;
+	};
+public:
+	// Opens the spool and fills replay with payloads left unacknowledged by
+	// an earlier run, oldest first. They are carried forward into a fresh
+	// segment and the old segments are deleted.
+	bool Open(std::vector<Record> &replay);
+	void Close();
+
+	bool IsOpen() const { return m_bOpen; }
+
+	// Returns the record id to acknowledge, or 0 if the spool isn't open.
+	uint64 Append(const PayloadRef &payload, uint8 kind);
+	// Records that one sink is done with it, so it isn't resent there.
+	void Settle(uint64 id, const char *pszSink);
+	void Acknowledge(uint64 id);
+
+	void PrintDebug() const;
+private:
+	// Headers are built and checksummed on the writer thread. The payload
+	// bytes are written straight from the shared buffer.
+	struct PendingWrite
+	{
+		uint32 segment;
+		uint8 type;
+		uint8 kind;
+		uint64 id;
+		// Empty for acks, the sink name for settled records
+		PayloadRef payload;
+	};
+private:
+	void ReadSegment(uint32 segment, std::map<uint64, Record> &records);
+	void QueueWrite(uint8 type, uint8 kind, uint64 id, const PayloadRef &payload);
+	void TrimSegments();
+	void SegmentPath(uint32 segment, char *pszPath, size_t len) const;
+	void WriterThread();
+	void CommitWrites(std::vector<PendingWrite> &writes);
+private:
+	bool m_bOpen = false;
+	char m_szSpoolPath[260];
+
+	// Game thread state
+	uint64 m_NextId = 1;
+	uint32 m_CurrentSegment = 0;
+	uint64 m_CurrentSegmentBytes = 0;
+	std::map<uint32, uint32> m_LiveRecords;
+	std::unordered_map<uint64, uint32> m_RecordSegment;
+
+	// Shared with the writer thread
+	std::mutex m_Mutex;
+	std::condition_variable m_WakeWriter;
+	std::vector<PendingWrite> m_PendingWrites;
+	std::vector<uint32> m_PendingDeletes;
+	size_t m_PendingBytes = 0;
+	bool m_bStopWriter = false;
+
+	// Writer thread state
+	std::thread m_Writer;
+	FILE *m_pSegmentFile = nullptr;
+	uint32 m_OpenSegment = 0;
+	int m_CommitIntervalMs = 50;
+	std::atomic<uint32> m_WriteErrors{ 0 };
+};
+
+extern PayloadSpool g_PayloadSpool;
@@ -0,0 +1,332 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "transport.h"
+
+#include "d2lobby.h"
+#include "util.h"
+
+#include <vstdlib/random.h>
+
+#include <inttypes.h>
+
+#include <queue>
+#include <vector>
+
+static ConVar d2lobby_http_sim_latency_min("d2lobby_http_sim_latency_min", "0.05", FCVAR_RELEASE, "Simulated transport: minimum seconds before a request completes", true, 0.0f, false, 0.0f);
+static ConVar d2lobby_http_sim_latency_max("d2lobby_http_sim_latency_max", "0.2", FCVAR_RELEASE, "Simulated transport: maximum seconds before a request completes", true, 0.0f, false, 0.0f);
+static ConVar d2lobby_http_sim_failure_rate("d2lobby_http_sim_failure_rate", "0.0", FCVAR_RELEASE, "Simulated transport: fraction of requests that fail. 1 simulates an outage", true, 0.0f, true, 1.0f);
+static ConVar d2lobby_http_sim_failure_status("d2lobby_http_sim_failure_status", "503", FCVAR_RELEASE, "Simulated transport: status code of failed requests. 0 simulates no response at all");
+
+class CSteamHTTPTransport : public IHTTPTransport
+{
+public:
+	const char *GetName() const override { return "steam"; }
+	bool IsAvailable() const override { return http != nullptr; }
+	bool Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler) override;
+	void CancelAll() override;
+	void PrintDebug() const override;
+private:
+	class Request
+	{
+	public:
+		Request(const Request &) = delete;
+		Request(CSteamHTTPTransport *pTransport, uint64 requestId, HTTPRequestHandle hReq, SteamAPICall_t hCall, const PayloadRef &body, IHTTPCompletionHandler *pHandler);
+		~Request();
+	private:
+		void OnHTTPRequestCompleted(HTTPRequestCompleted_t *arg, bool bFailed);
+	private:
+		friend class CSteamHTTPTransport;
+
+		CSteamHTTPTransport *m_pTransport;
+		uint64 m_RequestId;
+		HTTPRequestHandle m_hHTTPReq;
+		CCallResult<Request, HTTPRequestCompleted_t> m_CallResult;
+		// Kept alive until Steam is done with the request.
+		PayloadRef m_Body;
+		IHTTPCompletionHandler *m_pHandler;
+		// Index in m_Requests, for O(1) removal.
+		size_t m_iSlot;
+	};
+private:
+	std::vector<Request *> m_Requests;
+	std::vector<uint8> m_Response;
+};
+
+CSteamHTTPTransport::Request::Request(CSteamHTTPTransport *pTransport, uint64 requestId, HTTPRequestHandle hReq, SteamAPICall_t hCall, const PayloadRef &body, IHTTPCompletionHandler *pHandler)
+{
+	m_pTransport = pTransport;
+	m_RequestId = requestId;
+	m_hHTTPReq = hReq;
+	m_Body = body;
+	m_pHandler = pHandler;
+
+	m_CallResult.SetGameserverFlag();
+	m_CallResult.Set(hCall, this, &Request::OnHTTPRequestCompleted);
+
+	m_iSlot = m_pTransport->m_Requests.size();
+	m_pTransport->m_Requests.push_back(this);
+}
+
+CSteamHTTPTransport::Request::~Request()
+{
+	auto &requests = m_pTransport->m_Requests;
+
+	Request *pLast = requests.back();
+	requests[m_iSlot] = pLast;
+	pLast->m_iSlot = m_iSlot;
+	requests.pop_back();
+
+	if (http)
+	{
+		http->ReleaseHTTPRequest(m_hHTTPReq);
+	}
+}
+
+void CSteamHTTPTransport::Request::OnHTTPRequestCompleted(HTTPRequestCompleted_t *arg, bool bFailed)
+{
+	int status = bFailed ? 0 : (int)arg->m_eStatusCode;
+
+	auto &response = m_pTransport->m_Response;
+	response.clear();
+
+	uint32 size;
+	if (!bFailed && http->GetHTTPResponseBodySize(arg->m_hRequest, &size) && size)
+	{
+		response.resize(size);
+		if (!http->GetHTTPResponseBodyData(arg->m_hRequest, response.data(), size))
+		{
+			response.clear();
+		}
+	}
+
+	// The handler may start new requests, so this one is gone before it runs.
+	IHTTPCompletionHandler *pHandler = m_pHandler;
+	uint64 requestId = m_RequestId;
+	delete this;
+
+	pHandler->OnHTTPCompleted(requestId, status, response.data(), (uint32)response.size());
+}
+
+bool CSteamHTTPTransport::Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler)
+{
+	if (!http)
+		return false;
+
+	auto hReq = http->CreateHTTPRequest(k_EHTTPMethodPOST, post.pszUrl);
+	if (hReq == INVALID_HTTPREQUEST_HANDLE)
+		return false;
+
+	SteamAPICall_t hCall;
+	if ((!post.pszContentEncoding || http->SetHTTPRequestHeaderValue(hReq, "Content-Encoding", post.pszContentEncoding))
+		&& http->SetHTTPRequestRawPostBody(hReq, post.pszContentType, (uint8 *)post.body->Data(), post.body->Size())
+		&& http->SendHTTPRequest(hReq, &hCall))
+	{
+		new Request(this, requestId, hReq, hCall, post.body, pHandler);
+		return true;
+	}
+
+	http->ReleaseHTTPRequest(hReq);
+	return false;
+}
+
+void CSteamHTTPTransport::CancelAll()
+{
+	while (m_Requests.size())
+	{
+		delete m_Requests.back();
+	}
+}
+
+void CSteamHTTPTransport::PrintDebug() const
+{
+	Msg("Steam HTTP transport: %u request(s) outstanding\n", (uint32)m_Requests.size());
+}
+
+class CSimulatedHTTPTransport : public IHTTPTransport
+{
+public:
+	const char *GetName() const override { return "simulated"; }
+	bool IsAvailable() const override { return true; }
+	bool Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler) override;
+	void RunFrame() override;
+	void CancelAll() override;
+	void PrintDebug() const override;
+private:
+	struct Request
+	{
+		double flCompleteTime;
+		uint64 requestId;
+		int status;
+		IHTTPCompletionHandler *pHandler;
+
+		bool operator>(const Request &other) const { return flCompleteTime > other.flCompleteTime; }
+	};
+private:
+	std::priority_queue<Request, std::vector<Request>, std::greater<Request>> m_Requests;
+
+	uint32 m_Succeeded = 0;
+	uint32 m_Failed = 0;
+	uint64 m_BytesReceived = 0;
+};
+
+bool CSimulatedHTTPTransport::Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler)
+{
+	float flLatencyMin = d2lobby_http_sim_latency_min.GetFloat();
+	float flLatencyMax = MAX(flLatencyMin, d2lobby_http_sim_latency_max.GetFloat());
+
+	Request req;
+	req.flCompleteTime = Plat_FloatTime() + RandomFloat(flLatencyMin, flLatencyMax);
+	req.requestId = requestId;
+	req.status = RandomFloat(0.0f, 1.0f) < d2lobby_http_sim_failure_rate.GetFloat() ? d2lobby_http_sim_failure_status.GetInt() : 200;
+	req.pHandler = pHandler;
+	m_Requests.push(req);
+
+	m_BytesReceived += post.body->Size();
+
+	return true;
+}
+
+void CSimulatedHTTPTransport::RunFrame()
+{
+	static const uint8 kAccepted[] = { 'o', 'k' };
+
+	double flNow = Plat_FloatTime();
+	while (m_Requests.size() && m_Requests.top().flCompleteTime <= flNow)
+	{
+		// Popped first, since the handler may post again.
+		Request req = m_Requests.top();
+		m_Requests.pop();
+
+		if (req.status == 200)
+		{
+			++m_Succeeded;
+			req.pHandler->OnHTTPCompleted(req.requestId, req.status, kAccepted, sizeof(kAccepted));
+		}
+		else
+		{
+			++m_Failed;
+			req.pHandler->OnHTTPCompleted(req.requestId, req.status, nullptr, 0);
+		}
+	}
+}
+
+void CSimulatedHTTPTransport::CancelAll()
+{
+	m_Requests = decltype(m_Requests)();
+}
+
+void CSimulatedHTTPTransport::PrintDebug() const
+{
+	Msg("Simulated HTTP transport: %u request(s) outstanding, %u succeeded, %u failed, %" PRIu64 " bytes received\n",
+		(uint32)m_Requests.size(), m_Succeeded, m_Failed, m_BytesReceived);
+}
+
+// Accepts every request and completes it on the next frame without
+// sending anything.
+class CDiscardHTTPTransport : public IHTTPTransport
+{
+public:
+	const char *GetName() const override { return "discard"; }
+	bool IsAvailable() const override { return true; }
+	bool Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler) override;
+	void RunFrame() override;
+	void CancelAll() override;
+	void PrintDebug() const override;
+private:
+	struct Request
+	{
+		uint64 requestId;
+		IHTTPCompletionHandler *pHandler;
+	};
+private:
+	std::vector<Request> m_Requests;
+	std::vector<Request> m_Completing;
+
+	uint32 m_Completed = 0;
+	uint64 m_BytesReceived = 0;
+};
+
+bool CDiscardHTTPTransport::Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler)
+{
+	m_Requests.push_back({ requestId, pHandler });
+	m_BytesReceived += post.body->Size();
+	return true;
+}
+
+void CDiscardHTTPTransport::RunFrame()
+{
+	static const uint8 kAccepted[] = { 'o', 'k' };
+
+	// Swapped out first, since the handler may post again.
+	m_Completing.swap(m_Requests);
+	for (auto &req : m_Completing)
+	{
+		++m_Completed;
+		req.pHandler->OnHTTPCompleted(req.requestId, 200, kAccepted, sizeof(kAccepted));
+	}
+	m_Completing.clear();
+}
+
+void CDiscardHTTPTransport::CancelAll()
+{
+	m_Requests.clear();
+}
+
+void CDiscardHTTPTransport::PrintDebug() const
+{
+	Msg("Discard HTTP transport: %u request(s) outstanding, %u completed, %" PRIu64 " bytes received\n",
+		(uint32)m_Requests.size(), m_Completed, m_BytesReceived);
+}
+
+IHTTPTransport *SteamHTTPTransport()
+{
+	static CSteamHTTPTransport s_Transport;
+	return &s_Transport;
+}
+
+IHTTPTransport *SimulatedHTTPTransport()
+{
+	static CSimulatedHTTPTransport s_Transport;
+	return &s_Transport;
+}
+
+IHTTPTransport *DiscardHTTPTransport()
+{
+	static CDiscardHTTPTransport s_Transport;
+	return &s_Transport;
+}
+
+IHTTPTransport *HTTPTransportByName(const char *pszName)
+{
+	if (!V_stricmp(pszName, "simulated"))
+		return SimulatedHTTPTransport();
+
+	if (!V_stricmp(pszName, "discard"))
+		return DiscardHTTPTransport();
+
+	return SteamHTTPTransport();
+}
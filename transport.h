@@ -0,0 +1,84 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "payload.h"
+
+#include <basetypes.h>
+
+struct HTTPPost
+{
+	const char *pszUrl;
+	const char *pszContentType;
+	// nullptr if the body isn't encoded
+	const char *pszContentEncoding;
+	PayloadRef body;
+};
+
+class IHTTPCompletionHandler
+{
+public:
+	// Called on the game thread. status is 0 if no response was received.
+	virtual void OnHTTPCompleted(uint64 requestId, int status, const uint8 *pResponse, uint32 responseSize) = 0;
+};
+
+// Where HTTPManager sends its requests.
+class IHTTPTransport
+{
+public:
+	virtual ~IHTTPTransport() {}
+	virtual const char *GetName() const = 0;
+	virtual bool IsAvailable() const = 0;
+	// Returns false if the request couldn't be started, in which case the
+	// handler is never called for it.
+	virtual bool Post(uint64 requestId, const HTTPPost &post, IHTTPCompletionHandler *pHandler) = 0;
+	// For transports that don't complete requests from Steam callbacks.
+	virtual void RunFrame() {}
+	// Drops all outstanding requests without calling their handlers.
+	virtual void CancelAll() = 0;
+	virtual void PrintDebug() const {}
+};
+
+// Posts through ISteamHTTP.
+IHTTPTransport *SteamHTTPTransport();
+
+// Completes requests in memory after a configurable latency and with a
+// configurable failure rate, for exercising queueing, retries and batching
+// without a backend.
+IHTTPTransport *SimulatedHTTPTransport();
+
+// Completes every request successfully on the next frame without sending
+// it, for measuring the cost of everything up to the wire.
+//
+// Neither needs a backend, but both still run inside the plugin on a loaded
+// server. They complete requests from HTTPManager's game frame and read
+// their settings from convars, so there is no standalone build of them.
+IHTTPTransport *DiscardHTTPTransport();
+
+// Picks a transport by name (d2lobby_http_transport). Unknown names give
+// the Steam transport.
+IHTTPTransport *HTTPTransportByName(const char *pszName);
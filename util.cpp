@@ -26,7 +26,7 @@
 #include "util.h"
 #include "d2lobby.h"
 
-#include "lobbymgr.h"
+#include "identity.h"
 
 #if defined( _WIN32 )
 #include <Windows.h>
@@ -113,86 +113,10 @@ void *UTIL_FindAddress(void *startAddr, const char *sig, size_t len)
 
 bool UTIL_IsPlayerConnected(CEntityIndex idx)
 {
-	static ScriptVariant_t ret;
-
-	static HSCRIPT hCDOTA_PlayerResource = INVALID_HSCRIPT;
-	if (hCDOTA_PlayerResource == INVALID_HSCRIPT)
-	{
-		ScriptVariant_t varPRClassDef;
-		scriptvm->GetValue("CDOTA_PlayerResource", &varPRClassDef);
-		hCDOTA_PlayerResource = varPRClassDef.m_hScript;
-	}
-
-	static HSCRIPT hGetConnectionState = scriptvm->LookupFunction("GetConnectionState", hCDOTA_PlayerResource);
-
-	static HSCRIPT hPlayerResource = INVALID_HSCRIPT;
-	if (hPlayerResource == INVALID_HSCRIPT)
-	{
-		scriptvm->GetValue("PlayerResource", &ret);
-		hPlayerResource = ret.m_hScript;
-	}
-
-	static HSCRIPT hEntIndexToHScript = scriptvm->LookupFunction("EntIndexToHScript");
-
-	static HSCRIPT hCBaseEntity = INVALID_HSCRIPT;
-	if (hCBaseEntity == INVALID_HSCRIPT)
-	{
-		ScriptVariant_t varCBEClassDef;
-		scriptvm->GetValue("CBaseEntity", &varCBEClassDef);
-		hCBaseEntity = varCBEClassDef.m_hScript;
-	}
-
-	static HSCRIPT hIsPlayer = scriptvm->LookupFunction("IsPlayer", hCBaseEntity);
-
-	static HSCRIPT hCDOTAPlayer = INVALID_HSCRIPT;
-	if (hCDOTAPlayer == INVALID_HSCRIPT)
-	{
-		ScriptVariant_t varCDPClassDef;
-		scriptvm->GetValue("CDOTAPlayer", &varCDPClassDef);
-		hCDOTAPlayer = varCDPClassDef.m_hScript;
-	}
-
-	static HSCRIPT hGetPlayerID = scriptvm->LookupFunction("GetPlayerID", hCDOTAPlayer);
-
-	scriptvm->Call<int>(hEntIndexToHScript, nullptr, true, &ret, idx.Get());
-	HSCRIPT hPlayer = ret.m_hScript;
-	if (hPlayer == INVALID_HSCRIPT)
-		return false;
-
-	scriptvm->Call<HSCRIPT>(hIsPlayer, nullptr, true, &ret, hPlayer);
-	if (!ret.m_bool)
-		return false;
-
-	scriptvm->Call<HSCRIPT>(hGetPlayerID, nullptr, true, &ret, hPlayer);
-	int playerId = (int)ret.m_float64;
-
-	scriptvm->Call<HSCRIPT, int>(hGetConnectionState, nullptr, true, &ret, hPlayerResource, playerId);
-
-	if ((DOTAConnectionState_t)(int)ret.m_float64 != DOTA_CONNECTION_STATE_CONNECTED)
-		return false;
-
-	return true;
+	return g_PlayerIdentities.IsConnected(idx);
 }
 
 CSteamID UTIL_PlayerIdToSteamId(int playerId)
 {
-	// Look up class def. It is the scope when looking up a class func.
-	// Then look up the class instance var. It is prepended to args when calling a class func, like a thiscall.
-
-	ScriptVariant_t varPRClassDef;
-	scriptvm->GetValue("CDOTA_PlayerResource", &varPRClassDef);
-
-	HSCRIPT hPRClassScope = varPRClassDef.m_hScript;
-	HSCRIPT steamAccountId = scriptvm->LookupFunction("GetSteamAccountID", hPRClassScope);
-
-	ScriptVariant_t varPRInstance;
-	scriptvm->GetValue("PlayerResource", &varPRInstance);
-
-	HSCRIPT hPRIntance = varPRInstance.m_hScript;
-
-	ScriptVariant_t ret;
-	scriptvm->Call<HSCRIPT, int>(steamAccountId, nullptr, true, &ret, hPRIntance, playerId);
-	AccountID_t acctId = (AccountID_t)ret.m_float64;
-
-	return g_LobbyMgr.MemberSteamIdFromAccountId(acctId);
+	return g_PlayerIdentities.SteamIdFromPlayerId(playerId);
 }
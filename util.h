@@ -40,6 +40,20 @@ void UTIL_MsgAndLog(const char *pMsg, Ts ... ts)
 	g_Logger.LogToFilef(pMsg, ts...);
 }
 
+template <typename ... Ts>
+void UTIL_LogPayloadToFile(const Payload &payload, const char *pMsg, Ts ... ts)
+{
+	g_Logger.LogPayloadf(payload, pMsg, ts...);
+}
+
+template <typename ... Ts>
+void UTIL_MsgAndLogPayload(const Payload &payload, const char *pMsg, Ts ... ts)
+{
+	Msg(pMsg, ts...);
+	Msg("%s\n", payload.Data());
+	g_Logger.LogPayloadf(payload, pMsg, ts...);
+}
+
 void *UTIL_FindAddress(void *startAddr, const char *sig, size_t len);
 
 bool UTIL_IsPlayerConnected(CEntityIndex idx);
@@ -0,0 +1,688 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#include "wireformat.h"
+
+#include "compress.h"
+#include "d2lobby.h"
+#include "lobbymgr.h"
+#include "util.h"
+
+#include <filesystem.h>
+#include <tier1/utlbuffer.h>
+
+#include <jansson.h>
+
+#include <vector>
+
+const char *WireFormatName(WireFormat format)
+{
+	switch (format)
+	{
+	case WireFormat::JSON:
+		return "json";
+	case WireFormat::MessagePack:
+		return "msgpack";
+	default:
+		return "unknown";
+	}
+}
+
+WireFormat WireFormatFromName(const char *pszName)
+{
+	if (!V_stricmp(pszName, "msgpack"))
+		return WireFormat::MessagePack;
+
+	return WireFormat::JSON;
+}
+
+const char *WireFormatContentType(WireFormat format)
+{
+	switch (format)
+	{
+	case WireFormat::MessagePack:
+		return "application/msgpack";
+	case WireFormat::JSON:
+	default:
+		return "application/json";
+	}
+}
+
+PayloadRef EncodePayload(const json_t *pJson, WireFormat format)
+{
+	if (format == WireFormat::JSON)
+		return Payload::FromJSON(pJson, JSON_COMPACT);
+
+	std::string out;
+	EncodeMessagePack(pJson, out);
+	return Payload::Copy(out.data(), out.size());
+}
+
+PayloadRef EncodePayload(const PayloadRef &json, WireFormat format)
+{
+	if (format == WireFormat::JSON)
+		return json;
+
+	json_error_t error;
+	json_t *pJson = json_loadb(json->Data(), json->Size(), 0, &error);
+	if (!pJson)
+		return PayloadRef();
+
+	PayloadRef payload = EncodePayload(pJson, format);
+	json_decref(pJson);
+	return payload;
+}
+
+static void PutBigEndian(uint64 value, int bytes, std::string &out)
+{
+	for (int i = bytes - 1; i >= 0; --i)
+	{
+		out += (char)(uint8)(value >> (i * 8));
+	}
+}
+
+// Shared by strings, arrays and maps, which only differ in their tags.
+static void PutLength(uint32 len, uint32 fixLimit, uint8 fixTag, uint8 tag8, uint8 tag16, uint8 tag32, std::string &out)
+{
+	if (len < fixLimit)
+	{
+		out += (char)(fixTag | len);
+	}
+	else if (tag8 && len <= 0xFF)
+	{
+		out += (char)tag8;
+		PutBigEndian(len, 1, out);
+	}
+	else if (len <= 0xFFFF)
+	{
+		out += (char)tag16;
+		PutBigEndian(len, 2, out);
+	}
+	else
+	{
+		out += (char)tag32;
+		PutBigEndian(len, 4, out);
+	}
+}
+
+static void PutInteger(json_int_t value, std::string &out)
+{
+	if (value >= 0)
+	{
+		if (value <= 0x7F)
+		{
+			out += (char)value;
+		}
+		else if (value <= 0xFF)
+		{
+			out += (char)0xCC;
+			PutBigEndian(value, 1, out);
+		}
+		else if (value <= 0xFFFF)
+		{
+			out += (char)0xCD;
+			PutBigEndian(value, 2, out);
+		}
+		else if (value <= 0xFFFFFFFFLL)
+		{
+			out += (char)0xCE;
+			PutBigEndian(value, 4, out);
+		}
+		else
+		{
+			out += (char)0xCF;
+			PutBigEndian(value, 8, out);
+		}
+	}
+	else if (value >= -32)
+	{
+		out += (char)(int8)value;
+	}
+	else if (value >= -0x80)
+	{
+		out += (char)0xD0;
+		PutBigEndian((uint64)value, 1, out);
+	}
+	else if (value >= -0x8000)
+	{
+		out += (char)0xD1;
+		PutBigEndian((uint64)value, 2, out);
+	}
+	else if (value >= -0x80000000LL)
+	{
+		out += (char)0xD2;
+		PutBigEndian((uint64)value, 4, out);
+	}
+	else
+	{
+		out += (char)0xD3;
+		PutBigEndian((uint64)value, 8, out);
+	}
+}
+
+static void PutString(const char *pszValue, size_t len, std::string &out)
+{
+	PutLength((uint32)len, 32, 0xA0, 0xD9, 0xDA, 0xDB, out);
+	out.append(pszValue, len);
+}
+
+void EncodeMessagePackArrayHeader(uint32 count, std::string &out)
+{
+	PutLength(count, 16, 0x90, 0, 0xDC, 0xDD, out);
+}
+
+void EncodeMessagePack(const json_t *pJson, std::string &out)
+{
+	switch (json_typeof(pJson))
+	{
+	case JSON_OBJECT:
+	{
+		PutLength((uint32)json_object_size(pJson), 16, 0x80, 0, 0xDE, 0xDF, out);
+
+		const char *pszKey;
+		json_t *pValue;
+		json_object_foreach((json_t *)pJson, pszKey, pValue)
+		{
+			PutString(pszKey, strlen(pszKey), out);
+			EncodeMessagePack(pValue, out);
+		}
+		break;
+	}
+	case JSON_ARRAY:
+	{
+		size_t count = json_array_size(pJson);
+		EncodeMessagePackArrayHeader((uint32)count, out);
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			EncodeMessagePack(json_array_get(pJson, i), out);
+		}
+		break;
+	}
+	case JSON_STRING:
+	{
+		const char *pszValue = json_string_value(pJson);
+		PutString(pszValue, strlen(pszValue), out);
+		break;
+	}
+	case JSON_INTEGER:
+		PutInteger(json_integer_value(pJson), out);
+		break;
+	case JSON_REAL:
+	{
+		double value = json_real_value(pJson);
+		uint64 bits;
+		memcpy(&bits, &value, sizeof(bits));
+
+		out += (char)0xCB;
+		PutBigEndian(bits, 8, out);
+		break;
+	}
+	case JSON_TRUE:
+		out += (char)0xC3;
+		break;
+	case JSON_FALSE:
+		out += (char)0xC2;
+		break;
+	case JSON_NULL:
+	default:
+		out += (char)0xC0;
+		break;
+	}
+}
+
+namespace
+{
+	// Where the array under a key sits in an encoded payload: its whole
+	// extent including brackets or header, and the extent of its elements.
+	struct ArraySpan
+	{
+		size_t begin;
+		size_t elementsBegin;
+		size_t elementsEnd;
+		size_t end;
+		uint32 count;
+	};
+}
+
+static bool SkipJSONString(const char *p, size_t size, size_t &pos)
+{
+	for (++pos; pos < size; ++pos)
+	{
+		if (p[pos] == '\\')
+		{
+			++pos;
+		}
+		else if (p[pos] == '"')
+		{
+			++pos;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+// Stops at the ',', '}' or ']' that ends the value.
+static bool SkipJSONValue(const char *p, size_t size, size_t &pos)
+{
+	int depth = 0;
+	while (pos < size)
+	{
+		char c = p[pos];
+		if (c == '"')
+		{
+			if (!SkipJSONString(p, size, pos))
+				return false;
+			continue;
+		}
+
+		if (!depth && (c == ',' || c == '}' || c == ']'))
+			return true;
+
+		if (c == '{' || c == '[')
+		{
+			++depth;
+		}
+		else if (c == '}' || c == ']')
+		{
+			--depth;
+		}
+		++pos;
+	}
+
+	return false;
+}
+
+// Only compact JSON, which is all that is ever sent.
+static bool FindJSONArray(const char *p, size_t size, const char *pszKey, ArraySpan &span)
+{
+	size_t keyLen = strlen(pszKey);
+	if (!size || p[0] != '{')
+		return false;
+
+	size_t pos = 1;
+	while (pos < size && p[pos] != '}')
+	{
+		if (p[pos] == ',')
+		{
+			++pos;
+		}
+
+		if (pos >= size || p[pos] != '"')
+			return false;
+
+		size_t keyBegin = pos + 1;
+		if (!SkipJSONString(p, size, pos) || pos >= size || p[pos] != ':')
+			return false;
+
+		bool bMatch = pos - 1 - keyBegin == keyLen && !memcmp(p + keyBegin, pszKey, keyLen);
+		++pos;
+
+		if (bMatch && pos < size && p[pos] == '[')
+		{
+			span.begin = pos;
+			span.elementsBegin = ++pos;
+			span.count = 0;
+			while (pos < size && p[pos] != ']')
+			{
+				if (p[pos] == ',')
+				{
+					++pos;
+				}
+
+				if (!SkipJSONValue(p, size, pos))
+					return false;
+				++span.count;
+			}
+
+			if (pos >= size)
+				return false;
+
+			span.elementsEnd = pos;
+			span.end = pos + 1;
+			return true;
+		}
+
+		if (!SkipJSONValue(p, size, pos))
+			return false;
+	}
+
+	return false;
+}
+
+static bool GetBigEndian(const uint8 *p, size_t size, size_t &pos, int bytes, uint64 &value)
+{
+	if ((size_t)bytes > size - pos)
+		return false;
+
+	value = 0;
+	for (int i = 0; i < bytes; ++i)
+	{
+		value = (value << 8) | p[pos++];
+	}
+
+	return true;
+}
+
+enum class MessagePackType
+{
+	Scalar,
+	String,
+	Array,
+	Map,
+};
+
+// Reads the tag and length of the next value. For scalars and strings len
+// is the number of bytes that follow, for arrays and maps the number of
+// elements or pairs.
+static bool ReadMessagePackHeader(const uint8 *p, size_t size, size_t &pos, MessagePackType &type, uint64 &len)
+{
+	if (pos >= size)
+		return false;
+
+	uint8 tag = p[pos++];
+	type = MessagePackType::Scalar;
+	len = 0;
+
+	if (tag <= 0x7F || tag >= 0xE0)
+		return true;
+
+	if ((tag & 0xF0) == 0x80)
+	{
+		type = MessagePackType::Map;
+		len = tag & 0x0F;
+		return true;
+	}
+
+	if ((tag & 0xF0) == 0x90)
+	{
+		type = MessagePackType::Array;
+		len = tag & 0x0F;
+		return true;
+	}
+
+	if ((tag & 0xE0) == 0xA0)
+	{
+		type = MessagePackType::String;
+		len = tag & 0x1F;
+		return true;
+	}
+
+	switch (tag)
+	{
+	case 0xC0:
+	case 0xC2:
+	case 0xC3:
+		return true;
+	case 0xCC:
+	case 0xD0:
+		len = 1;
+		return true;
+	case 0xCD:
+	case 0xD1:
+		len = 2;
+		return true;
+	case 0xCA:
+	case 0xCE:
+	case 0xD2:
+		len = 4;
+		return true;
+	case 0xCB:
+	case 0xCF:
+	case 0xD3:
+		len = 8;
+		return true;
+	case 0xC4:
+	case 0xD9:
+		type = MessagePackType::String;
+		return GetBigEndian(p, size, pos, 1, len);
+	case 0xC5:
+	case 0xDA:
+		type = MessagePackType::String;
+		return GetBigEndian(p, size, pos, 2, len);
+	case 0xC6:
+	case 0xDB:
+		type = MessagePackType::String;
+		return GetBigEndian(p, size, pos, 4, len);
+	case 0xDC:
+		type = MessagePackType::Array;
+		return GetBigEndian(p, size, pos, 2, len);
+	case 0xDD:
+		type = MessagePackType::Array;
+		return GetBigEndian(p, size, pos, 4, len);
+	case 0xDE:
+		type = MessagePackType::Map;
+		return GetBigEndian(p, size, pos, 2, len);
+	case 0xDF:
+		type = MessagePackType::Map;
+		return GetBigEndian(p, size, pos, 4, len);
+	default:
+		// Extension types are never written.
+		return false;
+	}
+}
+
+static bool SkipMessagePackValue(const uint8 *p, size_t size, size_t &pos)
+{
+	MessagePackType type;
+	uint64 len;
+	if (!ReadMessagePackHeader(p, size, pos, type, len))
+		return false;
+
+	if (type == MessagePackType::Scalar || type == MessagePackType::String)
+	{
+		if (len > size - pos)
+			return false;
+
+		pos += (size_t)len;
+		return true;
+	}
+
+	uint64 elements = type == MessagePackType::Map ? len * 2 : len;
+	for (uint64 i = 0; i < elements; ++i)
+	{
+		if (!SkipMessagePackValue(p, size, pos))
+			return false;
+	}
+
+	return true;
+}
+
+static bool FindMessagePackArray(const uint8 *p, size_t size, const char *pszKey, ArraySpan &span)
+{
+	size_t keyLen = strlen(pszKey);
+
+	size_t pos = 0;
+	MessagePackType type;
+	uint64 pairs;
+	if (!ReadMessagePackHeader(p, size, pos, type, pairs) || type != MessagePackType::Map)
+		return false;
+
+	for (uint64 i = 0; i < pairs; ++i)
+	{
+		uint64 len;
+		if (!ReadMessagePackHeader(p, size, pos, type, len) || type != MessagePackType::String || len > size - pos)
+			return false;
+
+		bool bMatch = len == keyLen && !memcmp(p + pos, pszKey, keyLen);
+		pos += (size_t)len;
+
+		if (bMatch)
+		{
+			span.begin = pos;
+
+			uint64 count;
+			if (!ReadMessagePackHeader(p, size, pos, type, count) || type != MessagePackType::Array)
+				return false;
+
+			span.elementsBegin = pos;
+			for (uint64 e = 0; e < count; ++e)
+			{
+				if (!SkipMessagePackValue(p, size, pos))
+					return false;
+			}
+
+			span.elementsEnd = pos;
+			span.end = pos;
+			span.count = (uint32)count;
+			return true;
+		}
+
+		if (!SkipMessagePackValue(p, size, pos))
+			return false;
+	}
+
+	return false;
+}
+
+PayloadRef MergePayloadArrays(const PayloadRef *pPayloads, size_t count, const char *pszKey, WireFormat format)
+{
+	if (!count)
+		return PayloadRef();
+
+	std::vector<ArraySpan> spans(count);
+	size_t size = 0;
+	uint32 elements = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Payload &payload = *pPayloads[i];
+		bool bFound = format == WireFormat::MessagePack
+			? FindMessagePackArray((const uint8 *)payload.Data(), payload.Size(), pszKey, spans[i])
+			: FindJSONArray(payload.Data(), payload.Size(), pszKey, spans[i]);
+
+		if (!bFound)
+			return PayloadRef();
+
+		size += spans[i].elementsEnd - spans[i].elementsBegin + 1;
+		elements += spans[i].count;
+	}
+
+	const Payload &first = *pPayloads[0];
+	std::string body;
+	body.reserve(first.Size() + size + 8);
+	body.append(first.Data(), spans[0].begin);
+
+	if (format == WireFormat::MessagePack)
+	{
+		EncodeMessagePackArrayHeader(elements, body);
+		for (size_t i = 0; i < count; ++i)
+		{
+			body.append(pPayloads[i]->Data() + spans[i].elementsBegin, spans[i].elementsEnd - spans[i].elementsBegin);
+		}
+	}
+	else
+	{
+		body += '[';
+		bool bFirst = true;
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (!spans[i].count)
+				continue;
+
+			if (!bFirst)
+			{
+				body += ',';
+			}
+			bFirst = false;
+
+			body.append(pPayloads[i]->Data() + spans[i].elementsBegin, spans[i].elementsEnd - spans[i].elementsBegin);
+		}
+		body += ']';
+	}
+
+	body.append(first.Data() + spans[0].end, first.Size() - spans[0].end);
+
+	return Payload::Copy(body.data(), body.size());
+}
+
+// Encodes each given payload in every wire format and reports the size,
+// the size once gzipped and the CPU cost. Payloads can be copied out of
+// the server log, or taken from match_<id>.txt files.
+CON_COMMAND(d2lobby_wireformat_bench, "d2lobby_wireformat_bench <file> [file] ... - Compares encode cost and size of each wire format on recorded payloads")
+{
+	if (args.ArgC() < 2)
+	{
+		Msg("d2lobby_wireformat_bench <file> [file] ...\n");
+		return;
+	}
+
+	// It runs every encoder many times over on the game thread.
+	if (g_LobbyMgr.IsMatchActive())
+	{
+		Msg("Can't run the wire format bench while a match is active\n");
+		return;
+	}
+
+	static const int kIterations = 200;
+
+	for (int i = 1; i < args.ArgC(); ++i)
+	{
+		CUtlBuffer buf;
+		if (!filesystem->ReadFile(args[i], "GAME", buf))
+		{
+			Msg("Couldn't read \"%s\"\n", args[i]);
+			continue;
+		}
+
+		json_error_t error;
+		json_t *pJson = json_loadb((const char *)buf.Base(), buf.TellPut(), 0, &error);
+		if (!pJson)
+		{
+			Msg("Couldn't parse \"%s\": %s (line %d)\n", args[i], error.text, error.line);
+			continue;
+		}
+
+		// Event batches are also reported per event.
+		json_t *pEvents = json_object_get(pJson, "events");
+		size_t events = json_is_array(pEvents) ? json_array_size(pEvents) : 0;
+
+		Msg("%s: %u event(s)\n", args[i], (uint32)events);
+
+		std::vector<uint8> compressed;
+		for (int f = 0; f < (int)WireFormat::Count; ++f)
+		{
+			PayloadRef payload;
+			double flStart = Plat_FloatTime();
+			for (int n = 0; n < kIterations; ++n)
+			{
+				payload = EncodePayload(pJson, (WireFormat)f);
+			}
+			double flPerRun = (Plat_FloatTime() - flStart) / kIterations;
+
+			CompressBody(ContentEncoding::Gzip, 6, payload->Data(), payload->Size(), compressed);
+
+			Msg("- %s: %u bytes (%u gzipped), %.3fms", WireFormatName((WireFormat)f), payload->Size(), (uint32)compressed.size(), flPerRun * 1000.0);
+			if (events)
+			{
+				Msg(", %.1f bytes and %.2fus per event", (double)payload->Size() / events, flPerRun * 1000000.0 / events);
+			}
+			Msg("\n");
+		}
+
+		json_decref(pJson);
+	}
+}
@@ -0,0 +1,69 @@
+/**
+ * =============================================================================
+ * D2Lobby2
+ * Copyright (C) 2023 Nicholas Hastings
+ * =============================================================================
+ *
+ * This program is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License, version 2.0 or later, as published
+ * by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * As a special exception, you are also granted permission to link the code
+ * of this program (as well as its derivative works) to "Dota 2," the
+ * "Source Engine, and any Game MODs that run on software by the Valve Corporation.
+ * You must obey the GNU General Public License in all respects for all other
+ * code used.  Additionally, this exception is granted to all derivative works.
+ */
+
+
+#pragma once
+
+#include "payload.h"
+
+#include <basetypes.h>
+
+#include <string>
+
+struct json_t;
+
+// How request bodies are serialized. The spool and logs always hold JSON;
+// other formats are produced from the same tree just before sending.
+enum class WireFormat : uint8
+{
+	JSON,
+	MessagePack,
+
+	Count
+};
+
+const char *WireFormatName(WireFormat format);
+
+// Parses a d2lobby_http_format value. Unknown names give JSON.
+WireFormat WireFormatFromName(const char *pszName);
+
+const char *WireFormatContentType(WireFormat format);
+
+// Serializes pJson in the given format. Payloads that only exist as JSON
+// text, such as spool replays, are parsed first.
+PayloadRef EncodePayload(const json_t *pJson, WireFormat format);
+PayloadRef EncodePayload(const PayloadRef &json, WireFormat format);
+
+// Appends pJson to out as MessagePack. Integers take the smallest encoding
+// that holds them and reals are always float64.
+void EncodeMessagePack(const json_t *pJson, std::string &out);
+
+// Starts a MessagePack array. Its count elements are appended after it.
+void EncodeMessagePackArrayHeader(uint32 count, std::string &out);
+
+// Joins the arrays found under pszKey in payloads that share one container
+// layout, such as event batches, into a copy of the first container.
+// Returns an empty ref if one of them has no such array or doesn't parse.
+PayloadRef MergePayloadArrays(const PayloadRef *pPayloads, size_t count, const char *pszKey, WireFormat format);